@@ -1,18 +1,85 @@
 #pragma once
 
 #include <kazen/mesh.h>
+#include <kazen/instance.h>
+#include <kazen/bvh.h>
 #include <embree3/rtcore.h>
+#include <atomic>
+#include <memory>
+
+#define KAZEN_RAY_STREAM_SIZE 256 /* Rays handed to embree per rtcIntersect1M call */
+#define KAZEN_RAY_PACKET_SIZE 16  /* Width of the coherent ray packets (rtcIntersect16) */
 
 NAMESPACE_BEGIN(kazen)
 
+/**
+ * \brief Settings of the embree device and BVH build
+ *
+ * Read from the scene properties, the command line can override them
+ * through \ref setOverrides().
+ */
+struct AccelOptions {
+    /// Implementation of the ray queries
+    enum EBackend {
+        EEmbree = 0,      ///< Intel embree (default)
+        ENative           ///< The built-in \ref BVH
+    };
+
+    /// Quality of the BVH build (RTC_BUILD_QUALITY_*)
+    enum EBuildQuality {
+        ELowQuality = 0,  ///< Fastest build, e.g. for previews
+        EMediumQuality,
+        EHighQuality      ///< Spatial splits, fastest traversal
+    };
+
+    EBackend backend = EEmbree;
+    /// The remaining settings only apply to embree
+    EBuildQuality quality = EHighQuality;
+    /// Smaller BVH at some cost in traversal speed (RTC_SCENE_FLAG_COMPACT)
+    bool compact = false;
+    /// Avoid optimizations that lose accuracy (RTC_SCENE_FLAG_ROBUST)
+    bool robust = true;
+    /// Appended to the configuration of \c rtcNewDevice(), e.g. "isa=avx2,threads=8"
+    std::string deviceConfig;
+
+    AccelOptions() { }
+
+    /// Read the settings from properties, see \ref configure()
+    AccelOptions(const PropertyList &propList) { configure(propList); }
+
+    /**
+     * \brief Update the settings from properties, keeping those that are
+     * not set: "accel" (embree or bvh), "accelQuality" (low, medium or
+     * high), "accelCompact", "accelRobust" and "embreeConfig"
+     */
+    void configure(const PropertyList &propList);
+
+    /**
+     * \brief Set properties that take precedence over the ones of every
+     * scene loaded afterwards (e.g. from the command line)
+     */
+    static void setOverrides(const PropertyList &propList);
+
+    /// Return the properties set by \ref setOverrides()
+    static const PropertyList &getOverrides();
+
+    /// Return a string representation
+    std::string toString() const;
+};
+
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * using embree3 for fast intersection test.
- * 
+ * using embree3 for fast intersection test, or the built-in \ref BVH
+ * (see \ref AccelOptions::backend).
  */
 class Accel {
 public:
+    /// Create an acceleration data structure with the default settings
+    Accel() { }
+
+    /// Create an acceleration data structure with the given build settings
+    Accel(const AccelOptions &options) : m_options(options) { }
 
     /// Release all resources
     virtual ~Accel() { clear(); };
@@ -28,12 +95,33 @@ public:
      */
     void addMesh(Mesh *mesh);
 
+    /**
+     * \brief Register an instance of a shape group
+     *
+     * The meshes of each group are built once into an embree sub-scene,
+     * which all instances of the group share. The instance and its group
+     * must outlive the acceleration data structure.
+     */
+    void addInstance(const Instance *instance);
+
     /// Build the acceleration data structure (currently a no-op)
     void build();
 
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
+    /// Return the build settings
+    const AccelOptions &getOptions() const { return m_options; }
+
+    /// Return the time the last \ref build() took, in milliseconds
+    double getBuildTime() const { return m_buildTime; }
+
+    /// Return the bytes embree (or the built-in BVH) currently holds
+    size_t getMemoryUsage() const { return (size_t) std::max<ssize_t>(0, m_memory.load()); }
+
+    /// Return the most bytes embree held at any time, usually during the build
+    size_t getPeakMemoryUsage() const { return (size_t) std::max<ssize_t>(0, m_peakMemory.load()); }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene and
      * return detailed intersection information
@@ -46,21 +134,91 @@ public:
      *    A detailed intersection record, which will be filled by the
      *    intersection query
      *
-     * \param shadowRay
-     *    \c true if this is a shadow ray query, i.e. a query that only aims to
-     *    find out whether the ray is blocked or not without returning detailed
-     *    intersection information.
+     * \param visibility
+     *    Kind of the ray (see \ref EVisibility), meshes that are invisible
+     *    to it are ignored
      *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+    bool rayIntersect(const Ray3f &ray, Intersection &its, uint32_t visibility = EVisibleIndirect) const;
+
+    /**
+     * \brief Intersect a ray against the scene and only return the compact
+     * hit record
+     *
+     * Use \ref Mesh::computeIntersection() to get the detailed intersection
+     * information later, if it turns out to be needed.
+     */
+    bool rayIntersect(const Ray3f &ray, Hit &hit, uint32_t visibility = EVisibleIndirect) const;
+
+    /**
+     * \brief Test whether a shadow ray is blocked between \c mint and \c maxt
+     *
+     * The query stops at the first hit on a mesh visible to shadow rays
+     * and does not compute any intersection information.
+     */
+    bool rayOccluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a stream of rays against the scene
+     *
+     * Same as the single-ray version, but the rays are traced in chunks
+     * of \ref KAZEN_RAY_STREAM_SIZE through embree's stream interface.
+     *
+     * \param hits
+     *    Receives for every ray whether an intersection was found
+     *
+     * \param coherent
+     *    \c true if neighboring rays have similar origins and directions
+     *    (e.g. camera rays of a block). They are then traced as packets of
+     *    \ref KAZEN_RAY_PACKET_SIZE rays with a coherent intersect context.
+     *    Only the camera rays of wavefront rendering (\ref
+     *    RenderOptions::wavefront) are flagged coherent; the built-in BVH
+     *    ignores the flag.
+     */
+    void rayIntersect(const Ray3f *rays, Intersection *its, bool *hits, size_t count,
+                      uint32_t visibility = EVisibleIndirect, bool coherent = false) const;
+
+    /// Stream version of the compact hit query, misses have a \c nullptr mesh
+    void rayIntersect(const Ray3f *rays, Hit *hits, size_t count,
+                      uint32_t visibility = EVisibleIndirect, bool coherent = false) const;
+
+    /// Stream version of \ref rayOccluded(), traced with rtcOccluded1M
+    void rayOccluded(const Ray3f *rays, bool *occluded, size_t count) const;
 
 private:
+    /// Packet version of the stream query (see \c coherent above)
+    void rayIntersectPackets(const Ray3f *rays, Hit *hits, size_t count, uint32_t visibility) const;
+
+    /// Convert an embree hit into a compact hit record
+    void fillHit(const RTCRayHit &rayhit, Hit &hit) const;
+
+    /// Convert a hit of the built-in BVH into a compact hit record
+    void fillHit(const BVH::Result &result, Hit &hit) const;
+
+    /// Build the built-in BVH instead of the embree scene
+    void buildBVH();
+
+    /// Create a scene with the build settings
+    RTCScene newScene() const;
+
+    /// Track the allocations of the embree device
+    static bool memoryMonitor(void *ptr, ssize_t bytes, bool post);
+
     std::vector<Mesh *> m_meshes;                   ///< Meshes 
+    std::vector<const Instance *> m_instances;      ///< Instances, their geometry IDs follow the meshes
     BoundingBox3f       m_bbox;                     ///< Bounding box of the entire scene
     /// embree3 related
     RTCDevice   m_device = nullptr;
     RTCScene    m_scene = nullptr;
+    std::vector<RTCScene> m_groupScenes;            ///< Sub-scenes of the instanced shape groups
+    /// built-in backend
+    std::unique_ptr<BVH> m_bvh;                     ///< Top level, over the meshes and instances
+    std::vector<std::unique_ptr<BVH>> m_groupBVHs;  ///< Hierarchies of the instanced shape groups
+    AccelOptions m_options;                         ///< Build settings
+    double m_buildTime = 0.0;                       ///< Duration of the last build in ms
+    std::atomic<ssize_t> m_memory {0};              ///< Bytes allocated by embree
+    std::atomic<ssize_t> m_peakMemory {0};          ///< Most bytes allocated by embree at once
 };
 
 NAMESPACE_END(kazen)
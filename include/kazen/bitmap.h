@@ -5,6 +5,15 @@
 
 NAMESPACE_BEGIN(kazen)
 
+/// Extra image channel stored along with the color of an EXR (e.g. an AOV)
+struct BitmapChannel {
+    /// Channel name, a dot separates the layer (e.g. "cost.time")
+    std::string name;
+
+    /// One value per pixel, row by row
+    std::vector<float> data;
+};
+
 /**
  * \brief Stores a RGB high dynamic-range bitmap
  *
@@ -26,11 +35,22 @@ public:
     /// Load an OpenEXR file with the specified filename
     Bitmap(const std::string &filename);
 
-    /// Save the bitmap as an EXR file with the specified filename
-    void saveEXR(const std::string &filename);
+    /**
+     * \brief Save the bitmap as an EXR file with the specified filename
+     *
+     * \param half
+     *     Store 16 bit floats
+     * \param channels
+     *     Extra channels written after R, G and B (empty ones are skipped)
+     */
+    void saveEXR(const std::string &filename, bool half = false,
+                 const std::vector<BitmapChannel> &channels = {}) const;
 
     /// Save the bitmap as a PNG file (with sRGB tonemapping) with the specified filename
-    void savePNG(const std::string &filename);
+    void savePNG(const std::string &filename) const;
+
+    /// Tonemap to 8 bit sRGB (3 channels per pixel, row by row) using a lookup table, in parallel
+    void toSRGB8(uint8_t *dst) const;
 };
 
 NAMESPACE_END(kazen)
@@ -4,11 +4,95 @@
 #include <kazen/object.h>
 #include <tbb/spin_mutex.h>
 #include <kazen/vector.h>
+#include <atomic>
+#include <memory>
+#include <iosfwd>
 
-#define KAZEN_BLOCK_SIZE 32 /* Block size used for parallelization */
+#define KAZEN_BLOCK_SIZE 32 /* Default block size used for parallelization */
 
 NAMESPACE_BEGIN(kazen)
 
+struct BitmapChannel;
+
+/**
+ * \brief Running statistics of the samples taken inside one pixel
+ *
+ * Records the running mean and the sum of squared deviations of the sample
+ * luminance, which is enough to estimate the variance of the pixel value
+ * (e.g. for adaptive sampling). Reconstruction filtering is not taken into
+ * account.
+ *
+ * The statistics are updated with Welford's method and merged with the
+ * pairwise formula of Chan et al., in double precision. Unlike a sum of
+ * squares, this does not cancel out for bright pixels with many samples.
+ */
+struct PixelMoments {
+    double m = 0.0;       ///< Mean
+    double m2 = 0.0;      ///< Sum of squared deviations from the mean
+    uint32_t count = 0;
+
+    /// Record a sample
+    void put(float value) {
+        ++count;
+        double delta = value - m;
+        m += delta / count;
+        m2 += delta * (value - m);
+    }
+
+    /// Merge the statistics of another set of samples
+    PixelMoments &operator+=(const PixelMoments &other) {
+        if (other.count == 0)
+            return *this;
+        uint32_t total = count + other.count;
+        double delta = other.m - m;
+        m += delta * other.count / total;
+        m2 += other.m2 + delta * delta * ((double) count * other.count / total);
+        count = total;
+        return *this;
+    }
+
+    /// Return the mean sample value
+    float mean() const { return (float) m; }
+
+    /// Return the unbiased sample variance
+    float variance() const {
+        if (count < 2)
+            return std::numeric_limits<float>::infinity();
+        return (float) (std::max(0.0, m2) / (count - 1));
+    }
+
+    /**
+     * \brief Return the standard error of the mean relative to the mean
+     *
+     * Values below 0.1 are treated as 0.1 so that the error of dark pixels
+     * is measured in absolute terms instead of blowing up.
+     */
+    float relativeError() const {
+        return std::sqrt(variance() / count) / std::max(mean(), 0.1f);
+    }
+};
+
+/**
+ * \brief Render cost of the samples taken inside one pixel
+ *
+ * Recorded for the cost heatmap AOV (see \ref ImageBlock::getCostChannels()).
+ */
+struct PixelCost {
+    float seconds = 0.f;
+    uint32_t rays = 0;
+    uint32_t bounces = 0;
+    uint32_t samples = 0;
+
+    /// Merge the costs of another set of samples
+    PixelCost &operator+=(const PixelCost &c) {
+        seconds += c.seconds;
+        rays += c.rays;
+        bounces += c.bounces;
+        samples += c.samples;
+        return *this;
+    }
+};
+
 /**
  * \brief Weighted pixel storage for a rectangular subregion of an image
  *
@@ -32,8 +116,12 @@ public:
      * \param filter
      *     Samples will be convolved with the image reconstruction
      *     filter provided here.
+     * \param moments
+     *     Also record per-pixel \ref PixelMoments of the samples
+     * \param costs
+     *     Also record the per-pixel \ref PixelCost of the samples
      */
-    ImageBlock(const Vector2i &size, const ReconstructionFilter *filter);
+    ImageBlock(const Vector2i &size, const ReconstructionFilter *filter, bool moments = false, bool costs = false);
     
     /// Release all memory
     ~ImageBlock();
@@ -65,7 +153,41 @@ public:
     void fromBitmap(const Bitmap &bitmap);
 
     /// Clear all contents
-    void clear() { setConstant(Color4f()); }
+    void clear() {
+        setConstant(Color4f());
+        std::fill(m_moments.begin(), m_moments.end(), PixelMoments());
+        std::fill(m_costs.begin(), m_costs.end(), PixelCost());
+    }
+
+    /// Does the block record per-pixel sample statistics?
+    bool hasMoments() const { return !m_moments.empty(); }
+
+    /// Return the sample statistics of a pixel given in image coordinates
+    PixelMoments getMoments(const Point2i &pixel) const {
+        Vector2i p = pixel - m_offset;
+        if (m_moments.empty() || (p.array() < 0).any() || (p.array() >= m_size.array()).any())
+            return PixelMoments();
+        return m_moments[p.y() * m_pixelStride + p.x()];
+    }
+
+    /// Does the block record per-pixel render costs?
+    bool hasCosts() const { return !m_costs.empty(); }
+
+    /// Add to the render cost of a pixel given in image coordinates
+    void putCost(const Point2i &pixel, const PixelCost &cost) {
+        Vector2i p = pixel - m_offset;
+        if (!m_costs.empty() && (p.array() >= 0).all() && (p.array() < m_size.array()).all())
+            m_costs[p.y() * m_pixelStride + p.x()] += cost;
+    }
+
+    /**
+     * \brief Return the render costs as image channels for an EXR file
+     *
+     * <tt>cost.time</tt> holds the microseconds spent on a pixel, <tt>cost.rays</tt>
+     * the rays traced per sample, <tt>cost.depth</tt> the average number of bounces
+     * and <tt>cost.samples</tt> the number of samples taken.
+     */
+    std::vector<BitmapChannel> getCostChannels() const;
 
     /// Record a sample with the given position and radiance value
     void put(const Point2f &pos, const Color3f &value);
@@ -74,10 +196,64 @@ public:
      * \brief Merge another image block into this one
      *
      * During the merge operation, this function locks 
-     * the destination block using a mutex.
+     * the destination block using a mutex. Pixel statistics
+     * and costs are merged when both blocks record them.
      */
     void put(ImageBlock &b);
 
+    /**
+     * \brief Guard merges with one lock per \c stripeHeight rows
+     *
+     * Blocks that cover different rows can then be merged into this
+     * one concurrently. A value of 0 restores the single block lock.
+     */
+    void setStripeHeight(int stripeHeight);
+
+    /**
+     * \brief Add rows <tt>[rowBegin, rowEnd)</tt> of an equally sized block
+     *
+     * Rows are counted including the border region. No lock is taken,
+     * so the caller must make sure nobody else writes to these rows.
+     */
+    void addRows(const ImageBlock &b, int rowBegin, int rowEnd);
+
+    /**
+     * \brief Copy the pixel data into an equally sized block
+     *
+     * Takes the merge lock (or all stripe locks) for the duration of a
+     * memcpy, so the copy never contains a partially merged block.
+     * Sample statistics are not copied.
+     */
+    void copyTo(ImageBlock &target) const;
+
+    /**
+     * \brief Save the unnormalized contents as an EXR file with the
+     * channels R, G, B (weighted sums) and A (filter weight)
+     *
+     * The border region is included up to the bounds of an image of
+     * size \c imageSize, and the position of the block in that image is
+     * stored as the EXR data window. Partial renders of an image can
+     * then be summed up with \ref addAccumulation().
+     */
+    void saveAccumulation(const std::string &filename, const Vector2i &imageSize) const;
+
+    /**
+     * \brief Add an EXR file written by \ref saveAccumulation()
+     *
+     * Pixels are placed according to the data window of the file,
+     * those outside of this block are ignored. Like \ref put(), invalid
+     * (NaN or infinite) pixels are skipped with a warning.
+     *
+     * \return The size of the image that the file belongs to
+     */
+    Vector2i addAccumulation(const std::string &filename);
+
+    /// Write the pixel data and sample statistics to a binary stream
+    void serialize(std::ostream &stream) const;
+
+    /// Read data written by \ref serialize() (the block dimensions must match)
+    void unserialize(std::istream &stream);
+
     /// Lock the image block (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
     
@@ -87,6 +263,9 @@ public:
     /// Return a human-readable string summary
     std::string toString() const;
 protected:
+    /// Merge the statistics and costs of pixel rows <tt>[yBegin, yEnd)</tt> of \c b
+    void putPixelStats(const ImageBlock &b, int yBegin, int yEnd);
+
     Point2i m_offset;
     Vector2i m_size;
     int m_borderSize = 0;
@@ -95,6 +274,11 @@ protected:
     float *m_weightsX = nullptr;
     float *m_weightsY = nullptr;
     float m_lookupFactor = 0;
+    std::vector<PixelMoments> m_moments;
+    std::vector<PixelCost> m_costs;
+    int m_pixelStride = 0;
+    int m_stripeHeight = 0;
+    std::unique_ptr<tbb::spin_mutex[]> m_stripeLocks;
     mutable tbb::spin_mutex m_mutex;
 };
 
@@ -105,6 +289,10 @@ protected:
  * rectangular blocks suitable for parallel rendering. The blocks
  * are ordered in spiraling pattern so that the center is
  * rendered first.
+ *
+ * The order is computed up front and blocks are handed out through an
+ * atomic counter, so \ref next() never blocks. To keep all workers busy
+ * until the end, the last blocks of the spiral are split into quarters.
  */
 class BlockGenerator {
 public:
@@ -114,32 +302,95 @@ public:
      *      Size of the image that should be split into blocks
      * \param blockSize
      *      Maximum size of the individual blocks
+     * \param splitCount
+     *      Number of blocks at the end of the spiral that are split
+     *      into four smaller ones (usually the number of workers)
+     * \param offset
+     *      Position of the region within the image (e.g. a crop window)
      */
-    BlockGenerator(const Vector2i &size, int blockSize);
+    BlockGenerator(const Vector2i &size, int blockSize, int splitCount = 0,
+                   const Point2i &offset = Point2i(0, 0));
     
     /**
      * \brief Return the next block to be rendered
      *
-     * This function is thread-safe
+     * This function is thread-safe and lock-free
+     *
+     * \param index
+     *      Optionally receives the position of the block in the
+     *      rendering order (e.g. to keep track of finished blocks)
+     * \param repetition
+     *      Optionally receives how often the block was handed
+     *      out before (see \ref reset())
      *
      * \return \c false if there were no more blocks
      */
-    bool next(ImageBlock &block);
+    bool next(ImageBlock &block, int *index = nullptr, int *repetition = nullptr);
+
+    /**
+     * \brief Hand out all blocks again, starting from the center
+     *
+     * The whole spiral is walked \c repeatCount times, e.g. to render
+     * different sample ranges of every block in parallel.
+     */
+    void reset(int repeatCount = 1) {
+        m_repeatCount = repeatCount;
+        m_next = 0;
+    }
 
     /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    int getBlockCount() const { return (int) m_blocks.size(); }
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-    Point2i m_block;
-    Vector2i m_numBlocks;
-    Vector2i m_size;
-    int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::spin_mutex m_mutex;
+    struct Block {
+        Point2i offset;
+        Vector2i size;
+    };
+
+    std::vector<Block> m_blocks;
+    int m_repeatCount = 1;
+    std::atomic<int> m_next;
+};
+
+/**
+ * \brief Block generators for horizontal bands of an image
+ *
+ * Used for NUMA-aware rendering: the workers of every node take blocks
+ * from the band of their node first, and help out with the other bands
+ * once it is exhausted. Blocks are numbered consecutively across bands.
+ */
+class BlockQueues {
+public:
+    /**
+     * \brief Split the image into \c queueCount bands of whole blocks
+     *
+     * The remaining parameters are passed to the \ref BlockGenerator
+     * of every band (the split count applies per band).
+     */
+    BlockQueues(const Vector2i &size, int blockSize, int splitCount, int queueCount,
+                const Point2i &offset = Point2i(0, 0));
+
+    /**
+     * \brief Return the next block, preferably from the given queue
+     *
+     * This function is thread-safe and lock-free
+     *
+     * \return \c false if there were no more blocks in any queue
+     */
+    bool next(ImageBlock &block, int queue, int *index = nullptr, int *repetition = nullptr);
+
+    /// Hand out all blocks again, \c repeatCount times (see \ref BlockGenerator::reset())
+    void reset(int repeatCount = 1);
+
+    /// Return the total number of blocks
+    int getBlockCount() const { return m_firstBlock.back(); }
+
+    /// Return the number of queues (can be less than requested for small images)
+    int getQueueCount() const { return (int) m_generators.size(); }
+protected:
+    std::vector<std::unique_ptr<BlockGenerator>> m_generators;
+    std::vector<int> m_firstBlock;
 };
 
 NAMESPACE_END(kazen)
@@ -37,7 +37,7 @@ struct BSDFQueryRecord {
     BSDFFlag flag = BSDFFlag::BSDF_All;
 
     /// pdf associated with the sample
-    float pdf;
+    float pdf = 0.f;
 
     /// UV value for evaluate textures
     Point2f uv;
@@ -122,7 +122,7 @@ public:
 
 
     // https://twitter.com/YuriyODonnell/status/1199253959086612480
-    virtual float regularize(const Point2f &uv) const { return 0.f; }
+    virtual float regularize(const Point2f &) const { return 0.f; }
 
 };
 
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <kazen/mesh.h>
+#include <kazen/transform.h>
+
+NAMESPACE_BEGIN(kazen)
+
+/**
+ * \brief Built-in bounding volume hierarchy, an alternative to embree
+ *
+ * The hierarchy is built top-down with binned SAH splits, subtrees are
+ * built in parallel with TBB. The binary tree is then collapsed into
+ * 4-wide nodes whose child boxes are stored as SoA and tested against a
+ * ray with SSE at once (lane by lane on other architectures). Leaves hold
+ * packets of 4 triangles (first vertex and two edges, SoA) for a 4-wide
+ * Moeller-Trumbore test, and the instances that fall into them.
+ *
+ * A BVH is either built over meshes and instances (the top level of a
+ * scene) or over the meshes of one \ref ShapeGroup, which instances then
+ * reference. Rays only hit meshes whose visibility (\ref EVisibility)
+ * shares a bit with the visibility of the ray.
+ */
+class BVH {
+public:
+    /// Marks an unused ID
+    static const uint32_t InvalidID = 0xFFFFFFFFu;
+
+    /// Placement of another BVH (that of a shape group) in this one
+    struct InstanceRef {
+        const BVH *bvh;
+        Transform toWorld;
+    };
+
+    /// Closest hit found by \ref rayIntersect()
+    struct Result {
+        float t;
+        /// Barycentric coordinates of the second and third triangle vertex
+        float u, v;
+        /// Triangle index within its mesh
+        uint32_t primID;
+        /// Index of the mesh, in the instanced BVH for hits on an instance
+        uint32_t geomID;
+        /// Index of the instance that was hit, or \ref InvalidID
+        uint32_t instID;
+    };
+
+    /// Build the hierarchy over the triangles of \c meshes and the \c instances
+    BVH(const std::vector<const Mesh *> &meshes, const std::vector<InstanceRef> &instances = {});
+
+    /// Find the closest hit along the ray
+    bool rayIntersect(const Ray3f &ray, uint32_t visibility, Result &result) const;
+
+    /// Is there any hit between \c mint and \c maxt?
+    bool rayOccluded(const Ray3f &ray, uint32_t visibility) const;
+
+    /// Return the bytes held by nodes, leaves and triangle data
+    size_t getMemoryUsage() const;
+
+    /// Return a string summary (sizes of the hierarchy)
+    std::string toString() const;
+
+private:
+    struct BuildPrim;
+    struct BuildNode;
+    struct Builder;
+    struct TraversalRay;
+
+    /// 4-wide node, the child boxes as SoA: minX, maxX, minY, maxY, minZ, maxZ
+    struct alignas(16) Node {
+        float bounds[6][4];
+        uint32_t child[4];
+    };
+
+    /// Contents of a leaf: a range of triangle packets and a range of instances
+    struct Leaf {
+        uint32_t firstPacket, packetCount;
+        uint32_t firstInstance, instanceCount;
+    };
+
+    /// 4 triangles in SoA layout, unused lanes have an invalid geomID
+    struct alignas(16) TrianglePacket {
+        float v0[3][4];
+        float e1[3][4];
+        float e2[3][4];
+        uint32_t primID[4];
+        uint32_t geomID[4];
+    };
+
+    /// Traverse the hierarchy, stopping at the first hit if \c AnyHit
+    template <bool AnyHit> bool traverse(TraversalRay &ray, Result *result) const;
+
+    /// Test the triangles and instances of a leaf
+    template <bool AnyHit> bool intersectLeaf(const Leaf &leaf, TraversalRay &ray, Result *result) const;
+
+    /// Collapse a subtree of the binary build tree into 4-wide nodes, return the child reference
+    uint32_t collapse(const std::vector<BuildNode> &buildNodes, const std::vector<BuildPrim> &prims, uint32_t index);
+
+    /// Create the leaf of a binary build node, return the child reference
+    uint32_t makeLeaf(const BuildNode &node, const std::vector<BuildPrim> &prims);
+
+    std::vector<const Mesh *> m_meshes;
+    std::vector<uint32_t> m_meshVisibility;
+    std::vector<InstanceRef> m_instances;
+    std::vector<Transform> m_instanceToLocal;
+
+    std::vector<Node> m_nodes;
+    std::vector<Leaf> m_leaves;
+    std::vector<TrianglePacket> m_packets;
+    std::vector<uint32_t> m_leafInstances;
+    uint32_t m_root = InvalidID;       ///< Reference of the root (a node or a single leaf)
+    BoundingBox3f m_bbox;
+};
+
+NAMESPACE_END(kazen)
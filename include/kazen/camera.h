@@ -42,6 +42,18 @@ public:
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
 
+    /// Change the size of the output image (e.g. to override the scene from the command line)
+    void setOutputSize(const Vector2i &size) {
+        m_outputSize = size;
+        activate();
+    }
+
+    /// Return the camera-to-world transformation
+    const Transform &getCameraToWorld() const { return m_cameraToWorld; }
+
+    /// Move the camera (e.g. along a path over the frames of a batch render)
+    void setCameraToWorld(const Transform &cameraToWorld) { m_cameraToWorld = cameraToWorld; }
+
     /// Return the camera's reconstruction filter in image space
     const ReconstructionFilter *getReconstructionFilter() const { return m_rfilter; }
 
@@ -52,6 +64,7 @@ public:
     EClassType getClassType() const { return ECamera; }
 protected:
     Vector2i m_outputSize;
+    Transform m_cameraToWorld;
     ReconstructionFilter *m_rfilter;
 };
 
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <kazen/common.h>
+#include <kazen/vector.h>
+
+NAMESPACE_BEGIN(kazen)
+
+/**
+ * \brief Snapshot of an unfinished render
+ *
+ * Holds everything needed to continue a render where it stopped: the
+ * accumulation buffer, the pass in progress and the blocks of that pass
+ * which already went into the buffer. Samplers are deterministic given
+ * the pixel and sample index, so only their configuration is recorded to
+ * make sure that the resumed render continues the same sequences.
+ */
+struct Checkpoint {
+    /// Size of the image and position of the rendered region (crop window)
+    Vector2i outputSize = Vector2i(0, 0);
+    Point2i cropOffset = Point2i(0, 0);
+    /// Block size, split count and number of bands of the \ref BlockQueues
+    int blockSize = 0;
+    int splitCount = 0;
+    int queueCount = 1;
+    /// Rendered sample indices <tt>[firstSample, sampleCount)</tt> and samples per pass
+    uint32_t firstSample = 0;
+    uint32_t sampleCount = 0;
+    uint32_t passSampleCount = 0;
+    /// Summary of the sampler (see \ref Object::toString())
+    std::string sampler;
+
+    /// Pass in progress, all earlier passes are complete
+    uint32_t pass = 0;
+    /// Finished blocks of the pass in progress (indexed in rendering order)
+    std::vector<uint8_t> blocksDone;
+    /// Accumulation buffer written by \ref ImageBlock::serialize()
+    std::string image;
+
+    /// Does the render state of \c other match this one?
+    bool isCompatible(const Checkpoint &other) const;
+
+    /// Write the checkpoint, replacing an existing file only once writing succeeded
+    void save(const std::string &filename) const;
+
+    /// Read a checkpoint, returns \c false if \c filename does not exist
+    bool load(const std::string &filename);
+};
+
+NAMESPACE_END(kazen)
@@ -102,6 +102,7 @@ class BlockGenerator;
 class Camera;
 class ImageBlock;
 class Integrator;
+struct Intersection;
 class Light;
 struct LightQueryRecord;
 class Mesh;
@@ -301,7 +302,7 @@ NAMESPACE_BEGIN(math)
         // in log space.
         const uint32_t midsignif = 0b00000000001101010000010011110011;
         return floatingPoint::exponent(v) + 
-            (( floatingPoint::significand(v) >= midsignif) ? 1 : 0);
+            (( (uint32_t) floatingPoint::significand(v) >= midsignif) ? 1 : 0);
     }
 
     /// TODO: Because we use gcc builtin function __builtin_clz, 
@@ -319,6 +320,54 @@ NAMESPACE_BEGIN(math)
         return isPowerOf4(v) ? v : (1 << (2 * (1 + log4i(v))));
     }
 
+    /// Round up to the next power of two
+    inline uint32_t roundUpPow2(uint32_t v) {
+        return v <= 1 ? 1 : 1u << (32 - __builtin_clz(v - 1));
+    }
+
+    /// Gather the even bits of a 32 bit integer (inverse of a bit interleave)
+    inline uint32_t compactBits(uint32_t v) {
+        v &= 0x55555555;
+        v = (v ^ (v >> 1)) & 0x33333333;
+        v = (v ^ (v >> 2)) & 0x0f0f0f0f;
+        v = (v ^ (v >> 4)) & 0x00ff00ff;
+        v = (v ^ (v >> 8)) & 0x0000ffff;
+        return v;
+    }
+
+    /// Map a Morton (Z-order) code to 2D coordinates
+    inline void mortonDecode(uint32_t code, uint32_t &x, uint32_t &y) {
+        x = compactBits(code);
+        y = compactBits(code >> 1);
+    }
+
+    /**
+     * \brief Map a distance along the Hilbert curve to 2D coordinates
+     *
+     * \param n
+     *     Side length of the square covered by the curve (power of two)
+     * \param d
+     *     Distance along the curve in <tt>[0, n*n)</tt>
+     */
+    inline void hilbertDecode(uint32_t n, uint32_t d, uint32_t &x, uint32_t &y) {
+        x = y = 0;
+        for (uint32_t s = 1; s < n; s *= 2) {
+            uint32_t rx = 1 & (d / 2);
+            uint32_t ry = 1 & (d ^ rx);
+            /* Rotate the quadrant */
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+            x += s * rx;
+            y += s * ry;
+            d /= 4;
+        }
+    }
+
 NAMESPACE_END(math)
 
 
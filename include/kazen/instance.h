@@ -0,0 +1,94 @@
+#pragma once
+
+#include <kazen/mesh.h>
+#include <kazen/transform.h>
+
+NAMESPACE_BEGIN(kazen)
+
+/**
+ * \brief Group of meshes that can be placed many times in a scene
+ *
+ * The meshes of a group are loaded and stored once. The acceleration data
+ * structure builds them into one sub-scene that every \ref Instance of the
+ * group references with its own transformation. Groups are declared with
+ * an id and are invisible by themselves:
+ *
+ * <pre>
+ *   &lt;shapegroup id="chair"&gt;
+ *       &lt;mesh type="obj"&gt; ... &lt;/mesh&gt;
+ *   &lt;/shapegroup&gt;
+ * </pre>
+ *
+ * Area lights cannot be part of a group, light sampling needs the
+ * emitting triangles in world space.
+ */
+class ShapeGroup : public Object {
+public:
+    ShapeGroup(const PropertyList &) { }
+
+    /// Release the meshes of the group
+    virtual ~ShapeGroup();
+
+    /// Register a mesh of the group
+    void addChild(Object *child);
+
+    /// Check that the group is not empty
+    void activate();
+
+    /// Return the meshes of the group
+    const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
+
+    /// Return the bounding box of the group in its own coordinate system
+    const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+    std::string toString() const;
+
+    EClassType getClassType() const { return EShapeGroup; }
+
+private:
+    std::vector<Mesh *> m_meshes;
+    BoundingBox3f m_bbox;
+};
+
+/**
+ * \brief Placement of a \ref ShapeGroup in the scene
+ *
+ * <pre>
+ *   &lt;instance&gt;
+ *       &lt;string name="shapegroup" value="chair"/&gt;
+ *       &lt;transform name="toWorld"&gt; ... &lt;/transform&gt;
+ *   &lt;/instance&gt;
+ * </pre>
+ *
+ * The group is looked up by id when the scene is activated.
+ */
+class Instance : public Object {
+public:
+    Instance(const PropertyList &propList);
+
+    /// Return the id of the referenced group
+    const std::string &getShapeGroupId() const { return m_shapeGroupId; }
+
+    /// Return the referenced group (set by the scene)
+    const ShapeGroup *getShapeGroup() const { return m_shapeGroup; }
+
+    /// Set the referenced group
+    void setShapeGroup(const ShapeGroup *shapeGroup) { m_shapeGroup = shapeGroup; }
+
+    /// Return the transformation from group to world space
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    /// Return the world space bounding box of the instance
+    BoundingBox3f getBoundingBox() const;
+
+    std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+private:
+    std::string m_shapeGroupId;
+    const ShapeGroup *m_shapeGroup = nullptr;
+    Transform m_toWorld;
+};
+
+NAMESPACE_END(kazen)
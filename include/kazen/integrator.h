@@ -4,6 +4,21 @@
 
 NAMESPACE_BEGIN(kazen)
 
+/**
+ * \brief Pixel sample that a path of a wavefront batch belongs to
+ *
+ * Paths of a batch are advanced stage by stage, so the sampler is
+ * re-seeded with \ref Sampler::generateSample() whenever a path needs
+ * random numbers. Integrator dimensions start after the camera's.
+ */
+struct PixelSample {
+    /// Dimensions used by the camera (pixel and aperture sample)
+    static constexpr int CameraDimensions = 4;
+
+    Point2i pixel;
+    uint32_t index;
+};
+
 /**
  * \brief Abstract integrator (i.e. a rendering technique)
  *
@@ -19,7 +34,7 @@ public:
     virtual ~Integrator() { }
 
     /// Perform an (optional) preprocess step
-    virtual void preprocess(const Scene *scene) { }
+    virtual void preprocess(const Scene *) { }
 
     /**
      * \brief Sample the incident radiance along a ray
@@ -35,6 +50,35 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a ray whose first
+     * intersection has already been found
+     *
+     * \param its
+     *    First intersection along \c ray, or \c nullptr if it escaped
+     *
+     * The default implementation ignores \c its and traces the ray again.
+     */
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection * /* its */) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /**
+     * \brief Sample the incident radiance along a batch of camera rays
+     *
+     * Used by the wavefront renderer. The default implementation traces
+     * the camera rays as coherent packets and continues every path from
+     * its first hit. Integrators may override it to trace each bounce of
+     * all paths as one stream.
+     *
+     * \param samples
+     *    Pixel sample of every ray, used to re-seed the sampler
+     * \param Li
+     *    Receives the radiance estimate of every ray
+     */
+    virtual void Li(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+                    const PixelSample *samples, Color3f *Li, size_t count) const;
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -56,6 +56,43 @@ struct Intersection {
     std::string toString() const;
 };
 
+/**
+ * \brief Compact record of a ray-triangle hit
+ *
+ * Holds only what the traversal reports. The full \ref Intersection is
+ * computed from it on demand with \ref Mesh::computeIntersection(), so
+ * queries that only need to know what was hit and where along the ray
+ * skip the interpolation of the surface attributes.
+ */
+struct Hit {
+    /// Distance along the ray
+    float t;
+    /// Barycentric coordinates of the second and third triangle vertex
+    Point2f uv;
+    /// Index of the triangle that was hit
+    uint32_t primID;
+    /// Mesh that was hit, \c nullptr if the ray missed
+    const Mesh *mesh = nullptr;
+    /// Transformation of the instance that was hit, \c nullptr outside of instances
+    const Transform *toWorld = nullptr;
+
+    /// Did the ray hit anything?
+    bool isValid() const { return mesh != nullptr; }
+};
+
+/**
+ * \brief Kinds of rays a mesh can be visible to
+ *
+ * The flags are used as embree geometry masks, a ray only hits meshes whose
+ * visibility shares a bit with the ray's own flag.
+ */
+enum EVisibility {
+    EVisibleCamera   = 0x1,  ///< Camera rays
+    EVisibleShadow   = 0x2,  ///< Shadow rays of light sampling
+    EVisibleIndirect = 0x4,  ///< Rays scattered by a surface
+    EVisibleAll      = EVisibleCamera | EVisibleShadow | EVisibleIndirect
+};
+
 /**
  * \brief Triangle mesh
  *
@@ -81,6 +118,16 @@ public:
     /// Return the surface area of the given triangle
     float surfaceArea(uint32_t index) const;
 
+    /**
+     * \brief Compute the full intersection record of a hit on this mesh
+     *
+     * Fills in the position, geometric and shading frames, texture
+     * coordinates and tangents, in world space also for hits on an
+     * instance. \c its.accumulatedRoughness is left untouched, it is
+     * carried along a path.
+     */
+    void computeIntersection(const Hit &hit, Intersection &its) const;
+
     //// Return an axis-aligned bounding box of the entire mesh
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
@@ -147,6 +194,14 @@ public:
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
 
+    /**
+     * \brief Return the kinds of rays that can hit this mesh (see \ref EVisibility)
+     *
+     * Lights without primary visibility are only seen by scattered rays,
+     * camera and shadow rays pass through them.
+     */
+    uint32_t getVisibility() const;
+
     /// Return a human-readable summary of this instance
     std::string toString() const;
 
@@ -171,6 +226,9 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /// Read the "visibleCamera", "visibleShadow" and "visibleIndirect" properties
+    void configureVisibility(const PropertyList &propList);
+
 protected:
     std::string     m_name;                 ///< Identifying name
     MatrixXf        m_V;                    ///< Vertex positions
@@ -182,6 +240,15 @@ protected:
     BoundingBox3f   m_bbox;                 ///< Bounding box of the mesh
     DiscretePDF     *m_dpdf = nullptr;      ///< Pdf for each triangle
     float           m_area;                 ///< Surface area of mesh
+    uint32_t        m_visibility = EVisibleAll; ///< Ray types that can hit the mesh
 };
 
+/**
+ * \brief Write a UV sphere of radius 1 around the origin as Wavefront OBJ
+ *
+ * The sphere has \c rings rings of twice as many quads, about 2 * rings^2
+ * triangles. Used to generate meshes for tests and benchmarks.
+ */
+extern void writeSphereOBJ(const std::string &filename, int rings);
+
 NAMESPACE_END(kazen)
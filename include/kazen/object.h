@@ -24,6 +24,8 @@ public:
         ESampler,
         EReconstructionFilter,
         ETexture,
+        EShapeGroup,
+        EInstance,
         EClassTypeCount
     };
 
@@ -85,6 +87,8 @@ public:
             case ESampler:      return "sampler";
             case ETexture:      return "texture";
             case EMedium:       return "medium";
+            case EShapeGroup:   return "shapegroup";
+            case EInstance:     return "instance";
             default:            return "<unknown>";
         }
     }
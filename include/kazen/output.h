@@ -0,0 +1,34 @@
+#pragma once
+
+#include <kazen/bitmap.h>
+#include <memory>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(output)
+
+/**
+ * \brief Write a rendered image to disk on background threads
+ *
+ * The PNG (and the EXR, unless \c exr is false) are written concurrently
+ * while the caller continues, e.g. with the next render. Call \ref wait()
+ * before the process exits.
+ *
+ * \param bitmap
+ *     Normalized image, kept alive until both files are written
+ * \param basename
+ *     Output file name without extension
+ * \param exr
+ *     Also write <tt>basename.exr</tt>
+ * \param half
+ *     Store the EXR as 16 bit floats
+ * \param channels
+ *     Extra channels (AOVs) of the EXR
+ */
+void saveAsync(std::shared_ptr<const Bitmap> bitmap, const std::string &basename, bool exr, bool half,
+               std::vector<BitmapChannel> channels = {});
+
+/// Wait for all writes started by \ref saveAsync(), return false if one of them failed
+bool wait();
+
+NAMESPACE_END(output)
+NAMESPACE_END(kazen)
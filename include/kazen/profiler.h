@@ -0,0 +1,71 @@
+#pragma once
+
+#include <kazen/common.h>
+#include <chrono>
+
+/**
+ * Hot-path scopes (ray queries, BSDF and texture evaluations) run millions of
+ * times per second and are only compiled in when KAZEN_ENABLE_PROFILER is
+ * defined (cmake -DKAZEN_ENABLE_PROFILER=ON). Coarse scopes such as scene
+ * loading and render blocks are always available.
+ */
+#if defined(KAZEN_ENABLE_PROFILER)
+#  define KAZEN_PROFILE_CONCAT_(a, b) a##b
+#  define KAZEN_PROFILE_CONCAT(a, b) KAZEN_PROFILE_CONCAT_(a, b)
+#  define KAZEN_PROFILE(name) ::kazen::profiler::Scope KAZEN_PROFILE_CONCAT(profileScope, __LINE__)(name)
+#else
+#  define KAZEN_PROFILE(name) do { } while (0)
+#endif
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(profiler)
+
+/// Start recording trace events (scopes that end before this call are not recorded)
+void start();
+
+/// Is trace recording enabled?
+bool isRecording();
+
+/// Save the recorded events in the Chrome trace event format (chrome://tracing, ui.perfetto.dev)
+void save(const std::string &filename);
+
+/// Microseconds since the profiler clock started
+int64_t now();
+
+/// Record a finished scope on the calling thread
+void record(const char *name, std::string detail, int64_t begin, int64_t end);
+
+/**
+ * \brief Times the enclosing scope
+ *
+ * While recording, the scope ends up as a complete event on the track of the
+ * calling thread. \ref elapsed() can be used for log messages in any case.
+ */
+class Scope {
+public:
+    /// \c name must be a string literal (or otherwise outlive the profiler)
+    Scope(const char *name) : m_name(name), m_begin(now()) { }
+
+    /// Attach \c detail (e.g. a file name) as an argument of the event
+    Scope(const char *name, const std::string &detail)
+        : m_name(name), m_detail(detail), m_begin(now()) { }
+
+    ~Scope() {
+        if (isRecording())
+            record(m_name, std::move(m_detail), m_begin, now());
+    }
+
+    /// Return the number of milliseconds elapsed since the scope was entered
+    double elapsed() const { return (now() - m_begin) / 1000.0; }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+private:
+    const char *m_name;
+    std::string m_detail;
+    int64_t m_begin;
+};
+
+NAMESPACE_END(profiler)
+NAMESPACE_END(kazen)
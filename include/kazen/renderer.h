@@ -1,13 +1,253 @@
 #pragma once
 
 #include <kazen/common.h>
+#include <kazen/block.h>
 
 NAMESPACE_BEGIN(kazen)
+
+class PropertyList;
+
 NAMESPACE_BEGIN(renderer)
 
-    void renderSample(const Scene *scene, Sampler *sampler, ImageBlock &block, const Point2f &pixelSample);
+    /**
+     * \brief Render settings that are not part of any scene object
+     *
+     * The values are read from properties of the <tt>scene</tt> node of
+     * the XML file and can be overridden from the command line.
+     */
+    struct RenderOptions {
+        /// Order in which the pixels of a block are rendered
+        enum EPixelOrder {
+            EScanline = 0,
+            EMorton,
+            EHilbert
+        };
+
+        /// Pixel format of the EXR written next to the PNG
+        enum EEXRFormat {
+            ENoEXR = 0,
+            EHalfEXR,
+            EFloatEXR
+        };
+
+        /// How finished blocks are merged into the frame buffer
+        enum EAccumulation {
+            /// One lock guards the entire frame buffer
+            ELocked = 0,
+            /// One lock per stripe of rows, blocks on different rows merge concurrently
+            EStriped,
+            /// Every thread owns a full frame buffer, all are summed up after each pass
+            EPerThread
+        };
+
+        /// Render the whole frame in passes instead of block by block
+        bool progressive = false;
+
+        /// Number of samples per pixel rendered during one progressive pass
+        uint32_t passSampleCount = 1;
+
+        /// Stop once this many samples per pixel are done (0: sampler's sample count)
+        uint32_t targetSampleCount = 0;
+
+        /// Wall-clock budget in seconds (0: unlimited)
+        float timeLimit = 0.f;
+
+        /**
+         * \brief Stop sampling pixels whose estimate has converged
+         *
+         * With a sampler that can extend its sequence (\ref Sampler::isUnbounded()),
+         * the samples saved this way go to the pixels that are still noisy, in
+         * extra passes of up to 4x the sample count. Sample ranges, checkpoints
+         * and resumed renders keep the fixed count instead.
+         */
+        bool adaptive = false;
+
+        /// Relative standard error below which a pixel counts as converged
+        float adaptiveThreshold = 0.01f;
+
+        /// Number of samples every pixel receives before it may stop
+        uint32_t adaptiveMinSampleCount = 16;
+
+        /// Edge length of the image blocks handed out to the workers
+        int blockSize = KAZEN_BLOCK_SIZE;
+
+        /**
+         * \brief Split the samples of a block into ranges rendered in parallel
+         *
+         * Kicks in when an image has fewer blocks than there are workers (e.g.
+         * thumbnails). Not used with adaptive sampling, checkpoints or resumed
+         * renders, which need all samples of a block in one place.
+         */
+        bool sampleSplitting = true;
+
+        /**
+         * \brief Pixel traversal inside a block (space-filling curves keep neighbors together)
+         *
+         * On one core the curves stay within the run-to-run noise of scanline
+         * on the 2022_q1 scenes, so scanline stays the default until L2 misses
+         * and many-core runs show a gain (kazen_scenebench --pixel-order).
+         */
+        EPixelOrder pixelOrder = EScanline;
+
+        /**
+         * \brief Frame buffer accumulation strategy
+         *
+         * Locked stays the default: with small blocks on one core the others
+         * are within the noise of it, and per-thread buffers cost memory.
+         * Merge contention on many-core machines is still to be measured
+         * (kazen_scenebench --accumulation).
+         */
+        EAccumulation accumulation = ELocked;
+
+        /**
+         * \brief Trace the samples of a block in waves (see \ref Integrator::Li() for ray batches)
+         *
+         * This is also the only mode that traces camera rays as coherent
+         * packets (\ref KAZEN_RAY_PACKET_SIZE wide); the default sample by
+         * sample path traces every ray on its own.
+         */
+        bool wavefront = false;
+
+        /// Save a checkpoint of the render every this many seconds (0: never)
+        float checkpointInterval = 0.f;
+
+        /// Continue from the checkpoint of a previous run, if there is one
+        bool resume = false;
+
+        /// Write the image in progress every this many seconds (0: never)
+        float snapshotInterval = 0.f;
+
+        /// Write the image in progress every time this many blocks are done (0: never)
+        int snapshotBlocks = 0;
+
+        /// Render only this window of the image (an empty size selects the whole image)
+        Point2i cropOffset = Point2i(0, 0);
+        Vector2i cropSize = Vector2i(0, 0);
+
+        /// Render only the sample indices <tt>[sampleRangeBegin, sampleRangeEnd)</tt> (0 as end: all)
+        uint32_t sampleRangeBegin = 0;
+        uint32_t sampleRangeEnd = 0;
+
+        /// Save the unnormalized sums and weights as EXR (for kazen_merge) instead of the image
+        bool partial = false;
+
+        /// One worker arena and block queue per NUMA node (see \ref BlockQueues)
+        bool numa = false;
+
+        /// EXR output besides the PNG (written in the background, see \ref output::saveAsync())
+        EEXRFormat exrFormat = EFloatEXR;
+
+        /**
+         * \brief Record the render cost of every pixel as extra EXR layers
+         *
+         * Time spent per pixel, rays and bounces per sample (see \ref
+         * ImageBlock::getCostChannels()). Forces an EXR to be written and
+         * traces sample by sample, also when \ref wavefront is set.
+         */
+        bool costAOV = false;
+
+        /// Create the default options
+        RenderOptions() { }
+
+        /// Read the options from the properties of a scene
+        RenderOptions(const PropertyList &propList) { configure(propList); }
+
+        /// Override the options that are present in \c propList (e.g. command line flags)
+        void configure(const PropertyList &propList);
+
+        /// Return a human-readable string summary
+        std::string toString() const;
+    };
+
+    /// Timings of a finished render
+    struct RenderSummary {
+        /// Duration of the render in seconds (without scene loading and saving the image)
+        double seconds = 0.0;
+
+        /// Seconds until the first block reached the frame buffer
+        double firstBlockSeconds = 0.0;
+
+        /// Samples per pixel of the finished passes (at most the sampler's sample count)
+        uint32_t sampleCount = 0;
+    };
+
+    /// One image of a batch render
+    struct BatchJob {
+        /// Camera of the scene to render through
+        Camera *camera = nullptr;
+
+        /// Placement of the camera for this image
+        Transform cameraToWorld;
+
+        /// Output file name
+        std::string filename;
+    };
+
+    /**
+     * \brief Watches the frame buffer of a running render (e.g. to display it)
+     *
+     * Observers must not write to the frame buffer. To read pixels while the
+     * workers go on merging, copy it with \ref ImageBlock::copyTo().
+     */
+    class RenderObserver {
+    public:
+        virtual ~RenderObserver() { }
+
+        /**
+         * \brief Pixels <tt>[offset, offset + size)</tt> of \c result have new samples
+         *
+         * Called by the workers concurrently, right after they merged a block.
+         */
+        virtual void blockDone(const ImageBlock &result, const Point2i &offset, const Vector2i &size) = 0;
+
+        /// Called once the workers have stopped, before the image is saved
+        virtual void renderDone(const ImageBlock &result) = 0;
+    };
+
+    /// Request all running renders to stop after the blocks in flight (thread-safe)
+    void requestStop();
+
+    /// Let renders run again after \ref requestStop()
+    void clearStop();
+
+    /// Trace one sample through \c pixelPosition and add it to \c block (the sampler is already seeded)
+    void renderSample(const Scene *scene, Sampler *sampler, ImageBlock &block, const Point2i &pixelPosition);
+
+    /// Return the pixel positions of a block in the given traversal order
+    std::vector<Point2i> blockPixels(const ImageBlock &block, RenderOptions::EPixelOrder order);
+
+    /**
+     * \brief Render the samples [sampleBegin, sampleEnd) of every pixel in a block
+     *
+     * With adaptive sampling enabled in \c options, a pixel stops early once its
+     * error estimate falls below the threshold. Samples of previous passes that
+     * were already merged into \c history count towards that estimate.
+     */
+    void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleBegin, uint32_t sampleEnd,
+        const RenderOptions &options, const ImageBlock *history = nullptr);
+    void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleBegin, uint32_t sampleEnd);
     void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block);
-    void render(Scene *scene, const std::string &filename);
+
+    /**
+     * \brief Render the scene and save the image to \c filename (with the
+     * extension replaced)
+     *
+     * An empty file name renders without writing any files, e.g. for
+     * previews that only go to an \ref RenderObserver.
+     */
+    RenderSummary render(Scene *scene, const std::string &filename, const RenderOptions &options = RenderOptions(),
+        RenderObserver *observer = nullptr);
+
+    /**
+     * \brief Render several images of a scene that is loaded once
+     *
+     * All jobs share the acceleration structure, the light data and the texture
+     * cache of the scene, and the images of one job are written while the next
+     * one renders. The active camera and its placement are restored afterwards.
+     * A stop request ends the batch after the current job.
+     */
+    std::vector<RenderSummary> renderBatch(Scene *scene, const std::vector<BatchJob> &jobs,
+        const RenderOptions &options = RenderOptions());
 
 NAMESPACE_END(renderer)
-NAMESPACE_END(kazen)
\ No newline at end of file
+NAMESPACE_END(kazen)
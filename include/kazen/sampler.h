@@ -90,6 +90,15 @@ public:
     /// Return the number of configured pixel samples
     virtual uint32_t getSampleCount() const { return m_sampleCount; }
 
+    /**
+     * \brief Can samples with indices beyond \ref getSampleCount() be
+     * generated? (e.g. extra samples for noisy pixels in adaptive sampling)
+     *
+     * Stratified and low-discrepancy samplers lose their distribution when
+     * the sequence is extended.
+     */
+    virtual bool isUnbounded() const { return false; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
      * provided by this instance
@@ -29,15 +29,27 @@ public:
     /// Return a pointer to the scene's integrator
     Integrator *getIntegrator() { return m_integrator; }
 
-    /// Return a pointer to the scene's camera
+    /// Return a pointer to the scene's camera (const version)
     const Camera *getCamera() const { return m_camera; }
 
+    /// Return a pointer to the scene's camera
+    Camera *getCamera() { return m_camera; }
+
+    /// Return all cameras of the scene, the first one is active unless \ref setCamera() picks another
+    const std::vector<Camera *> &getCameras() const { return m_cameras; }
+
+    /// Render through another camera of the scene (e.g. for batch renders)
+    void setCamera(Camera *camera);
+
     /// Return a pointer to the scene's sample generator (const version)
     const Sampler *getSampler() const { return m_sampler; }
 
     /// Return a pointer to the scene's sample generator
     Sampler *getSampler() { return m_sampler; }
 
+    /// Return the properties of the scene node (render settings)
+    const PropertyList &getPropertyList() const { return m_propList; }
+
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
@@ -74,10 +86,22 @@ public:
      *    A detailed intersection record, which will be filled by the
      *    intersection query
      *
+     * \param visibility
+     *    Kind of the ray (see \ref EVisibility), camera rays should pass
+     *    \ref EVisibleCamera
+     *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-        return m_accel->rayIntersect(ray, its, false);
+    bool rayIntersect(const Ray3f &ray, Intersection &its, uint32_t visibility = EVisibleIndirect) const {
+        return m_accel->rayIntersect(ray, its, visibility);
+    }
+
+    /**
+     * \brief Intersect a ray against the scene and only return the compact
+     * hit record, see \ref Mesh::computeIntersection() for the rest
+     */
+    bool rayIntersect(const Ray3f &ray, Hit &hit, uint32_t visibility = EVisibleIndirect) const {
+        return m_accel->rayIntersect(ray, hit, visibility);
     }
 
     /**
@@ -96,12 +120,38 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->rayOccluded(ray);
+    }
+
+    /// Test whether a shadow ray is blocked (see \ref Accel::rayOccluded())
+    bool rayOccluded(const Ray3f &ray) const {
+        return m_accel->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Intersect a stream of rays against all triangles stored in
+     * the scene (see \ref Accel::rayIntersect())
+     *
+     * \param hits
+     *    Receives for every ray whether an intersection was found
+     *
+     * \param coherent
+     *    Trace as coherent packets (e.g. for camera rays)
+     */
+    void rayIntersect(const Ray3f *rays, Intersection *its, bool *hits, size_t count,
+                      uint32_t visibility = EVisibleIndirect, bool coherent = false) const {
+        m_accel->rayIntersect(rays, its, hits, count, visibility, coherent);
+    }
+
+    /// Stream version of the compact hit query, misses have a \c nullptr mesh
+    void rayIntersect(const Ray3f *rays, Hit *hits, size_t count,
+                      uint32_t visibility = EVisibleIndirect, bool coherent = false) const {
+        m_accel->rayIntersect(rays, hits, count, visibility, coherent);
     }
 
-    bool rayOccluded(const Ray3f &ray, Intersection &its) const {
-        return m_accel->rayIntersect(ray, its, true);
+    /// Stream version of \ref rayOccluded()
+    void rayOccluded(const Ray3f *rays, bool *occluded, size_t count) const {
+        m_accel->rayOccluded(rays, occluded, count);
     }
 
 
@@ -126,11 +176,15 @@ public:
 
     EClassType getClassType() const { return EScene; }
 private:
+    PropertyList m_propList;
     std::vector<Mesh *> m_meshes;
     std::vector<Mesh *> m_lights;
+    std::vector<ShapeGroup *> m_shapeGroups;
+    std::vector<Instance *> m_instances;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
+    std::vector<Camera *> m_cameras;
     Accel *m_accel = nullptr;
     Texture<Color3f> *m_background = nullptr;
     // Color3f m_backgroundColor = Color3f(0.05f);
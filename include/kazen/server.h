@@ -0,0 +1,36 @@
+#pragma once
+
+#include <kazen/renderer.h>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(server)
+
+/// Default port of the tev image viewer
+#define KAZEN_TEV_PORT 14158
+
+/**
+ * \brief Interactive preview: keep the scene loaded and re-render on request
+ *
+ * Renders the scene progressively and streams the finished blocks to the
+ * tev image viewer (https://github.com/Tom94/tev) at \c tevAddress
+ * ("host:port"). Meanwhile, commands are accepted one per line on the
+ * localhost TCP port \c port. Each command stops the render in flight and
+ * starts over with the change applied:
+ *
+ * <pre>
+ *   lookat ox oy oz tx ty tz ux uy uz   place the active camera
+ *   camera &lt;id&gt;                         switch to another camera of the scene
+ *   resolution &lt;w&gt; &lt;h&gt;                 change the image size
+ *   spp &lt;n&gt;                            stop refining after n samples per pixel
+ *   pass-spp &lt;n&gt;                       samples per pixel of each pass
+ *   restart                            render again from scratch
+ *   quit                               shut down the server
+ * </pre>
+ *
+ * Every command is answered with "ok" or "error: <message>". The function
+ * returns after "quit". Not available on Windows, where it throws.
+ */
+void run(Scene *scene, const renderer::RenderOptions &options, int port, const std::string &tevAddress);
+
+NAMESPACE_END(server)
+NAMESPACE_END(kazen)
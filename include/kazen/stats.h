@@ -0,0 +1,76 @@
+#pragma once
+
+#include <kazen/common.h>
+#include <array>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(stats)
+
+/// Events counted during rendering
+enum ECounter {
+    /// Primary rays generated by the camera
+    ECameraRays = 0,
+    /// Closest-hit queries (camera and extension rays)
+    EIntersectRays,
+    /// Any-hit queries of shadow rays
+    EShadowRays,
+    EBSDFEval,
+    EBSDFSample,
+    EBSDFPdf,
+    /// Lookups in OpenImageIO's texture system
+    ETextureLookups,
+    /// Paths stopped by Russian roulette
+    ERussianRoulette,
+    ECounterCount
+};
+
+/// Number of bins of the path length histogram, the last one collects all longer paths
+constexpr int PathLengthBins = 32;
+
+/// Counters of one thread, or the sum over all threads
+struct Counters {
+    std::array<uint64_t, ECounterCount> counters {};
+    std::array<uint64_t, PathLengthBins> pathLengths {};
+    /// Sum of the lengths of all paths
+    uint64_t bounces = 0;
+
+    Counters &operator+=(const Counters &other);
+};
+
+/// Return the counters of the calling thread (created on first use)
+Counters &local();
+
+/// Count \c n events of the given type on the calling thread
+inline void add(ECounter counter, uint64_t n = 1) {
+    local().counters[counter] += n;
+}
+
+/// Record a finished path with \c length bounces on the calling thread
+inline void addPathLength(int length) {
+    Counters &counters = local();
+    counters.pathLengths[std::min(std::max(length, 0), PathLengthBins - 1)]++;
+    counters.bounces += std::max(length, 0);
+}
+
+/// Clear the counters of every thread (not thread-safe, call while no render is running)
+void reset();
+
+/// Sum the counters of every thread (not thread-safe, call while no render is running)
+Counters collect();
+
+/**
+ * \brief Human-readable report of \c counters
+ *
+ * \param seconds
+ *     Duration of the render, used for ray throughput
+ */
+std::string toString(const Counters &counters, double seconds);
+
+/// Like \ref toString(), but formatted as JSON
+std::string toJSON(const Counters &counters, double seconds);
+
+/// Log the statistics of the last render and save them to <tt>basename_stats.{txt,json}</tt>
+void report(const std::string &basename, double seconds);
+
+NAMESPACE_END(stats)
+NAMESPACE_END(kazen)
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <kazen/common.h>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(test)
+
+/**
+ * \brief Minimal unit test support for test_kazen
+ *
+ * Test cases are declared with \ref KAZEN_TEST in the files under test/
+ * and register themselves at static initialization. test_kazen runs all
+ * of them, or those whose name contains the filter given on the command
+ * line. A failed check is reported and the test goes on; the process
+ * exits with a non-zero status if any check failed.
+ */
+struct Registration {
+    Registration(const char *name, void (*func)());
+};
+
+/// Report a failed check
+void fail(const char *file, int line, const std::string &message);
+
+/// Run the registered tests whose name contains \c filter, return the number of failed tests
+int run(const std::string &filter = "");
+
+/// Return a file name in the temporary directory, unique to this process
+std::string tempFilename(const std::string &name);
+
+NAMESPACE_END(test)
+NAMESPACE_END(kazen)
+
+/// Declare a test case
+#define KAZEN_TEST(name) \
+    static void name(); \
+    static kazen::test::Registration name##Registration(#name, name); \
+    static void name()
+
+/// Check a condition
+#define KAZEN_CHECK(cond) \
+    do { if (!(cond)) kazen::test::fail(__FILE__, __LINE__, #cond); } while (0)
+
+/// Check that two values are equal, printing both otherwise
+#define KAZEN_CHECK_EQUAL(a, b) \
+    do { auto _a = (a); auto _b = (b); if (!(_a == _b)) \
+        kazen::test::fail(__FILE__, __LINE__, fmt::format("{} == {} ({} vs {})", #a, #b, _a, _b)); } while (0)
+
+/// Check that two numbers differ by at most \c tol
+#define KAZEN_CHECK_CLOSE(a, b, tol) \
+    do { double _a = (a), _b = (b); if (!(std::abs(_a - _b) <= (tol))) \
+        kazen::test::fail(__FILE__, __LINE__, fmt::format("{} ~ {} ({} vs {})", #a, #b, _a, _b)); } while (0)
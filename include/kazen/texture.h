@@ -9,9 +9,9 @@ template<typename T>
 class Texture : public Object {
 public:
 
-    virtual Color3f eval(const Point2f &uv) const { return Color3f(0.f); };
+    virtual Color3f eval(const Point2f &) const { return Color3f(0.f); };
 
-    virtual Color3f eval(const Vector3f &dir) const { return Color3f(0.f); }
+    virtual Color3f eval(const Vector3f &) const { return Color3f(0.f); }
 
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <kazen/common.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+#include <memory>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(threading)
+
+/**
+ * \brief Limit the threads used by kazen and the libraries it drives
+ *
+ * Applies to the TBB scheduler (render workers and parallel loops), the
+ * embree BVH builder and OpenImageIO. Call this before loading the scene,
+ * embree reads its configuration when the device is created.
+ *
+ * \param threadCount
+ *     Number of threads, 0 uses every core available to the process
+ * \param pinThreads
+ *     Pin the threads of the render arenas to cores and let embree set
+ *     the affinity of its own threads
+ */
+void configure(int threadCount, bool pinThreads);
+
+/// Return the number of threads that kazen may use
+int getThreadCount();
+
+/// Are threads pinned to cores?
+bool getPinThreads();
+
+/// Return the configuration string for \c rtcNewDevice()
+std::string getEmbreeConfig();
+
+/**
+ * \brief Pin the threads that join \c arena to cores
+ *
+ * Slot \c i of the arena is pinned to the <tt>firstCore + i</tt>-th core
+ * that the process may run on (wrapping around). Pinning lasts as long as
+ * the returned observer exists. Returns \c nullptr when pinning is disabled
+ * or unsupported on this platform.
+ */
+std::unique_ptr<tbb::task_scheduler_observer> pinArena(tbb::task_arena &arena, int firstCore = 0);
+
+NAMESPACE_END(threading)
+NAMESPACE_END(kazen)
@@ -27,6 +27,9 @@ public:
     Transform(const Eigen::Matrix4f &trafo, const Eigen::Matrix4f &inv) 
         : m_transform(trafo), m_inverse(inv) { }
 
+    /// Camera-to-world transform of a camera at \c origin looking at \c target
+    static Transform lookAt(const Vector3f &origin, const Vector3f &target, const Vector3f &up);
+
     /// Return the underlying matrix
     const Eigen::Matrix4f &getMatrix() const {
         return m_transform;
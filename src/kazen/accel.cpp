@@ -1,69 +1,310 @@
 #include <kazen/accel.h>
-#include <kazen/timer.h>
+#include <kazen/profiler.h>
 #include <kazen/bsdf.h>
 #include <kazen/light.h>
+#include <kazen/threading.h>
+#include <kazen/stats.h>
 #include <Eigen/Geometry>
+#include <map>
 
 NAMESPACE_BEGIN(kazen)
 
+static PropertyList accelOverrides;
+
+void AccelOptions::configure(const PropertyList &propList) {
+    std::string name = string::toLower(propList.getString("accel", ""));
+    if (name == "embree")
+        backend = EEmbree;
+    else if (name == "bvh")
+        backend = ENative;
+    else if (!name.empty())
+        throw Exception("Unknown accel \"{}\" (expected embree or bvh)", name);
+
+    std::string level = string::toLower(propList.getString("accelQuality", ""));
+    if (level == "low")
+        quality = ELowQuality;
+    else if (level == "medium")
+        quality = EMediumQuality;
+    else if (level == "high")
+        quality = EHighQuality;
+    else if (!level.empty())
+        throw Exception("Unknown accel build quality \"{}\" (expected low, medium or high)", level);
+
+    compact = propList.getBoolean("accelCompact", compact);
+    robust = propList.getBoolean("accelRobust", robust);
+    deviceConfig = propList.getString("embreeConfig", deviceConfig);
+}
+
+void AccelOptions::setOverrides(const PropertyList &propList) {
+    accelOverrides = propList;
+}
+
+const PropertyList &AccelOptions::getOverrides() {
+    return accelOverrides;
+}
+
+std::string AccelOptions::toString() const {
+    static const char *backendNames[] = { "embree", "bvh" };
+    static const char *qualityNames[] = { "low", "medium", "high" };
+    return fmt::format("AccelOptions[backend={}, quality={}, compact={}, robust={}, deviceConfig=\"{}\"]",
+                       backendNames[backend], qualityNames[quality], compact, robust, deviceConfig);
+}
+
 void Accel::clear() {
     for (auto &mesh : m_meshes)
         delete mesh;
     m_meshes.clear();
+    m_instances.clear();
 
-    rtcReleaseScene(m_scene); 
+    if (m_scene)
+        rtcReleaseScene(m_scene); 
     m_scene = nullptr;
 
-    rtcReleaseDevice(m_device); 
+    for (RTCScene scene : m_groupScenes)
+        rtcReleaseScene(scene);
+    m_groupScenes.clear();
+
+    m_bvh.reset();
+    m_groupBVHs.clear();
+
+    m_memory = 0;
+    m_peakMemory = 0;
+
+    if (m_device)
+        rtcReleaseDevice(m_device); 
     m_device = nullptr;
 }
 
 void Accel::addMesh(Mesh *mesh) {
     m_meshes.push_back(mesh);
+    m_bbox.expandBy(mesh->getBoundingBox());
+}
+
+void Accel::addInstance(const Instance *instance) {
+    m_instances.push_back(instance);
+    m_bbox.expandBy(instance->getBoundingBox());
+}
+
+/* Stand-in for ray masks on embree builds without them: reject the hits on
+   geometry the ray may not see, its visibility is kept in the user pointer */
+static void visibilityFilter(const RTCFilterFunctionNArguments *args) {
+    uint32_t visibility = (uint32_t) (uintptr_t) args->geometryUserPtr;
+    RTCRayN *ray = (RTCRayN *) args->ray;
+    for (unsigned int i = 0; i < args->N; ++i) {
+        if (args->valid[i] != 0 && (RTCRayN_mask(ray, args->N, i) & visibility) == 0)
+            args->valid[i] = 0;
+    }
+}
+
+/* Create the embree geometry of a mesh and attach it to a scene */
+static void attachMesh(RTCDevice device, RTCScene scene, const Mesh *mesh, unsigned int geomID, bool rayMasks) {
+    RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+
+    /* fill in geom's vertex and index buffer here */
+    rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, mesh->getVertexPositions().data(), 0, 3*sizeof(float), mesh->getVertexCount());
+    rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, mesh->getIndices().data(), 0, 3*sizeof(unsigned), mesh->getTriangleCount());
+
+    /* restrict the ray types that can hit the mesh */
+    uint32_t visibility = mesh->getVisibility();
+    if (rayMasks) {
+        rtcSetGeometryMask(geom, visibility);
+    } else if (visibility != EVisibleAll) {
+        rtcSetGeometryUserData(geom, (void *) (uintptr_t) visibility);
+        rtcSetGeometryIntersectFilterFunction(geom, visibilityFilter);
+        rtcSetGeometryOccludedFilterFunction(geom, visibilityFilter);
+    }
+
+    rtcCommitGeometry(geom);
+    rtcAttachGeometryByID(scene, geom, geomID);
+    rtcReleaseGeometry(geom);
+}
+
+bool Accel::memoryMonitor(void *ptr, ssize_t bytes, bool) {
+    Accel *accel = static_cast<Accel *>(ptr);
+    ssize_t memory = accel->m_memory += bytes;
+    ssize_t peak = accel->m_peakMemory.load();
+    while (memory > peak && !accel->m_peakMemory.compare_exchange_weak(peak, memory)) { }
+    return true;
+}
+
+RTCScene Accel::newScene() const {
+    static const RTCBuildQuality qualities[] = {
+        RTC_BUILD_QUALITY_LOW, RTC_BUILD_QUALITY_MEDIUM, RTC_BUILD_QUALITY_HIGH
+    };
+
+    RTCSceneFlags flags = RTC_SCENE_FLAG_NONE;
+    if (m_options.compact)
+        flags |= RTC_SCENE_FLAG_COMPACT;
+    if (m_options.robust)
+        flags |= RTC_SCENE_FLAG_ROBUST;
+
+    RTCScene scene = rtcNewScene(m_device);
+    rtcSetSceneFlags(scene, flags);
+    rtcSetSceneBuildQuality(scene, qualities[m_options.quality]);
+    return scene;
 }
 
 void Accel::build() {
-    Timer timer;
-    LOG("================");
-    /* create new Embree device */
-    m_device = rtcNewDevice(nullptr); // "verbose=1"
-    if (!m_device) {
-        std::cerr << "Error " << rtcGetDeviceError(nullptr) << " cannot create device" << std::endl;
+    if (m_options.backend == AccelOptions::ENative) {
+        buildBVH();
+        return;
     }
 
+    profiler::Scope scope("Accel::build");
+    LOG("================");
+    /* create new Embree device, later config entries override earlier ones */
+    std::string config = threading::getEmbreeConfig();
+    if (!m_options.deviceConfig.empty())
+        config += "," + m_options.deviceConfig;
+    m_device = rtcNewDevice(config.c_str()); // "verbose=1"
+    if (!m_device)
+        throw Exception("Unable to create the embree device (error {}, config \"{}\")", (int) rtcGetDeviceError(nullptr), config);
+    rtcSetDeviceMemoryMonitorFunction(m_device, memoryMonitor, this);
+
     /* create scene */
-    m_scene = rtcNewScene(m_device);
-    rtcSetSceneFlags(m_scene, RTC_SCENE_FLAG_ROBUST);
-    rtcSetSceneBuildQuality(m_scene, RTC_BUILD_QUALITY_HIGH);
+    m_scene = newScene();
+    bool rayMasks = rtcGetDeviceProperty(m_device, RTC_DEVICE_PROPERTY_RAY_MASK_SUPPORTED) != 0;
 
-    /* add meshes */
+    /* add meshes, the geometry ID is the index in m_meshes */
     unsigned int geomID = 0;
-    for (auto &mesh : m_meshes) {
-        RTCGeometry geom = rtcNewGeometry(m_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-
-        /* fill in geom's vertex and index buffer here */
-        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, mesh->getVertexPositions().data(), 0, 3*sizeof(float), mesh->getVertexCount());
-        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, mesh->getIndices().data(), 0, 3*sizeof(unsigned), mesh->getTriangleCount());
+    for (auto &mesh : m_meshes)
+        attachMesh(m_device, m_scene, mesh, geomID++, rayMasks);
+
+    /* add instances, each shape group is built once into a sub-scene */
+    std::map<const ShapeGroup *, RTCScene> groupScenes;
+    for (const Instance *instance : m_instances) {
+        const ShapeGroup *group = instance->getShapeGroup();
+        RTCScene &groupScene = groupScenes[group];
+        if (!groupScene) {
+            groupScene = newScene();
+            unsigned int meshID = 0;
+            for (const Mesh *mesh : group->getMeshes())
+                attachMesh(m_device, groupScene, mesh, meshID++, rayMasks);
+            rtcCommitScene(groupScene);
+            m_groupScenes.push_back(groupScene);
+        }
 
-        /* set id for each geometry */
+        RTCGeometry geom = rtcNewGeometry(m_device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryInstancedScene(geom, groupScene);
+        rtcSetGeometryTransform(geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, instance->getToWorld().getMatrix().data());
         rtcCommitGeometry(geom);
-        rtcAttachGeometryByID(m_scene, geom, geomID);
+        rtcAttachGeometryByID(m_scene, geom, geomID++);
         rtcReleaseGeometry(geom);
-
-        /* increase this shit */
-        geomID++;
     }
     
     /* commit changes to scene */
     rtcCommitScene(m_scene);
 
-    LOG("Embree ready.  (took {})", util::timeString(timer.elapsed()));
+    m_buildTime = scope.elapsed();
+    if (!m_instances.empty())
+        LOG("Instances: {} of {} shape groups.", m_instances.size(), m_groupScenes.size());
+    LOG("Embree ready.  (took {}, {} in use, {} at peak)", util::timeString(m_buildTime),
+        util::memString(getMemoryUsage()), util::memString(getPeakMemoryUsage()));
 }
 
-bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
-    bool foundIntersection = false;  // Was an intersection found so far?
-    uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
-    Ray3f ray(ray_);
+void Accel::buildBVH() {
+    profiler::Scope scope("Accel::build (bvh)");
+    LOG("================");
+
+    /* each shape group is built once, its instances share the hierarchy */
+    std::map<const ShapeGroup *, const BVH *> groupBVHs;
+    std::vector<BVH::InstanceRef> instances;
+    for (const Instance *instance : m_instances) {
+        const ShapeGroup *group = instance->getShapeGroup();
+        const BVH *&groupBVH = groupBVHs[group];
+        if (!groupBVH) {
+            std::vector<const Mesh *> meshes(group->getMeshes().begin(), group->getMeshes().end());
+            m_groupBVHs.emplace_back(new BVH(meshes));
+            groupBVH = m_groupBVHs.back().get();
+        }
+        instances.push_back({ groupBVH, instance->getToWorld() });
+    }
+
+    /* the mesh and instance indices of the hits are those of m_meshes and m_instances */
+    std::vector<const Mesh *> meshes(m_meshes.begin(), m_meshes.end());
+    m_bvh.reset(new BVH(meshes, instances));
+
+    size_t memory = m_bvh->getMemoryUsage();
+    for (const auto &groupBVH : m_groupBVHs)
+        memory += groupBVH->getMemoryUsage();
+    m_memory = m_peakMemory = (ssize_t) memory;
+
+    m_buildTime = scope.elapsed();
+    if (!m_instances.empty())
+        LOG("Instances: {} of {} shape groups.", m_instances.size(), m_groupBVHs.size());
+    LOG("BVH ready.  (took {}, {})", util::timeString(m_buildTime), util::memString(memory));
+}
+
+/* Fill in an embree ray record */
+static void initRay(const Ray3f &ray, RTCRay &r, uint32_t visibility) {
+    r.org_x = ray.o.x(); 
+    r.org_y = ray.o.y(); 
+    r.org_z = ray.o.z();
+    r.dir_x = ray.d.x(); 
+    r.dir_y = ray.d.y(); 
+    r.dir_z = ray.d.z();
+    r.tnear  = ray.mint;
+    r.tfar   = ray.maxt;
+    r.time   = 0.f;
+    r.mask   = visibility;
+    r.flags  = 0;
+}
+
+static void initRayHit(const Ray3f &ray, RTCRayHit &rayhit, uint32_t visibility) {
+    initRay(ray, rayhit.ray, visibility);
+    rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+}
+
+void Accel::fillHit(const RTCRayHit &rayhit, Hit &hit) const {
+    if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+        hit.mesh = nullptr;
+        return;
+    }
+    hit.t = rayhit.ray.tfar;
+    hit.uv = Point2f(rayhit.hit.u, rayhit.hit.v);
+    hit.primID = rayhit.hit.primID;
+
+    /* The geometry ID is relative to the sub-scene for hits on an instance */
+    unsigned int instID = rayhit.hit.instID[0];
+    if (instID == RTC_INVALID_GEOMETRY_ID) {
+        hit.mesh = m_meshes[rayhit.hit.geomID];
+        hit.toWorld = nullptr;
+    } else {
+        const Instance *instance = m_instances[instID - m_meshes.size()];
+        hit.mesh = instance->getShapeGroup()->getMeshes()[rayhit.hit.geomID];
+        hit.toWorld = &instance->getToWorld();
+    }
+}
+
+void Accel::fillHit(const BVH::Result &result, Hit &hit) const {
+    hit.t = result.t;
+    hit.uv = Point2f(result.u, result.v);
+    hit.primID = result.primID;
+
+    if (result.instID == BVH::InvalidID) {
+        hit.mesh = m_meshes[result.geomID];
+        hit.toWorld = nullptr;
+    } else {
+        const Instance *instance = m_instances[result.instID];
+        hit.mesh = instance->getShapeGroup()->getMeshes()[result.geomID];
+        hit.toWorld = &instance->getToWorld();
+    }
+}
+
+bool Accel::rayIntersect(const Ray3f &ray, Hit &hit, uint32_t visibility) const {
+    KAZEN_PROFILE("Accel::rayIntersect");
+    stats::add(stats::EIntersectRays);
+
+    if (m_bvh) {
+        BVH::Result result;
+        if (!m_bvh->rayIntersect(ray, visibility, result)) {
+            hit.mesh = nullptr;
+            return false;
+        }
+        fillHit(result, hit);
+        return true;
+    }
 
     /* initialize intersect context */
     RTCIntersectContext context;
@@ -71,171 +312,167 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
 
     /* initialize ray */
     RTCRayHit rayhit; 
-    rayhit.ray.org_x = ray.o.x(); 
-    rayhit.ray.org_y = ray.o.y(); 
-    rayhit.ray.org_z = ray.o.z();
-    rayhit.ray.dir_x = ray.d.x(); 
-    rayhit.ray.dir_y = ray.d.y(); 
-    rayhit.ray.dir_z = ray.d.z();
-    rayhit.ray.tnear  = ray.mint;
-    rayhit.ray.tfar   = ray.maxt;
-    rayhit.ray.mask = -1;
-    rayhit.ray.flags = 0;
-    rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    initRayHit(ray, rayhit, visibility);
 
-    /* NOTICE: rtcOccluded1 should not use in this way */
-    /* trace shadow ray */
-    // if (shadowRay) {
-    //     rtcOccluded1(m_scene, &context, &rayhit.ray);
-    //     if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
-    //         return true;
-    //     } else {
-    //         return false;
-    //     }
-    // }
-    
     /* intersect ray with scene */
     rtcIntersect1(m_scene, &context, &rayhit);
-    if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID) {
-        if (shadowRay) { // trace shadow ray
-            its.t = rayhit.ray.tfar;
-            its.mesh = m_meshes[rayhit.hit.geomID];
-            return true;
-        }
-        ray.maxt = its.t = rayhit.ray.tfar;
-        its.uv = Point2f(rayhit.hit.u, rayhit.hit.v); // prim_uv
-        its.mesh = m_meshes[rayhit.hit.geomID];
-        f = rayhit.hit.primID;
-        foundIntersection = true;
-    }
-
-    /* post intersection */
-    if (foundIntersection) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-        Normal3f n0 = N.col(idx0), n1 = N.col(idx1), n2 = N.col(idx2);
-        // /* Compute the intersection positon accurately
-        //    using barycentric coordinates */
-        // its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-        
-        // [Hacking the Shadow Terminator. Johannes Hanika. 2021] https://jo.dreggn.org/home/2021_terminator.pdf
-        Point3f orignP = bary.x()*p0 + bary.y()*p1 + bary.z()*p2;
-        // get distance vectors from triangle vertices
-        Vector3f tmpu=orignP-p0, tmpv=orignP-p1, tmpw=orignP-p2;
-        // project these onto the tangent planes, defined by the shading normals
-        float dotu = std::min(0.f, tmpu.dot(n0));
-        float dotv = std::min(0.f, tmpv.dot(n1));
-        float dotw = std::min(0.f, tmpw.dot(n2));
-        tmpu -= dotu*n0;
-        tmpv -= dotv*n1;
-        tmpw -= dotw*n2;
-        // finally P' is the barycentric mean of these three
-        its.p = orignP + bary.x()*tmpu + bary.y()*tmpv + bary.z()*tmpw;
-
-        /* Compute the geometry frame */
-        Vector3f dp0 = p1 - p0, 
-                 dp1 = p2 - p0;
-        its.geoFrame = Frame(dp0.cross(dp1).normalized());
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) + 
-                     bary.y() * UV.col(idx1) + 
-                     bary.z() * UV.col(idx2);
-        
-        if (likely(N.size() > 0 && UV.size() > 0)) {
-            Point2f uv0 = UV.col(idx0), 
-                    uv1 = UV.col(idx1), 
-                    uv2 = UV.col(idx2);
-
-            Vector3f dp0 = p1 - p0, 
-                     dp1 = p2 - p0;
-            
-            Point2f duv0 = uv1 - uv0, 
-                    duv1 = uv2 - uv0;
-
-            Normal3f shNormal = bary.x() * n0 + bary.y() * n1 + bary.z() * n2;
-            
-            float length = dp0.cross(dp1).norm();
-            if (length > 0.f) {
-                
-                float determinant = duv0.x()*duv1.y() - duv0.y()*duv1.x();
-                if (determinant > 0.f) {
-                    float invDet = 1.0f / determinant;
-                    its.dpdu = ( duv1.y() * dp0 - duv0.y() * dp1) * invDet;
-                    its.dpdv = (-duv1.x() * dp0 + duv0.x() * dp1) * invDet;
-
-                    /* TODO: Add dndu dndv */
-                    // float invLN = 1.f / shNormal.norm(); 
-                    // shNormal.normalize();
-
-                    // Vector3f dndu = (n1 - n0) * invLN;
-                    // Vector3f dndv = (n2 - n0) * invLN;
-                    // dndu -= shNormal * shNormal.dot(dndu);
-                    // dndv -= shNormal * shNormal.dot(dndv);
-
-                    // its.dndu = (duv1.y()*dndu - duv0.y()*dndv) * invDet;
-                    // its.dndv = (-duv1.x()*dndu + duv0.x()*dndv) * invDet;
-
-                    its.shFrame.n = shNormal.normalized();
-                    its.shFrame.s = (its.dpdu - shNormal * shNormal.dot(its.dpdu)).normalized();
-                    its.shFrame.t = its.shFrame.n.cross(its.shFrame.s).normalized(); 
-                } else {
-                    /* The user-specified parameterization is degenerate. Pick
-                    arbitrary tangents that are perpendicular to the geometric normal */
-                    // coordinateSystem(n.normalized(), its.dpdu, its.dpdv);
-
-                    its.shFrame = Frame(shNormal.normalized());
-                    its.dpdu = its.shFrame.s; 
-                    its.dpdv = its.shFrame.t;
-                    its.dndu = Vector3f(0.f);
-                    its.dndv = Vector3f(0.f);  
-                }                
-            } else {
-                its.shFrame = Frame(shNormal.normalized());
-            }
+    fillHit(rayhit, hit);
+    return hit.isValid();
+}
+
+bool Accel::rayIntersect(const Ray3f &ray, Intersection &its, uint32_t visibility) const {
+    Hit hit;
+    if (!rayIntersect(ray, hit, visibility))
+        return false;
+
+    hit.mesh->computeIntersection(hit, its);
+    return true;
+}
+
+bool Accel::rayOccluded(const Ray3f &ray) const {
+    KAZEN_PROFILE("Accel::rayOccluded");
+    stats::add(stats::EShadowRays);
+
+    if (m_bvh)
+        return m_bvh->rayOccluded(ray, EVisibleShadow);
+
+    RTCIntersectContext context;
+    rtcInitIntersectContext(&context);
+
+    RTCRay r;
+    initRay(ray, r, EVisibleShadow);
+
+    /* embree sets tfar to -inf when any hit was found */
+    rtcOccluded1(m_scene, &context, &r);
+    return r.tfar < 0.f;
+}
+
+void Accel::rayOccluded(const Ray3f *rays, bool *occluded, size_t count) const {
+    KAZEN_PROFILE("Accel::rayOccluded (stream)");
+    stats::add(stats::EShadowRays, count);
+
+    if (m_bvh) {
+        for (size_t i = 0; i < count; ++i)
+            occluded[i] = m_bvh->rayOccluded(rays[i], EVisibleShadow);
+        return;
+    }
+
+    RTCIntersectContext context;
+    rtcInitIntersectContext(&context);
+
+    RTCRay chunk[KAZEN_RAY_STREAM_SIZE];
+    for (size_t begin = 0; begin < count; begin += KAZEN_RAY_STREAM_SIZE) {
+        size_t size = std::min(count - begin, (size_t) KAZEN_RAY_STREAM_SIZE);
+        for (size_t i = 0; i < size; ++i)
+            initRay(rays[begin + i], chunk[i], EVisibleShadow);
+
+        rtcOccluded1M(m_scene, &context, chunk, (unsigned int) size, sizeof(RTCRay));
+
+        for (size_t i = 0; i < size; ++i)
+            occluded[begin + i] = chunk[i].tfar < 0.f;
+    }
+}
+
+void Accel::rayIntersect(const Ray3f *rays, Intersection *its, bool *hits, size_t count,
+                         uint32_t visibility, bool coherent) const {
+    /* Trace chunks of compact hits, then expand them */
+    Hit chunk[KAZEN_RAY_STREAM_SIZE];
+    for (size_t begin = 0; begin < count; begin += KAZEN_RAY_STREAM_SIZE) {
+        size_t size = std::min(count - begin, (size_t) KAZEN_RAY_STREAM_SIZE);
+        rayIntersect(rays + begin, chunk, size, visibility, coherent);
+
+        for (size_t i = 0; i < size; ++i) {
+            hits[begin + i] = chunk[i].isValid();
+            if (hits[begin + i])
+                chunk[i].mesh->computeIntersection(chunk[i], its[begin + i]);
         }
-        else {
-            if (N.size() > 0) {
-                /* Compute the shading frame. Note that for simplicity,
-                the current implementation doesn't attempt to provide
-                tangents that are continuous across the surface. That
-                means that this code will need to be modified to be able
-                use anisotropic BRDFs, which need tangent continuity */
-
-                its.shFrame = Frame(
-                    (bary.x() * N.col(idx0) +
-                    bary.y() * N.col(idx1) +
-                    bary.z() * N.col(idx2)).normalized());
-            } 
-            else {
-                /* No normals provided. Use the geometric frame */
-                its.shFrame = its.geoFrame;
-            }
+    }
+}
+
+void Accel::rayIntersect(const Ray3f *rays, Hit *hits, size_t count, uint32_t visibility, bool coherent) const {
+    KAZEN_PROFILE("Accel::rayIntersect (stream)");
+    stats::add(stats::EIntersectRays, count);
+
+    /* the built-in BVH has no stream or packet traversal, rays are traced one by one */
+    if (m_bvh) {
+        for (size_t i = 0; i < count; ++i) {
+            BVH::Result result;
+            if (m_bvh->rayIntersect(rays[i], visibility, result))
+                fillHit(result, hits[i]);
+            else
+                hits[i].mesh = nullptr;
         }
+        return;
+    }
+
+    if (coherent) {
+        rayIntersectPackets(rays, hits, count, visibility);
+        return;
     }
 
-    return foundIntersection;
+    RTCIntersectContext context;
+    rtcInitIntersectContext(&context);
+
+    /* The stream is traced in fixed-size chunks that live on the stack */
+    RTCRayHit rayhits[KAZEN_RAY_STREAM_SIZE];
+    for (size_t begin = 0; begin < count; begin += KAZEN_RAY_STREAM_SIZE) {
+        size_t size = std::min(count - begin, (size_t) KAZEN_RAY_STREAM_SIZE);
+        for (size_t i = 0; i < size; ++i)
+            initRayHit(rays[begin + i], rayhits[i], visibility);
+
+        rtcIntersect1M(m_scene, &context, rayhits, (unsigned int) size, sizeof(RTCRayHit));
+
+        for (size_t i = 0; i < size; ++i)
+            fillHit(rayhits[i], hits[begin + i]);
+    }
+}
+
+void Accel::rayIntersectPackets(const Ray3f *rays, Hit *hits, size_t count, uint32_t visibility) const {
+    RTCIntersectContext context;
+    rtcInitIntersectContext(&context);
+    context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+    /* rtcIntersect16 expects the valid mask aligned like the packet (64 bytes) */
+    RTCRayHit16 packet;
+    alignas(64) int valid[KAZEN_RAY_PACKET_SIZE];
+    for (size_t begin = 0; begin < count; begin += KAZEN_RAY_PACKET_SIZE) {
+        size_t size = std::min(count - begin, (size_t) KAZEN_RAY_PACKET_SIZE);
+
+        /* Unused lanes of the last packet are masked out */
+        for (size_t i = 0; i < KAZEN_RAY_PACKET_SIZE; ++i) {
+            valid[i] = i < size ? -1 : 0;
+            if (i >= size)
+                continue;
+
+            const Ray3f &ray = rays[begin + i];
+            packet.ray.org_x[i] = ray.o.x();
+            packet.ray.org_y[i] = ray.o.y();
+            packet.ray.org_z[i] = ray.o.z();
+            packet.ray.dir_x[i] = ray.d.x();
+            packet.ray.dir_y[i] = ray.d.y();
+            packet.ray.dir_z[i] = ray.d.z();
+            packet.ray.tnear[i] = ray.mint;
+            packet.ray.tfar[i]  = ray.maxt;
+            packet.ray.time[i]  = 0.f;
+            packet.ray.mask[i]  = visibility;
+            packet.ray.flags[i] = 0;
+            packet.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+            packet.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        rtcIntersect16(valid, m_scene, &context, &packet);
+
+        for (size_t i = 0; i < size; ++i) {
+            RTCRayHit rayhit;
+            rayhit.ray.tfar   = packet.ray.tfar[i];
+            rayhit.hit.u      = packet.hit.u[i];
+            rayhit.hit.v      = packet.hit.v[i];
+            rayhit.hit.primID = packet.hit.primID[i];
+            rayhit.hit.geomID = packet.hit.geomID[i];
+            rayhit.hit.instID[0] = packet.hit.instID[0][i];
+            fillHit(rayhit, hits[begin + i]);
+        }
+    }
 }
 
 NAMESPACE_END(kazen)
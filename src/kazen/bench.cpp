@@ -0,0 +1,316 @@
+#include <kazen/common.h>
+#include <kazen/accel.h>
+#include <kazen/block.h>
+#include <kazen/bsdf.h>
+#include <kazen/dpdf.h>
+#include <kazen/pcg32.h>
+#include <kazen/proplist.h>
+#include <kazen/rfilter.h>
+#include <kazen/sampler.h>
+#include <kazen/texture.h>
+#include <kazen/warp.h>
+#include <chrono>
+#include <cstdio>
+
+using namespace kazen;
+
+/*
+ * Microbenchmarks of the kernels on the hot path of a render
+ *
+ * Every benchmark runs a single operation in a loop over precomputed random
+ * inputs, so that the time of the operation is not mixed with the cost of
+ * generating them. The loop is calibrated to run for a while and the best
+ * of a few repetitions is reported.
+ */
+
+/* Number of precomputed inputs per benchmark (a power of two) */
+static const size_t InputCount = 4096;
+
+/* Minimum duration of one repetition in seconds */
+static const double MinDuration = 0.1;
+
+/* Keep the compiler from optimizing \c value (and its computation) away */
+template <typename T> static inline void doNotOptimize(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+static std::string filter;
+
+/* Is the benchmark \c name selected by the filter on the command line? */
+static bool selected(const std::string &name) {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+/**
+ * Time \c func, which performs \c opsPerCall operations per call with the
+ * given call index, and print the time per operation and the throughput
+ */
+template <typename Func> static void run(const std::string &name, Func func, size_t opsPerCall = 1) {
+    if (!selected(name))
+        return;
+
+    auto measure = [&](size_t calls) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i)
+            func(i);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    /* Calibrate the number of calls, then keep the fastest of three repetitions */
+    size_t calls = 64;
+    while (measure(calls) < MinDuration && calls < ((size_t) 1 << 40))
+        calls *= 2;
+    double best = measure(calls);
+    for (int i = 0; i < 2; ++i)
+        best = std::min(best, measure(calls));
+
+    double ns = best * 1e9 / (calls * opsPerCall);
+    fmt::print("  {:<44} {:>10.2f} ns/op {:>10.2f} Mops/s\n", name, ns, 1e3 / ns);
+}
+
+/* Uniform random numbers that all benchmarks draw their inputs from */
+static pcg32 rng;
+
+static Point2f next2D() {
+    float x = rng.nextFloat();
+    return Point2f(x, rng.nextFloat());
+}
+
+static void benchWarp() {
+    LOG("Warp");
+    std::vector<Point2f> samples(InputCount);
+    for (auto &s : samples)
+        s = next2D();
+    auto sample = [&](size_t i) { return samples[i & (InputCount - 1)]; };
+
+    run("Warp::squareToTent", [&](size_t i) { doNotOptimize(Warp::squareToTent(sample(i))); });
+    run("Warp::squareToUniformDisk", [&](size_t i) { doNotOptimize(Warp::squareToUniformDisk(sample(i))); });
+    run("Warp::squareToUniformSphere", [&](size_t i) { doNotOptimize(Warp::squareToUniformSphere(sample(i))); });
+    run("Warp::squareToUniformHemisphere", [&](size_t i) { doNotOptimize(Warp::squareToUniformHemisphere(sample(i))); });
+    run("Warp::squareToCosineHemisphere", [&](size_t i) { doNotOptimize(Warp::squareToCosineHemisphere(sample(i))); });
+    run("Warp::squareToBeckmann", [&](size_t i) { doNotOptimize(Warp::squareToBeckmann(sample(i), 0.3f)); });
+}
+
+static void benchDiscretePDF() {
+    LOG("DiscretePDF");
+    for (size_t entries : {16, 1024, 65536}) {
+        DiscretePDF dpdf(entries);
+        for (size_t i = 0; i < entries; ++i)
+            dpdf.append(rng.nextFloat());
+        dpdf.normalize();
+
+        std::vector<float> samples(InputCount);
+        for (auto &s : samples)
+            s = rng.nextFloat();
+        run(fmt::format("DiscretePDF::sample ({} entries)", entries),
+            [&](size_t i) { doNotOptimize(dpdf.sample(samples[i & (InputCount - 1)])); });
+    }
+}
+
+static void benchSamplers() {
+    LOG("Sampler");
+    for (const char *name : {"independent", "stratified", "correlated", "pmj02bn"}) {
+        PropertyList propList;
+        propList.setInteger("sampleCount", 64);
+        std::unique_ptr<Sampler> sampler(static_cast<Sampler *>(ObjectFactory::createInstance(name, propList)));
+
+        /* A new pixel sample every 16 dimensions, as in a path of a few bounces */
+        run(fmt::format("Sampler::next1D ({})", name), [&](size_t i) {
+            if ((i & 15) == 0)
+                sampler->generateSample(Point2i((i >> 4) & 63, (i >> 10) & 63), (i >> 4) & 63);
+            doNotOptimize(sampler->next1D());
+        });
+        run(fmt::format("Sampler::next2D ({})", name), [&](size_t i) {
+            if ((i & 7) == 0)
+                sampler->generateSample(Point2i((i >> 3) & 63, (i >> 9) & 63), (i >> 3) & 63);
+            doNotOptimize(sampler->next2D());
+        });
+    }
+}
+
+static void benchBSDFs() {
+    LOG("BSDF");
+
+    /* Query records for directions in the upper hemisphere */
+    Intersection its;
+    its.shFrame = its.geoFrame = Frame(Vector3f(0.f, 0.f, 1.f));
+    std::vector<BSDFQueryRecord> records;
+    std::vector<Point2f> samples2;
+    std::vector<float> samples1;
+    for (size_t i = 0; i < InputCount; ++i) {
+        Vector3f wi = Warp::squareToCosineHemisphere(next2D());
+        Vector3f wo = Warp::squareToCosineHemisphere(next2D());
+        BSDFQueryRecord bRec(wi, wo, ESolidAngle);
+        bRec.its = its;
+        bRec.uv = next2D();
+        records.push_back(bRec);
+        samples1.push_back(rng.nextFloat());
+        samples2.push_back(next2D());
+    }
+
+    for (const char *name : {"diffuse", "roughconductor", "roughdielectric", "kazenstandard"}) {
+        std::unique_ptr<BSDF> bsdf(static_cast<BSDF *>(ObjectFactory::createInstance(name, PropertyList())));
+
+        /* The standard surface reads its parameters from textures */
+        std::vector<std::unique_ptr<Object>> textures;
+        if (std::string(name) == "kazenstandard") {
+            for (const char *id : {"baseColor", "metallic", "roughness"}) {
+                textures.emplace_back(ObjectFactory::createInstance("constanttexture", PropertyList()));
+                textures.back()->setId(id);
+                bsdf->addChild(textures.back().get());
+            }
+        }
+        bsdf->activate();
+
+        run(fmt::format("BSDF::eval ({})", name), [&](size_t i) {
+            doNotOptimize(bsdf->eval(records[i & (InputCount - 1)]));
+        });
+        run(fmt::format("BSDF::pdf ({})", name), [&](size_t i) {
+            doNotOptimize(bsdf->pdf(records[i & (InputCount - 1)]));
+        });
+        run(fmt::format("BSDF::sample ({})", name), [&](size_t i) {
+            size_t k = i & (InputCount - 1);
+            BSDFQueryRecord bRec = records[k];
+            doNotOptimize(bsdf->sample(bRec, samples1[k], samples2[k]));
+        });
+    }
+}
+
+static void benchImageBlock() {
+    LOG("ImageBlock");
+    const int size = KAZEN_BLOCK_SIZE;
+    std::vector<Point2f> positions(InputCount);
+    for (auto &p : positions)
+        p = Point2f(rng.nextFloat() * size, rng.nextFloat() * size);
+
+    for (const char *name : {"box", "tent", "gaussian", "mitchell"}) {
+        std::unique_ptr<ReconstructionFilter> rfilter(
+            static_cast<ReconstructionFilter *>(ObjectFactory::createInstance(name, PropertyList())));
+        ImageBlock block(Vector2i(size, size), rfilter.get());
+        block.clear();
+
+        run(fmt::format("ImageBlock::put ({})", name), [&](size_t i) {
+            block.put(positions[i & (InputCount - 1)], Color3f(1.f));
+        });
+        doNotOptimize(block);
+    }
+}
+
+/* Prefix of the accel benchmarks of a backend */
+static std::string accelPrefix(AccelOptions::EBackend backend) {
+    return backend == AccelOptions::ENative ? "BVH::" : "Accel::";
+}
+
+static void benchAccel(const std::string &meshName, AccelOptions::EBackend backend) {
+    std::string prefix = accelPrefix(backend);
+    LOG("{}", prefix.substr(0, prefix.size() - 2));
+
+    /* Without a mesh given, intersect a finely tessellated sphere */
+    std::string filename = meshName;
+    if (filename.empty()) {
+        filename = "kazen_bench_sphere.obj";
+        writeSphereOBJ(filename, 256);
+    }
+    PropertyList propList;
+    propList.setString("filename", filename);
+    Mesh *mesh = static_cast<Mesh *>(ObjectFactory::createInstance("obj", propList));
+    mesh->activate();
+    if (meshName.empty())
+        std::remove(filename.c_str());
+
+    /* The accelerator owns the mesh from here on */
+    AccelOptions options;
+    options.backend = backend;
+    Accel accel(options);
+    accel.addMesh(mesh);
+    accel.build();
+
+    /* Rays from a sphere around the mesh towards points inside of its bounds,
+       the same ones for every backend */
+    rng = pcg32();
+    BoundingBox3f bbox = mesh->getBoundingBox();
+    float radius = bbox.getExtents().norm();
+    std::vector<Ray3f> rays;
+    for (size_t i = 0; i < InputCount; ++i) {
+        Point3f o = bbox.getCenter() + radius * Warp::squareToUniformSphere(next2D());
+        Point3f target = bbox.min + bbox.getExtents().cwiseProduct(Vector3f(rng.nextFloat(), rng.nextFloat(), rng.nextFloat()));
+        rays.push_back(Ray3f(o, (target - o).normalized()));
+    }
+
+    run(prefix + "rayIntersect", [&](size_t i) {
+        Intersection its;
+        doNotOptimize(accel.rayIntersect(rays[i & (InputCount - 1)], its));
+        doNotOptimize(its);
+    });
+    run(prefix + "rayIntersect (hit)", [&](size_t i) {
+        Hit hit;
+        doNotOptimize(accel.rayIntersect(rays[i & (InputCount - 1)], hit));
+        doNotOptimize(hit);
+    });
+    run(prefix + "rayOccluded", [&](size_t i) {
+        doNotOptimize(accel.rayOccluded(rays[i & (InputCount - 1)]));
+    });
+
+    const size_t count = KAZEN_RAY_STREAM_SIZE;
+    std::vector<Intersection> its(count);
+    std::unique_ptr<bool[]> hits(new bool[count]);
+    run(prefix + "rayIntersect (stream)", [&](size_t i) {
+        size_t begin = (i * count) & (InputCount - 1);
+        accel.rayIntersect(&rays[begin], its.data(), hits.get(), count);
+        doNotOptimize(hits[0]);
+    }, count);
+    run(prefix + "rayOccluded (stream)", [&](size_t i) {
+        size_t begin = (i * count) & (InputCount - 1);
+        accel.rayOccluded(&rays[begin], hits.get(), count);
+        doNotOptimize(hits[0]);
+    }, count);
+
+    /* The built-in BVH traces streams one ray at a time, packets are embree only */
+    if (backend == AccelOptions::ENative)
+        return;
+    run(prefix + "rayIntersect (packets)", [&](size_t i) {
+        size_t begin = (i * count) & (InputCount - 1);
+        accel.rayIntersect(&rays[begin], its.data(), hits.get(), count, EVisibleCamera, true);
+        doNotOptimize(hits[0]);
+    }, count);
+}
+
+int main(int argc, char **argv) {
+    std::string meshName;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            cout << "Syntax: " << argv[0] << " [--mesh <file.obj>] [<filter>]\n"
+                    "Runs the benchmarks whose name contains <filter> (default: all)" << endl;
+            return 0;
+        } else if (arg == "--mesh" && i + 1 < argc) {
+            meshName = argv[++i];
+        } else {
+            filter = arg;
+        }
+    }
+
+    try {
+        benchWarp();
+        benchDiscretePDF();
+        benchSamplers();
+        benchBSDFs();
+        benchImageBlock();
+
+        /* Only load a mesh when it is needed, run each backend on the same rays */
+        for (AccelOptions::EBackend backend : {AccelOptions::EEmbree, AccelOptions::ENative}) {
+            std::string prefix = accelPrefix(backend);
+            for (const char *name : {"rayOccluded", "rayIntersect (hit)", "rayIntersect (stream)",
+                                     "rayIntersect (packets)", "rayOccluded (stream)"}) {
+                if (selected(prefix + name)) {
+                    benchAccel(meshName, backend);
+                    break;
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include <kazen/bitmap.h>
 #include <kazen/common.h>
 #include <OpenImageIO/imageio.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 NAMESPACE_BEGIN(kazen)
 
@@ -20,47 +22,95 @@ Bitmap::Bitmap(const std::string &filename) {
     LOG("Reading a EXR file[{}x{}] from : {}", cols(), rows(), filename);   
 }
 
-void Bitmap::saveEXR(const std::string &filename) {
+void Bitmap::saveEXR(const std::string &filename, bool half, const std::vector<BitmapChannel> &channels) const {
 
     const std::string& path = filename + ".exr";
     LOG("Save file to ==> {}. Resolution: [{}x{}]", path, cols(), rows());
 
-    const int channels = 3;  // RGB
+    std::vector<const BitmapChannel *> extra;
+    for (const BitmapChannel &channel : channels)
+        if (channel.data.size() == (size_t) size())
+            extra.push_back(&channel);
+
+    const int channelCount = 3 + (int) extra.size();  // RGB and the extra channels
     std::unique_ptr<OIIO::ImageOutput> out = OIIO::ImageOutput::create(path);
     if (! out)
         return;
-    OIIO::ImageSpec spec(cols(), rows(), channels, OIIO::TypeDesc::FLOAT);
+    OIIO::ImageSpec spec(cols(), rows(), channelCount, half ? OIIO::TypeDesc::HALF : OIIO::TypeDesc::FLOAT);
+    for (size_t c = 0; c < extra.size(); ++c)
+        spec.channelnames[3 + c] = extra[c]->name;
     out->open(path, spec);
-    out->write_image(OIIO::TypeDesc::FLOAT, data());
+
+    if (extra.empty()) {
+        out->write_image(OIIO::TypeDesc::FLOAT, data());
+    } else {
+        /* Interleave the extra channels with the color */
+        std::vector<float> pixels((size_t) size() * channelCount);
+        for (size_t i = 0; i < (size_t) size(); ++i) {
+            float *pixel = &pixels[i * channelCount];
+            for (int c = 0; c < 3; ++c)
+                pixel[c] = data()[i][c];
+            for (size_t c = 0; c < extra.size(); ++c)
+                pixel[3 + c] = extra[c]->data[i];
+        }
+        out->write_image(OIIO::TypeDesc::FLOAT, pixels.data());
+    }
     out->close();
 }
 
-void Bitmap::savePNG(const std::string &filename) {
+/* Resolution of the sRGB lookup table on [0, 1]. Fine enough that the steep
+   start of the curve never skips more than one of the 256 output levels */
+static const int SRGBTableSize = 1 << 14;
+
+/* 8 bit sRGB value for each entry of the linear range */
+static const std::vector<uint8_t> &srgbTable() {
+    static const std::vector<uint8_t> table = [] {
+        std::vector<uint8_t> table(SRGBTableSize);
+        for (int i = 0; i < SRGBTableSize; ++i) {
+            float value = Color3f(i / (float) (SRGBTableSize - 1)).toSRGB()[0];
+            table[i] = (uint8_t) math::clamp(255.f * value, 0.f, 255.f);
+        }
+        return table;
+    }();
+    return table;
+}
+
+void Bitmap::toSRGB8(uint8_t *dst) const {
+    const uint8_t *table = srgbTable().data();
+    const int width = (int) cols() * 3;
+    tbb::parallel_for(tbb::blocked_range<int>(0, (int) rows()),
+        [&](const tbb::blocked_range<int> &range) {
+            std::vector<int> index(width);
+            for (int i = range.begin(); i < range.end(); ++i) {
+                const float *src = data()[i * cols()].data();
+                uint8_t *row = dst + (size_t) i * width;
+
+                /* Clamp and quantize the whole row first (vectorizes), then look up.
+                   With the constant first, std::max() maps NaN to 0 */
+                for (int k = 0; k < width; ++k)
+                    index[k] = (int) (std::min(1.f, std::max(0.f, src[k])) * (SRGBTableSize - 1) + 0.5f);
+                for (int k = 0; k < width; ++k)
+                    row[k] = table[index[k]];
+            }
+        });
+}
+
+void Bitmap::savePNG(const std::string &filename) const {
     
     const std::string& path = filename + ".png";
     LOG("Save file to ==> {}. Resolution: [{}x{}]", path, cols(), rows());
 
     const int channels = 3;  // RGB
-    uint8_t *rgb8 = new uint8_t[channels * cols() * rows()];
-    uint8_t *dst = rgb8;
-    for (int i = 0; i < rows(); ++i) {
-        for (int j = 0; j < cols(); ++j) {
-            Color3f tonemapped = coeffRef(i, j).toSRGB();
-            dst[0] = (uint8_t) math::clamp(255.f * tonemapped[0], 0.f, 255.f);
-            dst[1] = (uint8_t) math::clamp(255.f * tonemapped[1], 0.f, 255.f);
-            dst[2] = (uint8_t) math::clamp(255.f * tonemapped[2], 0.f, 255.f);
-            dst += 3;
-        }
-    }
+    std::unique_ptr<uint8_t[]> rgb8(new uint8_t[channels * cols() * rows()]);
+    toSRGB8(rgb8.get());
 
     std::unique_ptr<OIIO::ImageOutput> out = OIIO::ImageOutput::create(path);
     if (! out)
         return;
     OIIO::ImageSpec spec(cols(), rows(), channels, OIIO::TypeDesc::UINT8);
     out->open(path, spec);
-    out->write_image(OIIO::TypeDesc::UINT8, rgb8);
+    out->write_image(OIIO::TypeDesc::UINT8, rgb8.get());
     out->close();
-    delete[] rgb8;
 }
 
 NAMESPACE_END(kazen)
\ No newline at end of file
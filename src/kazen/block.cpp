@@ -3,11 +3,14 @@
 #include <kazen/rfilter.h>
 #include <kazen/bbox.h>
 #include <tbb/tbb.h>
+#include <OpenImageIO/imageio.h>
+#include <iostream>
+#include <cstring>
 
 NAMESPACE_BEGIN(kazen)
 
-ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter) 
-        : m_offset(0, 0), m_size(size) {
+ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter, bool moments, bool costs) 
+        : m_offset(0, 0), m_size(size), m_pixelStride(size.x()) {
     if (filter) {
         /* Tabulate the image reconstruction filter for performance reasons */
         m_filterRadius = filter->getRadius();
@@ -28,6 +31,12 @@ ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter)
 
     /* Allocate space for pixels and border regions */
     resize(size.y() + 2*m_borderSize, size.x() + 2*m_borderSize);
+
+    /* Sample statistics and costs are only kept for the pixels inside the block */
+    if (moments)
+        m_moments.resize((size_t) size.x() * size.y());
+    if (costs)
+        m_costs.resize((size_t) size.x() * size.y());
 }
 
 ImageBlock::~ImageBlock() {
@@ -38,12 +47,38 @@ ImageBlock::~ImageBlock() {
 
 Bitmap *ImageBlock::toBitmap() const {
     Bitmap *result = new Bitmap(m_size);
-    for (int y=0; y<m_size.y(); ++y)
-        for (int x=0; x<m_size.x(); ++x)
-            result->coeffRef(y, x) = coeff(y + m_borderSize, x + m_borderSize).divideByFilterWeight();
+    tbb::parallel_for(tbb::blocked_range<int>(0, m_size.y()),
+        [&](const tbb::blocked_range<int> &range) {
+            for (int y=range.begin(); y<range.end(); ++y)
+                for (int x=0; x<m_size.x(); ++x)
+                    result->coeffRef(y, x) = coeff(y + m_borderSize, x + m_borderSize).divideByFilterWeight();
+        });
     return result;
 }
 
+std::vector<BitmapChannel> ImageBlock::getCostChannels() const {
+    std::vector<BitmapChannel> channels = {
+        { "cost.time", {} }, { "cost.rays", {} }, { "cost.depth", {} }, { "cost.samples", {} }
+    };
+    if (m_costs.empty())
+        return channels;
+
+    for (BitmapChannel &channel : channels)
+        channel.data.resize((size_t) m_size.prod());
+    for (int y=0; y<m_size.y(); ++y) {
+        for (int x=0; x<m_size.x(); ++x) {
+            const PixelCost &cost = m_costs[y * m_pixelStride + x];
+            size_t i = (size_t) y * m_size.x() + x;
+            float samples = (float) std::max(cost.samples, 1u);
+            channels[0].data[i] = cost.seconds * 1e6f;
+            channels[1].data[i] = cost.rays / samples;
+            channels[2].data[i] = cost.bounces / samples;
+            channels[3].data[i] = (float) cost.samples;
+        }
+    }
+    return channels;
+}
+
 void ImageBlock::fromBitmap(const Bitmap &bitmap) {
     if (bitmap.cols() != cols() || bitmap.rows() != rows())
         throw Exception("Invalid bitmap dimensions!");
@@ -53,6 +88,71 @@ void ImageBlock::fromBitmap(const Bitmap &bitmap) {
             coeffRef(y, x) << bitmap.coeff(y, x), 1;
 }
 
+void ImageBlock::saveAccumulation(const std::string &filename, const Vector2i &imageSize) const {
+    /* Stored region (including the border) clipped to the image */
+    Point2i begin = (m_offset - Vector2i::Constant(m_borderSize)).cwiseMax(Point2i(0, 0));
+    Point2i end = (m_offset + m_size + Vector2i::Constant(m_borderSize)).cwiseMin(imageSize);
+    Vector2i extent = end - begin;
+    if ((extent.array() <= 0).any())
+        throw Exception("ImageBlock::saveAccumulation(): block lies outside of the image!");
+
+    LOG("Save accumulation to ==> {}. Window: [{}, {}] {}x{}", filename, begin.x(), begin.y(), extent.x(), extent.y());
+
+    std::unique_ptr<OIIO::ImageOutput> out = OIIO::ImageOutput::create(filename);
+    if (!out)
+        throw Exception("Unable to create \"{}\"", filename);
+
+    OIIO::ImageSpec spec(extent.x(), extent.y(), 4, OIIO::TypeDesc::FLOAT);
+    spec.x = begin.x();
+    spec.y = begin.y();
+    spec.full_x = spec.full_y = 0;
+    spec.full_width = imageSize.x();
+    spec.full_height = imageSize.y();
+
+    Point2i first = begin - m_offset + Vector2i::Constant(m_borderSize);
+    if (!out->open(filename, spec) ||
+        !out->write_image(OIIO::TypeDesc::FLOAT, data() + (size_t) first.y() * cols() + first.x(),
+                          sizeof(Color4f), sizeof(Color4f) * cols()))
+        throw Exception("Unable to write \"{}\": {}", filename, out->geterror());
+    out->close();
+}
+
+Vector2i ImageBlock::addAccumulation(const std::string &filename) {
+    auto in = OIIO::ImageInput::open(filename);
+    if (!in)
+        throw Exception("Unable to open \"{}\"", filename);
+    const OIIO::ImageSpec &spec = in->spec();
+    if (spec.nchannels != 4)
+        throw Exception("\"{}\" is not an accumulation buffer (expected 4 channels)", filename);
+
+    std::vector<Color4f> pixels((size_t) spec.width * spec.height);
+    if (!in->read_image(OIIO::TypeDesc::FLOAT, pixels.data()))
+        throw Exception("Unable to read \"{}\": {}", filename, in->geterror());
+    in->close();
+
+    size_t invalid = 0;
+    for (int y=0; y<spec.height; ++y) {
+        int row = spec.y + y - m_offset.y() + m_borderSize;
+        if (row < 0 || row >= rows())
+            continue;
+        for (int x=0; x<spec.width; ++x) {
+            int col = spec.x + x - m_offset.x() + m_borderSize;
+            if (col < 0 || col >= cols())
+                continue;
+            /* Filters with negative lobes make negative sums, only NaN and infinity are invalid */
+            const Color4f &pixel = pixels[(size_t) y * spec.width + x];
+            if (pixel.allFinite())
+                coeffRef(row, col) += pixel;
+            else
+                ++invalid;
+        }
+    }
+    if (invalid > 0)
+        cerr << "ImageBlock::addAccumulation(): skipped " << invalid << " invalid pixels of \""
+             << filename << "\"" << endl;
+    return Vector2i(spec.full_width, spec.full_height);
+}
+
 void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
     if (!value.isValid()) {
         /* If this happens, go fix your code instead of removing this warning ;) */
@@ -60,6 +160,14 @@ void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
         return;
     }
 
+    /* Record the sample statistics of the pixel containing the sample */
+    if (!m_moments.empty()) {
+        int px = (int) std::floor(_pos.x()) - m_offset.x(),
+            py = (int) std::floor(_pos.y()) - m_offset.y();
+        if (px >= 0 && py >= 0 && px < m_size.x() && py < m_size.y())
+            m_moments[py * m_pixelStride + px].put(value.getLuminance());
+    }
+
     /* Convert to pixel coordinates within the image block */
     Point2f pos(
         _pos.x() - 0.5f - (m_offset.x() - m_borderSize),
@@ -89,10 +197,117 @@ void ImageBlock::put(ImageBlock &b) {
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    std::lock_guard<tbb::spin_mutex> lock(m_mutex);
+    if (!m_stripeLocks) {
+        std::lock_guard<tbb::spin_mutex> lock(m_mutex);
+
+        block(offset.y(), offset.x(), size.y(), size.x()) 
+            += b.topLeftCorner(size.y(), size.x());
+
+        putPixelStats(b, 0, b.getSize().y());
+        return;
+    }
+
+    /* Striped locking: merge the rows of each stripe covered by the block in turn */
+    for (int row = offset.y(), rowEnd; row < offset.y() + size.y(); row = rowEnd) {
+        int stripe = row / m_stripeHeight;
+        rowEnd = std::min((stripe + 1) * m_stripeHeight, offset.y() + size.y());
 
-    block(offset.y(), offset.x(), size.y(), size.x()) 
-        += b.topLeftCorner(size.y(), size.x());
+        std::lock_guard<tbb::spin_mutex> lock(m_stripeLocks[stripe]);
+
+        block(row, offset.x(), rowEnd - row, size.x())
+            += b.block(row - offset.y(), 0, rowEnd - row, size.x());
+
+        putPixelStats(b, row - offset.y() - b.getBorderSize(), rowEnd - offset.y() - b.getBorderSize());
+    }
+}
+
+void ImageBlock::putPixelStats(const ImageBlock &b, int yBegin, int yEnd) {
+    bool moments = !m_moments.empty() && !b.m_moments.empty();
+    bool costs = !m_costs.empty() && !b.m_costs.empty();
+    if (!moments && !costs)
+        return;
+
+    Vector2i pixelOffset = b.getOffset() - m_offset;
+    yBegin = std::max(yBegin, 0);
+    yEnd = std::min(yEnd, b.getSize().y());
+    for (int y=yBegin; y<yEnd; ++y) {
+        for (int x=0; x<b.getSize().x(); ++x) {
+            size_t dst = (pixelOffset.y() + y) * m_pixelStride + pixelOffset.x() + x,
+                   src = y * b.m_pixelStride + x;
+            if (moments)
+                m_moments[dst] += b.m_moments[src];
+            if (costs)
+                m_costs[dst] += b.m_costs[src];
+        }
+    }
+}
+
+void ImageBlock::setStripeHeight(int stripeHeight) {
+    m_stripeHeight = stripeHeight;
+    if (stripeHeight > 0)
+        m_stripeLocks.reset(new tbb::spin_mutex[(rows() + stripeHeight - 1) / stripeHeight]);
+    else
+        m_stripeLocks.reset();
+}
+
+void ImageBlock::addRows(const ImageBlock &b, int rowBegin, int rowEnd) {
+    if (b.rows() != rows() || b.cols() != cols())
+        throw Exception("ImageBlock::addRows(): block dimensions do not match!");
+
+    middleRows(rowBegin, rowEnd - rowBegin) += b.middleRows(rowBegin, rowEnd - rowBegin);
+
+    int yBegin = std::max(rowBegin - m_borderSize, 0),
+        yEnd = std::min(rowEnd - m_borderSize, m_size.y());
+    if (!m_moments.empty() && !b.m_moments.empty())
+        for (int y=yBegin; y<yEnd; ++y)
+            for (int x=0; x<m_size.x(); ++x)
+                m_moments[y * m_pixelStride + x] += b.m_moments[y * b.m_pixelStride + x];
+    if (!m_costs.empty() && !b.m_costs.empty())
+        for (int y=yBegin; y<yEnd; ++y)
+            for (int x=0; x<m_size.x(); ++x)
+                m_costs[y * m_pixelStride + x] += b.m_costs[y * b.m_pixelStride + x];
+}
+
+void ImageBlock::copyTo(ImageBlock &target) const {
+    if (target.rows() != rows() || target.cols() != cols())
+        throw Exception("ImageBlock::copyTo(): block dimensions do not match!");
+
+    if (!m_stripeLocks) {
+        std::lock_guard<tbb::spin_mutex> lock(m_mutex);
+        std::memcpy((void *) target.data(), data(), sizeof(Color4f) * size());
+        return;
+    }
+
+    /* Stripes are always locked one at a time by put(), so taking all of them in order cannot deadlock */
+    int stripeCount = (int) (rows() + m_stripeHeight - 1) / m_stripeHeight;
+    for (int i=0; i<stripeCount; ++i)
+        m_stripeLocks[i].lock();
+    std::memcpy((void *) target.data(), data(), sizeof(Color4f) * size());
+    for (int i=0; i<stripeCount; ++i)
+        m_stripeLocks[i].unlock();
+}
+
+void ImageBlock::serialize(std::ostream &stream) const {
+    int32_t dims[2] = { (int32_t) rows(), (int32_t) cols() };
+    uint64_t momentCount = m_moments.size();
+    stream.write((const char *) dims, sizeof(dims));
+    stream.write((const char *) &momentCount, sizeof(momentCount));
+    stream.write((const char *) data(), sizeof(Color4f) * size());
+    stream.write((const char *) m_moments.data(), sizeof(PixelMoments) * momentCount);
+}
+
+void ImageBlock::unserialize(std::istream &stream) {
+    int32_t dims[2];
+    uint64_t momentCount;
+    stream.read((char *) dims, sizeof(dims));
+    stream.read((char *) &momentCount, sizeof(momentCount));
+    if (!stream || dims[0] != rows() || dims[1] != cols() || momentCount != m_moments.size())
+        throw Exception("ImageBlock::unserialize(): block dimensions do not match!");
+
+    stream.read((char *) data(), sizeof(Color4f) * size());
+    stream.read((char *) m_moments.data(), sizeof(PixelMoments) * momentCount);
+    if (!stream)
+        throw Exception("ImageBlock::unserialize(): unexpected end of stream!");
 }
 
 std::string ImageBlock::toString() const {
@@ -102,49 +317,108 @@ std::string ImageBlock::toString() const {
         m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-        : m_size(size), m_blockSize(blockSize) {
-    m_numBlocks = Vector2i(
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize, int splitCount, const Point2i &offset)
+        : m_next(0) {
+    Vector2i numBlocks = Vector2i(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
-}
+    int blocksLeft = numBlocks.x() * numBlocks.y();
+    int direction = ERight;
+    Point2i block = Point2i(numBlocks / 2);
+    int stepsLeft = 1;
+    int numSteps = 1;
 
-bool BlockGenerator::next(ImageBlock &block) {
-    std::lock_guard<tbb::spin_mutex> lock(m_mutex);
+    /* Walk the spiral once and record the blocks in rendering order */
+    m_blocks.reserve(blocksLeft + 3 * splitCount);
+    while (blocksLeft > 0) {
+        Point2i pos = block * blockSize;
+        m_blocks.push_back({ offset + pos, (size - pos).cwiseMin(Vector2i::Constant(blockSize)) });
 
-    if (m_blocksLeft == 0)
+        if (--blocksLeft == 0)
+            break;
+
+        do {
+            switch (direction) {
+                case ERight: ++block.x(); break;
+                case EDown:  ++block.y(); break;
+                case ELeft:  --block.x(); break;
+                case EUp:    --block.y(); break;
+            }
+
+            if (--stepsLeft == 0) {
+                direction = (direction + 1) % 4;
+                if (direction == ELeft || direction == ERight) 
+                    ++numSteps;
+                stepsLeft = numSteps;
+            }
+        } while ((block.array() < 0).any() ||
+                 (block.array() >= numBlocks.array()).any());
+    }
+
+    /* Split the tail of the spiral into quarters, so that idle workers
+       can help with the last expensive blocks instead of waiting */
+    int halfSize = blockSize / 2;
+    splitCount = std::min(splitCount, (int) m_blocks.size());
+    if (halfSize == 0 || splitCount <= 0)
+        return;
+
+    std::vector<Block> tail(m_blocks.end() - splitCount, m_blocks.end());
+    m_blocks.resize(m_blocks.size() - splitCount);
+    for (const Block &b : tail) {
+        for (int y=0; y<b.size.y(); y += halfSize)
+            for (int x=0; x<b.size.x(); x += halfSize) {
+                Point2i pos = b.offset + Vector2i(x, y);
+                m_blocks.push_back({ pos, (b.offset + b.size - pos).cwiseMin(Vector2i::Constant(halfSize)) });
+            }
+    }
+}
+
+bool BlockGenerator::next(ImageBlock &block, int *index, int *repetition) {
+    int i = m_next.fetch_add(1, std::memory_order_relaxed);
+    int count = (int) m_blocks.size();
+    if (i >= count * m_repeatCount)
         return false;
 
-    Point2i pos = m_block * m_blockSize;
-    block.setOffset(pos);
-    block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+    const Block &b = m_blocks[i % count];
+    block.setOffset(b.offset);
+    block.setSize(b.size);
+    if (index)
+        *index = i % count;
+    if (repetition)
+        *repetition = i / count;
+    return true;
+}
 
-    if (--m_blocksLeft == 0)
-        return true;
+BlockQueues::BlockQueues(const Vector2i &size, int blockSize, int splitCount, int queueCount,
+        const Point2i &offset) {
+    int blockRows = (size.y() + blockSize - 1) / blockSize;
+    int bandRows = (blockRows + std::max(queueCount, 1) - 1) / std::max(queueCount, 1);
+    int bandHeight = std::max(bandRows, 1) * blockSize;
 
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
-        }
+    m_firstBlock.push_back(0);
+    for (int y = 0; y < size.y(); y += bandHeight) {
+        Vector2i bandSize(size.x(), std::min(bandHeight, size.y() - y));
+        m_generators.emplace_back(new BlockGenerator(bandSize, blockSize, splitCount, offset + Vector2i(0, y)));
+        m_firstBlock.push_back(m_firstBlock.back() + m_generators.back()->getBlockCount());
+    }
+}
 
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
+bool BlockQueues::next(ImageBlock &block, int queue, int *index, int *repetition) {
+    int count = getQueueCount();
+    for (int i = 0; i < count; ++i) {
+        int q = (queue + i) % count;
+        if (m_generators[q]->next(block, index, repetition)) {
+            if (index)
+                *index += m_firstBlock[q];
+            return true;
         }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
+    }
+    return false;
+}
 
-    return true;
+void BlockQueues::reset(int repeatCount) {
+    for (auto &generator : m_generators)
+        generator->reset(repeatCount);
 }
 
 NAMESPACE_END(kazen)
@@ -5,6 +5,7 @@
 #include <kazen/texture.h>
 #include <kazen/ggx_brdf.h>
 #include <kazen/mircofacet.h>
+#include <kazen/profiler.h>
 #include <kazen/proplist.h>
 #include <Eigen/Geometry> // cross()
 #include <OpenImageIO/texture.h>
@@ -25,6 +26,7 @@ public:
 
     /// Evaluate the BRDF model
     Color3f eval(const BSDFQueryRecord &bRec) const {
+        KAZEN_PROFILE("BSDF::eval");
         /* This is a smooth BRDF -- return zero if the measure
            is wrong, or when queried for illumination on the backside */
         if (bRec.measure != ESolidAngle
@@ -38,6 +40,7 @@ public:
 
     /// Compute the density of \ref sample() wrt. solid angles
     float pdf(const BSDFQueryRecord &bRec) const {
+        KAZEN_PROFILE("BSDF::pdf");
         /* This is a smooth BRDF -- return zero if the measure
            is wrong, or when queried for illumination on the backside */
         if (bRec.measure != ESolidAngle
@@ -56,7 +59,8 @@ public:
     }
 
     /// Draw a a sample from the BRDF model
-    Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const {
+    Color3f sample(BSDFQueryRecord &bRec, float, const Point2f &sample2) const {
+        KAZEN_PROFILE("BSDF::sample");
         if (Frame::cosTheta(bRec.wi) <= 0)
             return Color3f(0.0f);
 
@@ -107,16 +111,19 @@ public:
     }
 
     Color3f eval(const BSDFQueryRecord &) const {
+        KAZEN_PROFILE("BSDF::eval");
         /* Discrete BRDFs always evaluate to zero in kazen */
         return Color3f(0.0f);
     }
 
     float pdf(const BSDFQueryRecord &) const {
+        KAZEN_PROFILE("BSDF::pdf");
         /* Discrete BRDFs always evaluate to zero in kazen */
         return 0.0f;
     }
 
-    Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const {
+    Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &) const {
+        KAZEN_PROFILE("BSDF::sample");
         bRec.measure = EDiscrete;
 
         auto cosThetaI = Frame::cosTheta(bRec.wi);
@@ -163,16 +170,19 @@ public:
     Mirror(const PropertyList &) { }
 
     Color3f eval(const BSDFQueryRecord &) const {
+        KAZEN_PROFILE("BSDF::eval");
         /* Discrete BRDFs always evaluate to zero in kazen */
         return Color3f(0.0f);
     }
 
     float pdf(const BSDFQueryRecord &) const {
+        KAZEN_PROFILE("BSDF::pdf");
         /* Discrete BRDFs always evaluate to zero in kazen */
         return 0.0f;
     }
 
-    Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const {
+    Color3f sample(BSDFQueryRecord &bRec, float, const Point2f &) const {
+        KAZEN_PROFILE("BSDF::sample");
         if (Frame::cosTheta(bRec.wi) <= 0) 
             return Color3f(0.0f);
 
@@ -201,13 +211,14 @@ public:
  */
 class Lambertian : public BSDF {
 public:
-    Lambertian( const PropertyList &propList) { }
+    Lambertian( const PropertyList &) { }
 
     ~Lambertian() {
         if(!m_albedo) delete m_albedo;
     }
 
     Color3f eval(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::eval");
         /* This is a smooth BRDF -- return zero if the measure
            is wrong, or when queried for illumination on the backside */
         if (bRec.measure != ESolidAngle
@@ -220,6 +231,7 @@ public:
     }
 
     float pdf(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::pdf");
         /* This is a smooth BRDF -- return zero if the measure
            is wrong, or when queried for illumination on the backside */
         if (bRec.measure != ESolidAngle
@@ -237,7 +249,8 @@ public:
         return INV_PI * Frame::cosTheta(bRec.wo);       
     }
 
-    Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const override {
+    Color3f sample(BSDFQueryRecord &bRec, float, const Point2f &sample2) const override {
+        KAZEN_PROFILE("BSDF::sample");
         if (Frame::cosTheta(bRec.wi) <= 0)
             return Color3f(0.0f);
 
@@ -280,7 +293,7 @@ private:
 /// normal map (normal switch)
 class NormalMap : public BSDF {
 public:
-    NormalMap( const PropertyList &propList) { }
+    NormalMap( const PropertyList &) { }
 
     ~NormalMap() {
         if(!m_normalMap) delete m_normalMap;
@@ -288,6 +301,7 @@ public:
     }
 
     Color3f eval(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::eval");
         const Intersection &its = bRec.its;
         Color3f rgb = m_normalMap->eval(its.uv);
         Vector3f n(2*rgb.r()-1, 2*rgb.g()-1, 2*rgb.b()-1);
@@ -312,6 +326,7 @@ public:
     }
 
     float pdf(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::pdf");
         const Intersection &its = bRec.its;
         Color3f rgb = m_normalMap->eval(its.uv);
         Vector3f n(2*rgb.r()-1, 2*rgb.g()-1, 2*rgb.b()-1);
@@ -336,6 +351,7 @@ public:
     }
 
     Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const override {
+        KAZEN_PROFILE("BSDF::sample");
         const Intersection &its = bRec.its;
         Color3f rgb = m_normalMap->eval(its.uv);
         Vector3f n(2*rgb.r()-1, 2*rgb.g()-1, 2*rgb.b()-1);
@@ -363,7 +379,7 @@ public:
     }
 
     // https://arxiv.org/abs/1705.01263
-    Frame getFrame(const Intersection &its, Vector3f n,  Vector3f wi) const {
+    Frame getFrame(const Intersection &its, Vector3f n,  Vector3f) const {
 
         // 1. Naive implementation
         Frame result;
@@ -638,6 +654,7 @@ public:
     }
 
     Color3f eval(const BSDFQueryRecord &bRec) const {
+        KAZEN_PROFILE("BSDF::eval");
         if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
             return Color3f(0.0f);        
         Color3f F;
@@ -646,6 +663,7 @@ public:
     }
 
     float pdf(const BSDFQueryRecord &bRec) const {
+        KAZEN_PROFILE("BSDF::pdf");
         if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0) 
             return 0.0f;
         
@@ -655,7 +673,8 @@ public:
         return computeGGXSmithPDF(bRec.wi, H, alpha) / denom;
     }
 
-    Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const {
+    Color3f sample(BSDFQueryRecord &bRec, float, const Point2f &sample2) const {
+        KAZEN_PROFILE("BSDF::sample");
         if (Frame::cosTheta(bRec.wi) <= 0)
             return Color3f(0.0f);
         Color3f albedo = m_albedo->eval(bRec.uv);            
@@ -758,6 +777,7 @@ public:
 
     /// Evaluate the BRDF for the given pair of directions
     virtual Color3f eval(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::eval");
         if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
             return Color3f(0.0f);          
         Vector3f wh = (bRec.wi + bRec.wo).normalized();
@@ -771,6 +791,7 @@ public:
 
     /// Evaluate the sampling density of \ref sample() wrt. solid angles
     virtual float pdf(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::pdf");
         if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0) 
             return 0.0f;      
         Vector3f wh = (bRec.wi + bRec.wo).normalized();
@@ -780,7 +801,8 @@ public:
     }
 
     /// Sample the BRDF
-    virtual Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const override {
+    virtual Color3f sample(BSDFQueryRecord &bRec, float, const Point2f &sample2) const override {
+        KAZEN_PROFILE("BSDF::sample");
         if (Frame::cosTheta(bRec.wi) <= 0)
             return Color3f(0.0f);
         
@@ -874,6 +896,7 @@ public:
 
     /// Evaluate the BRDF for the given pair of directions
     virtual Color3f eval(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::eval");
         if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
             return Color3f(0.0f); 		
         
@@ -889,6 +912,7 @@ public:
 
     /// Evaluate the sampling density of \ref sample() wrt. solid angles
     virtual float pdf(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::pdf");
 	    if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
             return 0.0f; 
 
@@ -902,6 +926,7 @@ public:
 
     /// Sample the BRDF
     virtual Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const override {
+        KAZEN_PROFILE("BSDF::sample");
 		if (Frame::cosTheta(bRec.wi) <= 0)
 			return Color3f(0.0f);
 
@@ -964,6 +989,7 @@ public:
 
     /// Evaluate the BRDF for the given pair of directions
     virtual Color3f eval(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::eval");
         if (Frame::cosTheta(bRec.wi) == 0)
             return Color3f(0.0f);
 
@@ -975,7 +1001,6 @@ public:
         
         /* Determine the relative index of refraction */
         float eta = cosThetaI > 0.f ? m_eta : m_invEta;
-        float invEta = cosThetaI > 0.f ? m_invEta : m_eta;
 
         /* Compute the half-vector */
         Vector3f wm;
@@ -1010,6 +1035,7 @@ public:
 
     /// Evaluate the sampling density of \ref sample() wrt. solid angles
     virtual float pdf(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::pdf");
         float cosThetaI = Frame::cosTheta(bRec.wi);
         float cosThetaO = Frame::cosTheta(bRec.wo);
 
@@ -1048,6 +1074,7 @@ public:
 
     /// Sample the BRDF
     virtual Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const override {
+        KAZEN_PROFILE("BSDF::sample");
         /* Trick by Walter et al.: slightly scale the roughness values to
         reduce importance sampling weights. Not needed for the
         Heitz and D'Eon sampling technique. */
@@ -1213,6 +1240,7 @@ public:
     }
 
     Color3f eval(const BSDFQueryRecord &bRec) const {
+        KAZEN_PROFILE("BSDF::eval");
         /* This is a smooth BRDF -- return zero if the measure
            is wrong, or when queried for illumination on the backside */
         if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
@@ -1240,7 +1268,6 @@ public:
         float FH = schlickWeight(L.dot(H));
 
         float cosThetaD = V.dot(H);
-         float FD90 = 0.5f * 2 * roughness * cosThetaD * cosThetaD;
 
         float Lambert = (1.f - 0.5f*FL) * (1.f - 0.5f*FV);
         float RR = 2.f * roughness * cosThetaD * cosThetaD;
@@ -1267,6 +1294,7 @@ public:
     }
 
     float pdf(const BSDFQueryRecord &bRec) const override {
+        KAZEN_PROFILE("BSDF::pdf");
         /* This is a smooth BRDF -- return zero if the measure
            is wrong, or when queried for illumination on the backside */
         if (Frame::cosTheta(bRec.wi) <= 0 || Frame::cosTheta(bRec.wo) <= 0)
@@ -1299,6 +1327,7 @@ public:
     }
 
     Color3f sample(BSDFQueryRecord &bRec, float sample1, const Point2f &sample2) const override {
+        KAZEN_PROFILE("BSDF::sample");
         if (Frame::cosTheta(bRec.wi) <= 0)
             return Color3f(0.0f);
 
@@ -0,0 +1,594 @@
+#include <kazen/bvh.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <algorithm>
+#include <atomic>
+
+/* Boxes and triangles are tested four at a time with SSE on x86, one lane
+   after the other with the same arithmetic elsewhere */
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#  define KAZEN_BVH_SSE 1
+#  include <xmmintrin.h>
+#endif
+
+NAMESPACE_BEGIN(kazen)
+
+/* Child references: a node index, a leaf index with LeafFlag, or an empty slot */
+static const uint32_t LeafFlag = 0x80000000u;
+static const uint32_t EmptyChild = BVH::InvalidID;
+
+/* Build primitives that stand for an instance carry this flag in their geomID */
+static const uint32_t InstanceFlag = 0x80000000u;
+
+static const int BinCount = 16;                   /* SAH bins per axis */
+static const uint32_t MaxLeafSize = 4;            /* one triangle packet */
+static const uint32_t ParallelBuildSize = 4096;   /* smaller subtrees are built serially */
+static const int MaxSAHDepth = 48;                /* deeper nodes are split at the median */
+static const float TraversalCost = 1.f;           /* relative to one triangle test */
+static const int StackSize = 256;
+
+/* Far distances are widened by a few ulps so that rounding cannot miss a box (PBRT 3.9.2) */
+static const float FarScale = 1.f + 2.f * 3.f * std::numeric_limits<float>::epsilon();
+
+/* Smallest determinant of a triangle that counts as hit */
+static const float MinDeterminant = 1e-8f;
+
+/*
+ * Slab test of a ray against four boxes in SoA layout (minX, maxX, minY, maxY,
+ * minZ, maxZ). \c near holds the bounds that the ray enters first, per axis.
+ * Returns the mask of the boxes that are hit and their entry distances.
+ */
+static inline int intersectBoxes(const float bounds[6][4], const int near[3], const Point3f &o, const float rcp[3],
+                                 float mint, float maxt, float tNear[4]) {
+#if defined(KAZEN_BVH_SSE)
+    const __m128 ox = _mm_set1_ps(o.x()), oy = _mm_set1_ps(o.y()), oz = _mm_set1_ps(o.z());
+    const __m128 rx = _mm_set1_ps(rcp[0]), ry = _mm_set1_ps(rcp[1]), rz = _mm_set1_ps(rcp[2]);
+    __m128 tNearX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[near[0]]), ox), rx);
+    __m128 tNearY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[near[1]]), oy), ry);
+    __m128 tNearZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[near[2]]), oz), rz);
+    __m128 tFarX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[near[0] ^ 1]), ox), rx);
+    __m128 tFarY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[near[1] ^ 1]), oy), ry);
+    __m128 tFarZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[near[2] ^ 1]), oz), rz);
+
+    __m128 tNear4 = _mm_max_ps(_mm_max_ps(tNearX, tNearY), _mm_max_ps(tNearZ, _mm_set1_ps(mint)));
+    __m128 tFar4 = _mm_mul_ps(_mm_min_ps(_mm_min_ps(tFarX, tFarY), tFarZ), _mm_set1_ps(FarScale));
+    tFar4 = _mm_min_ps(tFar4, _mm_set1_ps(maxt));
+    _mm_store_ps(tNear, tNear4);
+    return _mm_movemask_ps(_mm_cmple_ps(tNear4, tFar4));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        float tNearX = (bounds[near[0]][i] - o.x()) * rcp[0];
+        float tNearY = (bounds[near[1]][i] - o.y()) * rcp[1];
+        float tNearZ = (bounds[near[2]][i] - o.z()) * rcp[2];
+        float tFarX = (bounds[near[0] ^ 1][i] - o.x()) * rcp[0];
+        float tFarY = (bounds[near[1] ^ 1][i] - o.y()) * rcp[1];
+        float tFarZ = (bounds[near[2] ^ 1][i] - o.z()) * rcp[2];
+
+        tNear[i] = std::max(std::max(tNearX, tNearY), std::max(tNearZ, mint));
+        float tFar = std::min(std::min(std::min(tFarX, tFarY), tFarZ) * FarScale, maxt);
+        if (tNear[i] <= tFar)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+/*
+ * Moeller-Trumbore test of a ray against four triangles in SoA layout (first
+ * vertex and two edges), as in Mesh::rayIntersect(). Returns the mask of the
+ * triangles that are hit within [mint, maxt], with distance and barycentrics.
+ */
+static inline int intersectTriangles(const float v0[3][4], const float e1[3][4], const float e2[3][4],
+                                     const Point3f &o, const Vector3f &d, float mint, float maxt,
+                                     float ts[4], float us[4], float vs[4]) {
+#if defined(KAZEN_BVH_SSE)
+    const __m128 ox = _mm_set1_ps(o.x()), oy = _mm_set1_ps(o.y()), oz = _mm_set1_ps(o.z());
+    const __m128 dx = _mm_set1_ps(d.x()), dy = _mm_set1_ps(d.y()), dz = _mm_set1_ps(d.z());
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    const __m128 signMask = _mm_set1_ps(-0.f);
+
+    __m128 e1x = _mm_load_ps(e1[0]), e1y = _mm_load_ps(e1[1]), e1z = _mm_load_ps(e1[2]);
+    __m128 e2x = _mm_load_ps(e2[0]), e2y = _mm_load_ps(e2[1]), e2z = _mm_load_ps(e2[2]);
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 invDet = _mm_div_ps(one, det);
+
+    __m128 tx = _mm_sub_ps(ox, _mm_load_ps(v0[0]));
+    __m128 ty = _mm_sub_ps(oy, _mm_load_ps(v0[1]));
+    __m128 tz = _mm_sub_ps(oz, _mm_load_ps(v0[2]));
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+    __m128 valid = _mm_cmpge_ps(_mm_andnot_ps(signMask, det), _mm_set1_ps(MinDeterminant));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_set1_ps(mint)));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(maxt)));
+
+    _mm_store_ps(ts, t);
+    _mm_store_ps(us, u);
+    _mm_store_ps(vs, v);
+    return _mm_movemask_ps(valid);
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        float px = d.y() * e2[2][i] - d.z() * e2[1][i];
+        float py = d.z() * e2[0][i] - d.x() * e2[2][i];
+        float pz = d.x() * e2[1][i] - d.y() * e2[0][i];
+        float det = e1[0][i] * px + e1[1][i] * py + e1[2][i] * pz;
+        float invDet = 1.f / det;
+
+        float tx = o.x() - v0[0][i], ty = o.y() - v0[1][i], tz = o.z() - v0[2][i];
+        us[i] = (tx * px + ty * py + tz * pz) * invDet;
+
+        float qx = ty * e1[2][i] - tz * e1[1][i];
+        float qy = tz * e1[0][i] - tx * e1[2][i];
+        float qz = tx * e1[1][i] - ty * e1[0][i];
+        vs[i] = (d.x() * qx + d.y() * qy + d.z() * qz) * invDet;
+        ts[i] = (e2[0][i] * qx + e2[1][i] * qy + e2[2][i] * qz) * invDet;
+
+        if (std::abs(det) >= MinDeterminant && us[i] >= 0.f && vs[i] >= 0.f && us[i] + vs[i] <= 1.f &&
+            ts[i] >= mint && ts[i] <= maxt)
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+struct BVH::BuildPrim {
+    BoundingBox3f bbox;
+    Point3f centroid;
+    uint32_t geomID;    /* mesh index, or instance index with InstanceFlag */
+    uint32_t primID;
+};
+
+/* Node of the binary build tree, children are never 0 (the root) */
+struct BVH::BuildNode {
+    BoundingBox3f bbox;
+    uint32_t begin = 0, end = 0;
+    uint32_t left = 0, right = 0;
+
+    bool isLeaf() const { return left == 0; }
+};
+
+/* Top-down binned SAH build, the node array is allocated for the worst case
+   (2n - 1 nodes) so that subtrees can be built in parallel */
+struct BVH::Builder {
+    std::vector<BuildPrim> &prims;
+    std::vector<BuildNode> &nodes;
+    std::atomic<uint32_t> nodeCount {1};
+
+    Builder(std::vector<BuildPrim> &prims, std::vector<BuildNode> &nodes)
+        : prims(prims), nodes(nodes) { }
+
+    void build(uint32_t index, int depth) {
+        BuildNode &node = nodes[index];
+        BoundingBox3f centroidBox;
+        for (uint32_t i = node.begin; i < node.end; ++i) {
+            node.bbox.expandBy(prims[i].bbox);
+            centroidBox.expandBy(prims[i].centroid);
+        }
+
+        uint32_t mid = split(node, centroidBox, depth);
+        if (mid == node.begin)
+            return;
+
+        uint32_t left = nodeCount.fetch_add(2);
+        nodes[left].begin = node.begin;
+        nodes[left].end = mid;
+        nodes[left + 1].begin = mid;
+        nodes[left + 1].end = node.end;
+        node.left = left;
+        node.right = left + 1;
+
+        if (node.end - node.begin > ParallelBuildSize) {
+            tbb::parallel_invoke(
+                [&] { build(left, depth + 1); },
+                [&] { build(left + 1, depth + 1); }
+            );
+        } else {
+            build(left, depth + 1);
+            build(left + 1, depth + 1);
+        }
+    }
+
+    /* Partition the primitives of a node, return the begin of the right
+       half or node.begin if the node should become a leaf */
+    uint32_t split(const BuildNode &node, const BoundingBox3f &centroidBox, int depth) {
+        uint32_t count = node.end - node.begin;
+        Vector3f extents = centroidBox.getExtents();
+
+        float bestCost = std::numeric_limits<float>::infinity();
+        int bestAxis = -1, bestBin = 0;
+        if (depth < MaxSAHDepth) {
+            for (int axis = 0; axis < 3; ++axis) {
+                if (extents[axis] <= 0.f)
+                    continue;
+
+                BoundingBox3f boxes[BinCount];
+                uint32_t counts[BinCount] = { };
+                for (uint32_t i = node.begin; i < node.end; ++i) {
+                    int bin = binIndex(prims[i].centroid[axis], centroidBox, axis);
+                    counts[bin]++;
+                    boxes[bin].expandBy(prims[i].bbox);
+                }
+
+                /* Sweep from the right, then evaluate the splits from the left */
+                float rightArea[BinCount];
+                uint32_t rightCount[BinCount];
+                BoundingBox3f box;
+                uint32_t n = 0;
+                for (int bin = BinCount - 1; bin > 0; --bin) {
+                    box.expandBy(boxes[bin]);
+                    n += counts[bin];
+                    rightArea[bin] = n > 0 ? box.getSurfaceArea() : 0.f;
+                    rightCount[bin] = n;
+                }
+
+                box.reset();
+                n = 0;
+                for (int bin = 0; bin < BinCount - 1; ++bin) {
+                    box.expandBy(boxes[bin]);
+                    n += counts[bin];
+                    if (n == 0 || rightCount[bin + 1] == 0)
+                        continue;
+                    float cost = n * box.getSurfaceArea() + rightCount[bin + 1] * rightArea[bin + 1];
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestBin = bin + 1;
+                    }
+                }
+            }
+        }
+
+        float area = node.bbox.getSurfaceArea();
+        if (count <= MaxLeafSize && (bestAxis < 0 || TraversalCost * area + bestCost >= count * area))
+            return node.begin;
+
+        auto begin = prims.begin() + node.begin, end = prims.begin() + node.end;
+        if (bestAxis >= 0) {
+            auto mid = std::partition(begin, end, [&](const BuildPrim &prim) {
+                return binIndex(prim.centroid[bestAxis], centroidBox, bestAxis) < bestBin;
+            });
+            return (uint32_t) (mid - prims.begin());
+        }
+
+        /* All centroids coincide or the tree got too deep: split at the median */
+        int axis = centroidBox.getMajorAxis();
+        auto mid = begin + count / 2;
+        if (extents[axis] > 0.f) {
+            std::nth_element(begin, mid, end, [axis](const BuildPrim &a, const BuildPrim &b) {
+                return a.centroid[axis] < b.centroid[axis];
+            });
+        }
+        return (uint32_t) (mid - prims.begin());
+    }
+
+    static int binIndex(float value, const BoundingBox3f &centroidBox, int axis) {
+        float extent = centroidBox.max[axis] - centroidBox.min[axis];
+        int bin = (int) ((value - centroidBox.min[axis]) * (BinCount / extent));
+        return std::min(std::max(bin, 0), BinCount - 1);
+    }
+};
+
+struct BVH::TraversalRay {
+    Point3f o;
+    Vector3f d;
+    float mint, maxt;
+    uint32_t visibility;
+};
+
+BVH::BVH(const std::vector<const Mesh *> &meshes, const std::vector<InstanceRef> &instances)
+    : m_meshes(meshes), m_instances(instances) {
+    for (const Mesh *mesh : m_meshes)
+        m_meshVisibility.push_back(mesh->getVisibility());
+    for (const InstanceRef &instance : m_instances)
+        m_instanceToLocal.push_back(instance.toWorld.inverse());
+
+    /* Build primitives: the triangles of every mesh, then the instances */
+    std::vector<size_t> offsets;
+    size_t primCount = 0;
+    for (const Mesh *mesh : m_meshes) {
+        offsets.push_back(primCount);
+        primCount += mesh->getTriangleCount();
+    }
+    size_t triangleCount = primCount;
+    primCount += m_instances.size();
+    if (primCount == 0)
+        return;
+    if (primCount >= LeafFlag)
+        throw Exception("BVH: too many primitives ({})", primCount);
+
+    std::vector<BuildPrim> prims(primCount);
+    for (size_t m = 0; m < m_meshes.size(); ++m) {
+        const Mesh *mesh = m_meshes[m];
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh->getTriangleCount()),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    BuildPrim &prim = prims[offsets[m] + i];
+                    prim.bbox = mesh->getBoundingBox(i);
+                    prim.centroid = prim.bbox.getCenter();
+                    prim.geomID = (uint32_t) m;
+                    prim.primID = i;
+                }
+            }
+        );
+    }
+    for (size_t j = 0; j < m_instances.size(); ++j) {
+        BuildPrim &prim = prims[triangleCount + j];
+        const BoundingBox3f &box = m_instances[j].bvh->m_bbox;
+        if (box.isValid()) {
+            for (int k = 0; k < 8; ++k)
+                prim.bbox.expandBy(m_instances[j].toWorld * box.getCorner(k));
+            prim.centroid = prim.bbox.getCenter();
+        } else {
+            /* An empty group cannot be hit, keep the instance out of the way */
+            prim.bbox.expandBy(Point3f(0.f));
+            prim.centroid = Point3f(0.f);
+        }
+        prim.geomID = InstanceFlag | (uint32_t) j;
+        prim.primID = 0;
+    }
+
+    std::vector<BuildNode> buildNodes(2 * primCount - 1);
+    buildNodes[0].end = (uint32_t) primCount;
+    Builder builder(prims, buildNodes);
+    builder.build(0, 0);
+    m_bbox = buildNodes[0].bbox;
+
+    /* Collapse the binary tree into 4-wide nodes */
+    m_nodes.reserve(builder.nodeCount / 3 + 1);
+    m_leaves.reserve(builder.nodeCount / 2 + 1);
+    m_packets.reserve(triangleCount / 2 + 1);
+    m_root = collapse(buildNodes, prims, 0);
+
+    m_nodes.shrink_to_fit();
+    m_leaves.shrink_to_fit();
+    m_packets.shrink_to_fit();
+}
+
+uint32_t BVH::collapse(const std::vector<BuildNode> &buildNodes, const std::vector<BuildPrim> &prims, uint32_t index) {
+    const BuildNode &node = buildNodes[index];
+    if (node.isLeaf())
+        return makeLeaf(node, prims);
+
+    /* Open the largest inner child until there are four children */
+    uint32_t children[4] = { node.left, node.right };
+    int childCount = 2;
+    while (childCount < 4) {
+        int largest = -1;
+        float largestArea = -1.f;
+        for (int i = 0; i < childCount; ++i) {
+            const BuildNode &child = buildNodes[children[i]];
+            if (!child.isLeaf() && child.bbox.getSurfaceArea() > largestArea) {
+                largest = i;
+                largestArea = child.bbox.getSurfaceArea();
+            }
+        }
+        if (largest < 0)
+            break;
+
+        const BuildNode &child = buildNodes[children[largest]];
+        children[largest] = child.left;
+        children[childCount++] = child.right;
+    }
+
+    uint32_t nodeIndex = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+
+    uint32_t refs[4];
+    for (int i = 0; i < childCount; ++i)
+        refs[i] = collapse(buildNodes, prims, children[i]);
+
+    /* Empty slots get inverted boxes, which no ray overlaps */
+    Node &result = m_nodes[nodeIndex];
+    for (int i = 0; i < 4; ++i) {
+        if (i < childCount) {
+            const BoundingBox3f &box = buildNodes[children[i]].bbox;
+            for (int axis = 0; axis < 3; ++axis) {
+                result.bounds[2 * axis][i] = box.min[axis];
+                result.bounds[2 * axis + 1][i] = box.max[axis];
+            }
+            result.child[i] = refs[i];
+        } else {
+            for (int axis = 0; axis < 3; ++axis) {
+                result.bounds[2 * axis][i] = std::numeric_limits<float>::infinity();
+                result.bounds[2 * axis + 1][i] = -std::numeric_limits<float>::infinity();
+            }
+            result.child[i] = EmptyChild;
+        }
+    }
+    return nodeIndex;
+}
+
+uint32_t BVH::makeLeaf(const BuildNode &node, const std::vector<BuildPrim> &prims) {
+    Leaf leaf;
+    leaf.firstPacket = (uint32_t) m_packets.size();
+    leaf.packetCount = 0;
+    leaf.firstInstance = (uint32_t) m_leafInstances.size();
+    leaf.instanceCount = 0;
+
+    int lane = 4;
+    for (uint32_t i = node.begin; i < node.end; ++i) {
+        const BuildPrim &prim = prims[i];
+        if (prim.geomID & InstanceFlag) {
+            m_leafInstances.push_back(prim.geomID & ~InstanceFlag);
+            leaf.instanceCount++;
+            continue;
+        }
+
+        if (lane == 4) {
+            /* Unused lanes keep degenerate triangles, which the test rejects */
+            TrianglePacket packet = { };
+            std::fill(packet.geomID, packet.geomID + 4, InvalidID);
+            m_packets.push_back(packet);
+            leaf.packetCount++;
+            lane = 0;
+        }
+
+        TrianglePacket &packet = m_packets.back();
+        const Mesh *mesh = m_meshes[prim.geomID];
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+        Point3f p0 = V.col(F(0, prim.primID)), p1 = V.col(F(1, prim.primID)), p2 = V.col(F(2, prim.primID));
+        for (int k = 0; k < 3; ++k) {
+            packet.v0[k][lane] = p0[k];
+            packet.e1[k][lane] = p1[k] - p0[k];
+            packet.e2[k][lane] = p2[k] - p0[k];
+        }
+        packet.primID[lane] = prim.primID;
+        packet.geomID[lane] = prim.geomID;
+        lane++;
+    }
+
+    m_leaves.push_back(leaf);
+    return LeafFlag | (uint32_t) (m_leaves.size() - 1);
+}
+
+template <bool AnyHit> bool BVH::traverse(TraversalRay &ray, Result *result) const {
+    if (m_root == EmptyChild)
+        return false;
+
+    /* Zero direction components are replaced by tiny ones to keep the slabs finite */
+    float rcp[3];
+    for (int k = 0; k < 3; ++k) {
+        float d = ray.d[k];
+        if (std::abs(d) < 1e-20f)
+            d = std::copysign(1e-20f, d);
+        rcp[k] = 1.f / d;
+    }
+
+    /* Bounds that the ray enters first, per axis */
+    const int near[3] = { rcp[0] >= 0.f ? 0 : 1, rcp[1] >= 0.f ? 2 : 3, rcp[2] >= 0.f ? 4 : 5 };
+
+    struct Entry {
+        uint32_t ref;
+        float t;
+    };
+    Entry stack[StackSize];
+    int stackSize = 0;
+    stack[stackSize++] = { m_root, ray.mint };
+
+    bool found = false;
+    while (stackSize > 0) {
+        Entry entry = stack[--stackSize];
+        if (entry.t > ray.maxt)
+            continue;
+
+        if (entry.ref & LeafFlag) {
+            if (intersectLeaf<AnyHit>(m_leaves[entry.ref & ~LeafFlag], ray, result)) {
+                if (AnyHit)
+                    return true;
+                found = true;
+            }
+            continue;
+        }
+
+        /* Slab test against the four child boxes at once */
+        const Node &node = m_nodes[entry.ref];
+        alignas(16) float tNear[4];
+        int mask = intersectBoxes(node.bounds, near, ray.o, rcp, ray.mint, ray.maxt, tNear);
+        if (!mask)
+            continue;
+
+        /* Push the children that were hit sorted by distance, the nearest on top */
+        int first = stackSize;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i)) || node.child[i] == EmptyChild)
+                continue;
+            Entry child = { node.child[i], tNear[i] };
+            int j = stackSize++;
+            while (j > first && stack[j - 1].t < child.t) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+    return found;
+}
+
+template <bool AnyHit> bool BVH::intersectLeaf(const Leaf &leaf, TraversalRay &ray, Result *result) const {
+    bool found = false;
+
+    for (uint32_t p = 0; p < leaf.packetCount; ++p) {
+        const TrianglePacket &packet = m_packets[leaf.firstPacket + p];
+        alignas(16) float ts[4], us[4], vs[4];
+        int mask = intersectTriangles(packet.v0, packet.e1, packet.e2, ray.o, ray.d, ray.mint, ray.maxt, ts, us, vs);
+        if (!mask)
+            continue;
+
+        for (int i = 0; i < 4; ++i) {
+            uint32_t geomID = packet.geomID[i];
+            if (!(mask & (1 << i)) || geomID == InvalidID || !(m_meshVisibility[geomID] & ray.visibility))
+                continue;
+            /* An earlier lane may have moved maxt closer */
+            if (ts[i] > ray.maxt)
+                continue;
+            if (AnyHit)
+                return true;
+
+            ray.maxt = ts[i];
+            result->t = ts[i];
+            result->u = us[i];
+            result->v = vs[i];
+            result->primID = packet.primID[i];
+            result->geomID = geomID;
+            result->instID = InvalidID;
+            found = true;
+        }
+    }
+
+    /* Instances: continue in the group's hierarchy with the ray in its space. The
+       direction is not normalized, so that distances stay those of the world ray */
+    for (uint32_t i = 0; i < leaf.instanceCount; ++i) {
+        uint32_t index = m_leafInstances[leaf.firstInstance + i];
+        const Transform &toLocal = m_instanceToLocal[index];
+        TraversalRay local = { toLocal * ray.o, toLocal * ray.d, ray.mint, ray.maxt, ray.visibility };
+        if (m_instances[index].bvh->traverse<AnyHit>(local, result)) {
+            if (AnyHit)
+                return true;
+            ray.maxt = local.maxt;
+            result->instID = index;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool BVH::rayIntersect(const Ray3f &ray, uint32_t visibility, Result &result) const {
+    TraversalRay r = { ray.o, ray.d, ray.mint, ray.maxt, visibility };
+    return traverse<false>(r, &result);
+}
+
+bool BVH::rayOccluded(const Ray3f &ray, uint32_t visibility) const {
+    TraversalRay r = { ray.o, ray.d, ray.mint, ray.maxt, visibility };
+    return traverse<true>(r, nullptr);
+}
+
+size_t BVH::getMemoryUsage() const {
+    return m_nodes.capacity() * sizeof(Node)
+         + m_leaves.capacity() * sizeof(Leaf)
+         + m_packets.capacity() * sizeof(TrianglePacket)
+         + m_leafInstances.capacity() * sizeof(uint32_t)
+         + m_instanceToLocal.capacity() * sizeof(Transform);
+}
+
+std::string BVH::toString() const {
+    return fmt::format("BVH[nodes={}, leaves={}, packets={}, instances={}, memory={}]",
+                       m_nodes.size(), m_leaves.size(), m_packets.size(), m_instances.size(),
+                       util::memString(getMemoryUsage()));
+}
+
+NAMESPACE_END(kazen)
@@ -33,6 +33,7 @@ public:
     }
 
     void activate() {
+        m_invOutputSize = m_outputSize.cast<float>().cwiseInverse();
         float aspect = m_outputSize.x() / (float) m_outputSize.y();
 
         /* Project vectors in camera space onto a plane at z=1:
@@ -69,7 +70,7 @@ public:
 
     Color3f sampleRay(Ray3f &ray,
             const Point2f &samplePosition,
-            const Point2f &apertureSample) const {
+            const Point2f &) const {
         /* Compute the corresponding position on the 
            near plane (in local camera space) */
         Point3f nearP = m_sampleToCamera * Point3f(
@@ -124,7 +125,6 @@ public:
 private:
     Vector2f m_invOutputSize;
     Transform m_sampleToCamera;
-    Transform m_cameraToWorld;
     float m_fov;
     float m_nearClip;
     float m_farClip;
@@ -154,6 +154,7 @@ public:
     }
 
     void activate() {
+        m_invOutputSize = m_outputSize.cast<float>().cwiseInverse();
         float aspect = m_outputSize.x() / (float) m_outputSize.y();
 
         /* Project vectors in camera space onto a plane at z=1:
@@ -261,7 +262,6 @@ public:
 private:
     Vector2f m_invOutputSize;
     Transform m_sampleToCamera;
-    Transform m_cameraToWorld;
     float m_fov;
     float m_nearClip;
     float m_farClip;
@@ -0,0 +1,110 @@
+#include <kazen/checkpoint.h>
+#include <cstdio>
+#include <fstream>
+
+NAMESPACE_BEGIN(kazen)
+
+/* File identifier and layout version */
+static const char CheckpointMagic[4] = { 'K', 'Z', 'C', 'K' };
+static const uint32_t CheckpointVersion = 3;
+
+template <typename T> static void write(std::ostream &stream, const T &value) {
+    stream.write((const char *) &value, sizeof(T));
+}
+
+template <typename T> static void read(std::istream &stream, T &value) {
+    stream.read((char *) &value, sizeof(T));
+}
+
+static void writeString(std::ostream &stream, const std::string &value) {
+    write(stream, (uint64_t) value.size());
+    stream.write(value.data(), value.size());
+}
+
+static void readString(std::istream &stream, std::string &value) {
+    uint64_t size = 0;
+    read(stream, size);
+    if (!stream)
+        return;
+    value.resize(size);
+    stream.read(&value[0], size);
+}
+
+bool Checkpoint::isCompatible(const Checkpoint &other) const {
+    return outputSize == other.outputSize &&
+           cropOffset == other.cropOffset &&
+           firstSample == other.firstSample &&
+           blockSize == other.blockSize &&
+           sampleCount == other.sampleCount &&
+           passSampleCount == other.passSampleCount &&
+           sampler == other.sampler;
+}
+
+void Checkpoint::save(const std::string &filename) const {
+    /* Write to a temporary file first, so that a process killed
+       while saving never leaves a truncated checkpoint behind */
+    std::string tempName = filename + ".tmp";
+    {
+        std::ofstream stream(tempName, std::ios::binary | std::ios::trunc);
+        stream.write(CheckpointMagic, sizeof(CheckpointMagic));
+        write(stream, CheckpointVersion);
+        write(stream, outputSize.x());
+        write(stream, outputSize.y());
+        write(stream, cropOffset.x());
+        write(stream, cropOffset.y());
+        write(stream, blockSize);
+        write(stream, splitCount);
+        write(stream, queueCount);
+        write(stream, firstSample);
+        write(stream, sampleCount);
+        write(stream, passSampleCount);
+        writeString(stream, sampler);
+        write(stream, pass);
+        write(stream, (uint64_t) blocksDone.size());
+        stream.write((const char *) blocksDone.data(), blocksDone.size());
+        writeString(stream, image);
+        if (!stream)
+            throw Exception("Unable to write checkpoint \"{}\"", tempName);
+    }
+
+    if (std::rename(tempName.c_str(), filename.c_str()) != 0)
+        throw Exception("Unable to replace checkpoint \"{}\"", filename);
+}
+
+bool Checkpoint::load(const std::string &filename) {
+    std::ifstream stream(filename, std::ios::binary);
+    if (!stream)
+        return false;
+
+    char magic[4];
+    uint32_t version = 0;
+    stream.read(magic, sizeof(magic));
+    read(stream, version);
+    if (!stream || !std::equal(magic, magic + 4, CheckpointMagic) || version != CheckpointVersion)
+        throw Exception("\"{}\" is not a kazen checkpoint (or was written by another version)", filename);
+
+    uint64_t blockCount = 0;
+    read(stream, outputSize.x());
+    read(stream, outputSize.y());
+    read(stream, cropOffset.x());
+    read(stream, cropOffset.y());
+    read(stream, blockSize);
+    read(stream, splitCount);
+    read(stream, queueCount);
+    read(stream, firstSample);
+    read(stream, sampleCount);
+    read(stream, passSampleCount);
+    readString(stream, sampler);
+    read(stream, pass);
+    read(stream, blockCount);
+    if (stream) {
+        blocksDone.resize(blockCount);
+        stream.read((char *) blocksDone.data(), blockCount);
+    }
+    readString(stream, image);
+    if (!stream)
+        throw Exception("Checkpoint \"{}\" is truncated", filename);
+    return true;
+}
+
+NAMESPACE_END(kazen)
@@ -405,6 +405,17 @@ std::string Transform::toString() const {
     return oss.str();
 }
 
+Transform Transform::lookAt(const Vector3f &origin, const Vector3f &target, const Vector3f &up) {
+    Vector3f dir = (target - origin).normalized();
+    Vector3f left = up.normalized().cross(dir).normalized();
+    Vector3f newUp = dir.cross(left).normalized();
+
+    Eigen::Matrix4f trafo;
+    trafo << left, newUp, dir, origin,
+              0, 0, 0, 1;
+    return Transform(trafo);
+}
+
 Transform Transform::operator*(const Transform &t) const {
     return Transform(m_transform * t.m_transform,
         t.m_inverse * m_inverse);
@@ -0,0 +1,82 @@
+#include <kazen/instance.h>
+
+NAMESPACE_BEGIN(kazen)
+
+ShapeGroup::~ShapeGroup() {
+    for (Mesh *mesh : m_meshes)
+        delete mesh;
+}
+
+void ShapeGroup::addChild(Object *obj) {
+    switch (obj->getClassType()) {
+        case EMesh: {
+                Mesh *mesh = static_cast<Mesh *>(obj);
+                if (mesh->isLight())
+                    throw Exception("ShapeGroup \"{}\": area lights cannot be instanced ({})", m_id, mesh->getName());
+                m_meshes.push_back(mesh);
+                m_bbox.expandBy(mesh->getBoundingBox());
+            }
+            break;
+
+        default:
+            throw Exception("ShapeGroup::addChild(<{}>) is not supported!", classTypeName(obj->getClassType()));
+    }
+}
+
+void ShapeGroup::activate() {
+    if (m_id.empty())
+        throw Exception("A shape group needs an id to be referenced by instances!");
+    if (m_meshes.empty())
+        throw Exception("ShapeGroup \"{}\" is empty!", m_id);
+}
+
+std::string ShapeGroup::toString() const {
+    std::string meshes;
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        meshes += std::string("  ") + string::indent(m_meshes[i]->toString(), 2);
+        if (i + 1 < m_meshes.size())
+            meshes += ",";
+        meshes += "\n";
+    }
+
+    return fmt::format(
+        "ShapeGroup[\n"
+        "  id = \"{}\",\n"
+        "  meshes = [\n"
+        "  {}  ]\n"
+        "]",
+        m_id,
+        string::indent(meshes, 2)
+    );
+}
+
+Instance::Instance(const PropertyList &propList) {
+    m_shapeGroupId = propList.getString("shapegroup");
+    m_toWorld = propList.getTransform("toWorld", Transform());
+}
+
+BoundingBox3f Instance::getBoundingBox() const {
+    BoundingBox3f bbox;
+    if (!m_shapeGroup)
+        return bbox;
+
+    const BoundingBox3f &groupBox = m_shapeGroup->getBoundingBox();
+    for (int i = 0; i < 8; ++i)
+        bbox.expandBy(m_toWorld * groupBox.getCorner(i));
+    return bbox;
+}
+
+std::string Instance::toString() const {
+    return fmt::format(
+        "Instance[\n"
+        "  shapegroup = \"{}\",\n"
+        "  toWorld = {}\n"
+        "]",
+        m_shapeGroupId,
+        string::indent(m_toWorld.toString(), 12)
+    );
+}
+
+KAZEN_REGISTER_CLASS(ShapeGroup, "shapegroup");
+KAZEN_REGISTER_CLASS(Instance, "instance");
+NAMESPACE_END(kazen)
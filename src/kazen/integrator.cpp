@@ -4,13 +4,27 @@
 #include <kazen/light.h>
 #include <kazen/bsdf.h>
 #include <kazen/medium.h>
+#include <kazen/sampler.h>
+#include <kazen/stats.h>
 
 NAMESPACE_BEGIN(kazen)
 
+void Integrator::Li(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+                    const PixelSample *samples, Color3f *Li, size_t count) const {
+    std::vector<Intersection> its(count);
+    std::unique_ptr<bool[]> hits(new bool[count]);
+    scene->rayIntersect(rays, its.data(), hits.get(), count, EVisibleCamera, true);
+
+    for (size_t i = 0; i < count; ++i) {
+        sampler->generateSample(samples[i].pixel, samples[i].index, PixelSample::CameraDimensions);
+        Li[i] = this->Li(scene, sampler, rays[i], hits[i] ? &its[i] : nullptr);
+    }
+}
+
 /// normals
 class NormalIntegrator : public Integrator {
 public:
-    NormalIntegrator( const PropertyList &props) {
+    NormalIntegrator( const PropertyList &) {
         /* No parameters this time */
         // LOG("intergrator: normal");
     }
@@ -18,13 +32,17 @@ public:
     Color3f Li(const Scene *scene,  Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        return Li(scene, sampler, ray, scene->rayIntersect(ray, its, EVisibleCamera) ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *, Sampler *, const Ray3f &, const Intersection *its) const {
+        if (!its)
             return Color3f(0.f);
 
         /* Return the component-wise absolute
            value of the shading normal as a color */
-        // Normal3f n = its.shFrame.n.cwiseAbs();
-        Normal3f n = its.geoFrame.n.cwiseAbs();
+        // Normal3f n = its->shFrame.n.cwiseAbs();
+        Normal3f n = its->geoFrame.n.cwiseAbs();
         return Color3f(n.x(), n.y(), n.z());
     }
 
@@ -36,17 +54,22 @@ public:
 /// ao
 class AmbientOcclusionIntegrator : public Integrator {
 public:
-    AmbientOcclusionIntegrator( const PropertyList &props) {
+    AmbientOcclusionIntegrator( const PropertyList &) {
 
     }
     
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if(!scene->rayIntersect(ray, its)) {
+        return Li(scene, sampler, ray, scene->rayIntersect(ray, its, EVisibleCamera) ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &, const Intersection *hit) const {
+        if (!hit) {
             return Color3f(0.f);
         }
 
+        Intersection its = *hit;
         auto sample = Warp::squareToUniformHemisphere(sampler->next2D());
         auto point = its.toWorld(sample);
         auto shadowRay = Ray3f(its.p, point);
@@ -73,14 +96,19 @@ private:
 /// Whitted
 class WhittedIntegrator : public Integrator {
 public:
-    WhittedIntegrator( const PropertyList& props) {}
+    WhittedIntegrator( const PropertyList&) {}
     
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {        
         Intersection its;
+        return Li(scene, sampler, ray, scene->rayIntersect(ray, its, EVisibleCamera) ? &its : nullptr);
+    }
 
-        if (!scene->rayIntersect(ray, its)) {
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection *hit) const {
+        if (!hit) {
             return Color3f(0.f);
         }
+
+        const Intersection &its = *hit;
     
         /* Le term here to account for light sources that were direcly hit by the camera ray. */
         Color3f Le(0.f);
@@ -109,6 +137,7 @@ public:
             /* Calculate bsdf factor */
             BSDFQueryRecord bRec(its.toLocal(-ray.d), its.toLocal(rec.wi), ESolidAngle);
             Color3f f = its.mesh->getBSDF()->eval(bRec);
+            stats::add(stats::EBSDFEval);
 
             /* reflection equation */
             auto Lr = f * Ls * cosTheta;
@@ -120,9 +149,13 @@ public:
         } else {
             BSDFQueryRecord bRec(its.toLocal(-ray.d));
             Color3f reflect = its.mesh->getBSDF()->sample(bRec, sampler->next1D(), sampler->next2D());
+            stats::add(stats::EBSDFSample);
             if (sampler->next1D() < 0.95) {
-                return reflect * Li(scene, sampler, Ray3f(its.p, its.toWorld(bRec.wo))) / 0.95;
+                Ray3f reflected(its.p, its.toWorld(bRec.wo));
+                Intersection next;
+                return reflect * Li(scene, sampler, reflected, scene->rayIntersect(reflected, next) ? &next : nullptr) / 0.95;
             } else {
+                stats::add(stats::ERussianRoulette);
                 return Color3f(0.f);
             }
         }
@@ -136,18 +169,29 @@ public:
 
 class PathMatsIntegrator : public Integrator {
 public:
-    PathMatsIntegrator( const PropertyList &props) {}
+    PathMatsIntegrator( const PropertyList &) {}
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
+        Intersection its;
+        return Li(scene, sampler, ray, scene->rayIntersect(ray, its, EVisibleCamera) ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection *hit) const override {
         Color3f color = 0;
         Color3f t = 1;
         Ray3f rayRecursive = ray;
         float probability;
 
-        while (true) {
+        int depth = 0;
+        for (;; ++depth) {
+            /* The first intersection may be passed in by the caller */
             Intersection its;
-            if (!scene->rayIntersect(rayRecursive, its))
-                return color;
+            if (depth == 0) {
+                if (!hit)
+                    break;
+                its = *hit;
+            } else if (!scene->rayIntersect(rayRecursive, its))
+                break;
 
             //contribute emitted
             if (its.mesh->isLight()) {
@@ -157,8 +201,10 @@ public:
 
             //Russian roulettio
             probability = std::min(t.x(), 0.95f);
-            if (sampler->next1D() >= probability)
-                return color;
+            if (sampler->next1D() >= probability) {
+                stats::add(stats::ERussianRoulette);
+                break;
+            }
 
             t /= probability;
 
@@ -166,12 +212,14 @@ public:
             BSDFQueryRecord bRec(its.shFrame.toLocal(-rayRecursive.d));
             bRec.uv = its.uv;
             Color3f f = its.mesh->getBSDF()->sample(bRec, sampler->next1D(), sampler->next2D());
+            stats::add(stats::EBSDFSample);
             t *= f;
 
            //continue recursion
            rayRecursive = Ray3f(its.p, its.toWorld(bRec.wo));
         }
 
+        stats::addPathLength(depth);
         return color;
     }
 
@@ -192,7 +240,12 @@ public:
         m_accumulatedRoughness = propList.getFloat("accumulatedRoughness", 0.5f);
     }
 
-    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray_) const {
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        Intersection its;
+        return Li(scene, sampler, ray, scene->rayIntersect(ray, its, EVisibleCamera) ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray_, const Intersection *hit) const {
         Ray3f ray = ray_;
         Color3f Li(0.f), throughput(1.f);
         
@@ -206,18 +259,12 @@ public:
         // float roughnessBias(0.f);
 
         /* First intersection */
-        Intersection its;
-        if (!scene->rayIntersect(ray, its)) {
+        if (!hit) {
+            stats::addPathLength(0);
             return Li;
-        } 
-        else {
-            if (its.mesh->isLight()) {
-                if (!its.mesh->getLight()->getPrimaryVisibility()) {
-                    Ray3f newRay = Ray3f(its.p + m_rayEpsilon*ray.d, ray.d);
-                    scene->rayIntersect(newRay, its);
-                }
-            }
         }
+
+        Intersection its = *hit;
     
         /* Tracks depth for Russian roulette */
         int depth = 0;
@@ -238,6 +285,7 @@ public:
                 // continuation probability
                 auto probability = std::min(throughput.maxCoeff()*eta*eta, 0.95f);
                 if (probability <= sampler->next1D()) {
+                    stats::add(stats::ERussianRoulette);
                     break;
                 }
                 throughput /= probability;
@@ -256,29 +304,8 @@ public:
                 lRec.shadowRay.mint = m_rayEpsilon;
                 lRec.shadowRay.maxt -= m_rayEpsilon;
 
-                Intersection shadowIts;
-                bool occluded = false;
-                auto tempRay = lRec.shadowRay;
-                while (true) {
-                    if (scene->rayOccluded(tempRay, shadowIts)) {
-                        if (!shadowIts.mesh->isLight()) {
-                            occluded = true;
-                            break;
-                        } else {
-                            if (shadowIts.mesh->getLight()->getPrimaryVisibility()) {
-                                occluded = true;
-                                break;
-                            }
-                            tempRay = Ray3f(tempRay.o + tempRay.d*(shadowIts.t+m_rayEpsilon), tempRay.d, m_rayEpsilon, tempRay.maxt-shadowIts.t);
-                        }
-                    }
-                    else {
-                        break;
-                    }
-                }
-        
-                // if (!scene->rayOccluded(lRec.shadowRay, shadowIts)) {
-                if (!occluded) {
+                /* Lights without primary visibility are invisible to shadow rays */
+                if (!scene->rayOccluded(lRec.shadowRay)) {
                     /* Query the BSDF for that emitter-sampled direction */
                     BSDFQueryRecord bRec(its.toLocal(-ray.d), its.toLocal(lRec.wi), ESolidAngle);
                     bRec.its = its;
@@ -288,6 +315,8 @@ public:
 
                     /* Determine density of sampling that same direction using BSDF sampling */
                     auto bsdfPdf = its.mesh->getBSDF()->pdf(bRec);
+                    stats::add(stats::EBSDFEval);
+                    stats::add(stats::EBSDFPdf);
 
                     auto lightWeight = powerHeuristic(lightPdf, bsdfPdf);
                     Li += throughput * Ls * f  * lightWeight;
@@ -312,11 +341,20 @@ public:
             ray = Ray3f(its.p, its.toWorld(bRec.wo));
             ray.mint = m_rayEpsilon;
             auto bsdfPdf = its.mesh->getBSDF()->pdf(bRec);
-            if (!scene->rayIntersect(ray, its)) {
+            stats::add(stats::EBSDFSample);
+            stats::add(stats::EBSDFPdf);
+            Hit next;
+            if (!scene->rayIntersect(ray, next)) {
                 Li += throughput * scene->getBackgroundColor(ray.d);
+                depth++;
                 break;
             }
 
+            /* Increase depth for rr, the hit is only shaded if the path goes on */
+            if (++depth >= m_maxDepth)
+                break;
+            next.mesh->computeIntersection(next, its);
+
             /* Determine probability of having sampled that same
                direction using emitter sampling. */
             if (its.mesh->isLight()) {
@@ -329,14 +367,209 @@ public:
             if (bRec.measure == EDiscrete) {
                 bsdfWeight = 1.f;
             }
-            
-            /* Increase depth for rr */
-            depth++;
         }
 
+        stats::addPathLength(depth);
         return Li;
     }
 
+    /**
+     * \brief Wavefront version of \ref Li()
+     *
+     * Computes the same estimator, but every stage (shading and light
+     * sampling, shadow rays, extension rays) runs over the whole queue of
+     * live paths before the next one starts, so that all intersection
+     * queries of a bounce are traced as one stream. Paths carry compact
+     * hit records, the full intersection is only computed for hits that
+     * get shaded.
+     */
+    void Li(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+            const PixelSample *samples, Color3f *Li, size_t count) const override {
+        /* State of a path between two stages */
+        struct PathState {
+            Ray3f ray;
+            Hit hit;
+            Color3f throughput;
+            float eta;
+            float accumulatedRoughness;
+            float bsdfWeight;
+            float bsdfPdf;
+            bool discrete;
+            int depth;
+            size_t index;
+        };
+
+        /* Shadow ray of the light sampling stage, the contribution
+           is added if the ray turns out to be unoccluded */
+        struct ShadowQuery {
+            Ray3f ray;
+            Color3f contribution;
+            size_t index;
+        };
+
+        std::vector<PathState> paths(count);
+        std::vector<ShadowQuery> shadows;
+        std::vector<Ray3f> queueRays(count);
+        std::vector<Hit> queueHits(count);
+        std::unique_ptr<bool[]> occluded(new bool[count]);
+        shadows.reserve(count);
+
+        /* ----------------------- Camera rays ----------------------- */
+        scene->rayIntersect(rays, queueHits.data(), count, EVisibleCamera, true);
+
+        size_t live = 0;
+        for (size_t i = 0; i < count; ++i) {
+            Li[i] = Color3f(0.f);
+            if (!queueHits[i].isValid() || m_maxDepth <= 0) {
+                stats::addPathLength(0);
+                continue;
+            }
+
+            PathState &path = paths[live++];
+            path.ray = rays[i];
+            path.hit = queueHits[i];
+            path.throughput = Color3f(1.f);
+            path.eta = 1.f;
+            path.accumulatedRoughness = 0.f;
+            path.bsdfWeight = 1.f;
+            path.depth = 0;
+            path.index = i;
+        }
+
+        while (live > 0) {
+            /* ----------------------- Shading stage ----------------------- */
+            size_t extended = 0;
+            shadows.clear();
+            for (size_t k = 0; k < live; ++k) {
+                PathState path = paths[k];
+                const Ray3f &ray = path.ray;
+                const PixelSample &sample = samples[path.index];
+                Intersection its;
+
+                /* Intersection with lights */
+                if (path.hit.mesh->isLight()) {
+                    path.hit.mesh->computeIntersection(path.hit, its);
+                    LightQueryRecord lRec(ray.o, its.p, its.shFrame.n);
+                    lRec.uv = its.uv;
+                    Li[path.index] += path.bsdfWeight * path.throughput * its.mesh->getLight()->eval(lRec);
+                    stats::addPathLength(path.depth);
+                    continue;
+                }
+
+                sampler->generateSample(sample.pixel, sample.index, bounceDimension(path.depth));
+
+                /* Russian roulette */
+                if (path.depth >= 3) {
+                    auto probability = std::min(path.throughput.maxCoeff()*path.eta*path.eta, 0.95f);
+                    if (probability <= sampler->next1D()) {
+                        stats::add(stats::ERussianRoulette);
+                        stats::addPathLength(path.depth);
+                        continue;
+                    }
+                    path.throughput /= probability;
+                }
+
+                /* Paths killed by roulette never need the shading data */
+                path.hit.mesh->computeIntersection(path.hit, its);
+                its.accumulatedRoughness = path.accumulatedRoughness;
+
+                /* Light sampling, occlusion is resolved by the shadow stage */
+                const Mesh* mesh = scene->getRandomLight(sampler->next1D());
+                if (mesh) {
+                    const Light* light = mesh->getLight();
+                    LightQueryRecord lRec(its.p);
+                    lRec.uv = its.uv;
+                    Color3f Ls = light->sample(lRec, sampler, mesh) / scene->getLightPdf();
+                    auto lightPdf = light->pdf(lRec, mesh);
+
+                    /* Apply trace bias to shadow ray. */
+                    lRec.shadowRay.mint = m_rayEpsilon;
+                    lRec.shadowRay.maxt -= m_rayEpsilon;
+
+                    BSDFQueryRecord bRec(its.toLocal(-ray.d), its.toLocal(lRec.wi), ESolidAngle);
+                    bRec.its = its;
+                    bRec.uv = its.uv;
+                    Color3f f = its.mesh->getBSDF()->eval(bRec);
+                    auto bsdfPdf = its.mesh->getBSDF()->pdf(bRec);
+                    stats::add(stats::EBSDFEval);
+                    stats::add(stats::EBSDFPdf);
+                    auto lightWeight = powerHeuristic(lightPdf, bsdfPdf);
+
+                    shadows.push_back({lRec.shadowRay, path.throughput * Ls * f * lightWeight, path.index});
+                }
+
+                /* Regularize the bsdf to reduce firefly issue */
+                if (m_regularization) {
+                    its.accumulatedRoughness += its.mesh->getBSDF()->regularize(its.uv) * m_accumulatedRoughness;
+                    path.accumulatedRoughness = its.accumulatedRoughness;
+                }
+
+                /* BSDF sampling */
+                sampler->generateSample(sample.pixel, sample.index, bounceDimension(path.depth) + BsdfDimensionOffset);
+                BSDFQueryRecord bRec(its.shFrame.toLocal(-ray.d));
+                bRec.uv = its.uv;
+                bRec.its = its;
+                path.throughput *= its.mesh->getBSDF()->sample(bRec, sampler->next1D(), sampler->next2D());
+                path.eta *= bRec.eta;
+                path.bsdfPdf = its.mesh->getBSDF()->pdf(bRec);
+                stats::add(stats::EBSDFSample);
+                stats::add(stats::EBSDFPdf);
+                path.discrete = bRec.measure == EDiscrete;
+                path.ray = Ray3f(its.p, its.toWorld(bRec.wo));
+                path.ray.mint = m_rayEpsilon;
+
+                paths[extended++] = path;
+            }
+
+            /* ----------------------- Shadow stage ----------------------- */
+            for (size_t i = 0; i < shadows.size(); ++i)
+                queueRays[i] = shadows[i].ray;
+            scene->rayOccluded(queueRays.data(), occluded.get(), shadows.size());
+            for (size_t i = 0; i < shadows.size(); ++i) {
+                if (!occluded[i])
+                    Li[shadows[i].index] += shadows[i].contribution;
+            }
+
+            /* ----------------------- Extension stage ----------------------- */
+            for (size_t k = 0; k < extended; ++k)
+                queueRays[k] = paths[k].ray;
+            scene->rayIntersect(queueRays.data(), queueHits.data(), extended);
+
+            live = 0;
+            for (size_t k = 0; k < extended; ++k) {
+                PathState &path = paths[k];
+                path.hit = queueHits[k];
+                if (!path.hit.isValid()) {
+                    Li[path.index] += path.throughput * scene->getBackgroundColor(path.ray.d);
+                    stats::addPathLength(path.depth + 1);
+                    continue;
+                }
+
+                if (++path.depth >= m_maxDepth) {
+                    stats::addPathLength(path.depth);
+                    continue;
+                }
+
+                /* Determine probability of having sampled that same
+                   direction using emitter sampling. */
+                if (path.hit.mesh->isLight()) {
+                    Intersection its;
+                    path.hit.mesh->computeIntersection(path.hit, its);
+                    LightQueryRecord lRec(path.ray.o, its.p, its.shFrame.n);
+                    lRec.uv = its.uv;
+                    float lightPdf = its.mesh->getLight()->pdf(lRec, its.mesh);
+                    path.bsdfWeight = powerHeuristic(path.bsdfPdf, lightPdf);
+                }
+
+                if (path.discrete) {
+                    path.bsdfWeight = 1.f;
+                }
+
+                paths[live++] = path;
+            }
+        }
+    }
+
     inline float powerHeuristic(float pdfA, float pdfB) const {
         pdfA *= pdfA;
         pdfB *= pdfB;
@@ -348,6 +581,16 @@ public:
     }
 
 private:
+    /* Sampler dimensions used per bounce by the wavefront version. Roulette,
+       light selection and the light sample come first, the BSDF sample
+       starts at a fixed offset because lights consume a varying amount */
+    static constexpr int BounceDimensions = 16;
+    static constexpr int BsdfDimensionOffset = 10;
+
+    static int bounceDimension(int depth) {
+        return PixelSample::CameraDimensions + depth * BounceDimensions;
+    }
+
     int m_maxDepth;
     float m_rayEpsilon;
     bool m_regularization;
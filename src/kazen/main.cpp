@@ -1,8 +1,15 @@
 #include <kazen/common.h>
 #include <kazen/scene.h>
+#include <kazen/camera.h>
 #include <kazen/parser.h>
 #include <kazen/renderer.h>
+#include <kazen/threading.h>
+#include <kazen/profiler.h>
+#include <kazen/output.h>
+#include <kazen/server.h>
 #include <filesystem/resolver.h>
+#include <Eigen/Geometry>
+#include <csignal>
 
 
 #include <xmmintrin.h>
@@ -17,13 +24,115 @@
 
 using namespace kazen;
 
+/* Let progressive renders finish cleanly (and save their image) on SIGINT/SIGTERM */
+static void stopHandler(int) {
+    renderer::requestStop();
+}
+
+/* Output file name of a batch job: the base name, the camera and the frame number */
+static std::string batchFilename(const std::string &basename, const Camera *camera, size_t cameraIndex,
+        int frame, int frameCount) {
+    std::string name = basename + "_" + (camera->getId().empty() ? std::to_string(cameraIndex) : camera->getId());
+    if (frameCount > 1)
+        name += fmt::format("_{:04d}", frame);
+    return name + ".png";
+}
+
+/* Jobs of a batch render: every camera, the ones in \c cameraIds or else the active
+   one, each turned about an axis through the scene center over the frames. The axis
+   is \c turntableAxis, or the up direction of each camera if that is zero */
+static std::vector<renderer::BatchJob> batchJobs(const Scene *scene, bool allCameras,
+        const std::vector<std::string> &cameraIds, int frameCount, const Vector3f &turntableAxis,
+        const std::string &filename) {
+    std::string basename = filename;
+    size_t lastdot = basename.find_last_of(".");
+    if (lastdot != std::string::npos)
+        basename.erase(lastdot, std::string::npos);
+
+    const std::vector<Camera *> &cameras = scene->getCameras();
+    std::vector<size_t> selected;
+    for (size_t i=0; i<cameras.size(); ++i) {
+        bool listed = cameraIds.empty() ? cameras[i] == scene->getCamera() :
+            std::find(cameraIds.begin(), cameraIds.end(), cameras[i]->getId()) != cameraIds.end();
+        if (allCameras || listed)
+            selected.push_back(i);
+    }
+    for (const std::string &id : cameraIds)
+        if (std::none_of(cameras.begin(), cameras.end(), [&](const Camera *c) { return c->getId() == id; }))
+            throw Exception("The scene has no camera with id \"{}\"", id);
+
+    Point3f center = scene->getBoundingBox().getCenter();
+    std::vector<renderer::BatchJob> jobs;
+    for (size_t index : selected) {
+        Vector3f axis = turntableAxis.isZero() ?
+            cameras[index]->getCameraToWorld() * Vector3f(0.f, 1.f, 0.f) : turntableAxis;
+        axis.normalize();
+        for (int frame=0; frame<frameCount; ++frame) {
+            float angle = 2.f * M_PI * frame / frameCount;
+            Eigen::Affine3f turn = Eigen::Translation3f(center) *
+                Eigen::AngleAxisf(angle, axis) * Eigen::Translation3f(-center);
+
+            renderer::BatchJob job;
+            job.camera = cameras[index];
+            job.cameraToWorld = Transform(turn.matrix()) * cameras[index]->getCameraToWorld();
+            job.filename = batchFilename(basename, cameras[index], index, frame, frameCount);
+            jobs.push_back(job);
+        }
+    }
+    return jobs;
+}
+
+static void printUsage(const char *program) {
+    cerr << "Syntax: " << program << " [options] <scene.xml>\n"
+            "Options:\n"
+            "  --progressive         Render the frame in passes of --pass-spp samples\n"
+            "  --pass-spp <n>        Samples per pixel rendered in each progressive pass\n"
+            "  --spp <n>             Stop after <n> samples per pixel\n"
+            "  --time-limit <sec>    Stop a progressive render after <sec> seconds\n"
+            "  --adaptive <error>    Stop sampling pixels below this relative error\n"
+            "  --block-size <n>      Edge length of the blocks rendered by each thread\n"
+            "  --no-sample-split     Never split the samples of a block across threads\n"
+            "  --pixel-order <name>  Pixel order inside a block: scanline, morton or hilbert\n"
+            "  --accumulation <name> Frame buffer merging: locked, striped or perthread\n"
+            "  --wavefront           Trace each block in waves of ray streams\n"
+            "                        (the only mode that traces camera ray packets)\n"
+            "  --checkpoint <sec>    Save a checkpoint of the render every <sec> seconds\n"
+            "  --resume              Continue from the checkpoint of a previous run\n"
+            "  --snapshot <sec>      Write the image in progress every <sec> seconds\n"
+            "  --snapshot-blocks <n> Write the image in progress every <n> finished blocks\n"
+            "  --crop <x> <y> <w> <h> Render only this window of the image\n"
+            "  --sample-range <b> <e> Render only the sample indices [b, e) of every pixel\n"
+            "  --partial             Save unnormalized sums as EXR, to be combined by kazen_merge\n"
+            "  --output <name>       Output file name (default: the scene file name)\n"
+            "  --resolution <w> <h>  Override the image size of the camera\n"
+            "  --camera <id>         Render through the camera with this id (repeatable)\n"
+            "  --all-cameras         Render one image through every camera of the scene\n"
+            "  --turntable <frames>  Render <frames> images, turning the camera about an axis\n"
+            "                        through the scene center (default: the camera's up)\n"
+            "  --turntable-axis <x> <y> <z> Turn about this world-space axis instead\n"
+            "  --exr <format>        EXR output: none, half or float (default)\n"
+            "  --cost-aov            Add per-pixel render time, rays and depth as EXR layers\n"
+            "  --serve <port>        Interactive preview: take commands on a localhost port\n"
+            "                        and stream the image to tev (see server.h)\n"
+            "  --tev <host:port>     Address of tev for --serve (default: 127.0.0.1:14158)\n"
+            "  --accel <name>        Ray tracing backend: embree (default) or bvh (built-in)\n"
+            "  --accel-quality <q>   BVH build quality: low, medium or high (default)\n"
+            "  --accel-compact       Build a smaller, slightly slower BVH\n"
+            "  --no-accel-robust     Let embree trade accuracy for traversal speed\n"
+            "  --embree-config <cfg> Extra embree device configuration, e.g. isa=avx2\n"
+            "  --threads <n>         Number of worker threads (default: all cores)\n"
+            "  --pin-threads         Pin the worker threads to cores\n"
+            "  --numa                One worker arena and block queue per NUMA node\n"
+            "  --trace <file.json>   Record a Chrome/Perfetto trace of scene loading and rendering" << endl;
+}
+
 int main(int argc, char **argv) {
     /* for best performance set FTZ and DAZ flags in MXCSR control and status register */
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
     _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
     
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml>" <<  endl;
+        printUsage(argv[0]);
         return -1;
     }
 
@@ -38,20 +147,125 @@ int main(int argc, char **argv) {
     );
     std::cout << util::copyright() << '\n';
 
-    /* Parsing scene file path */
+    /* Parsing command line options and scene file path */
     std::string sceneName = "";
+    std::string outputName = "";
+    int threadCount = 0;
+    bool pinThreads = false;
+    std::string traceName = "";
+    Vector2i resolution(0, 0);
+    std::vector<std::string> cameraIds;
+    bool allCameras = false;
+    int frameCount = 0;
+    Vector3f turntableAxis = Vector3f::Zero();
+    int servePort = 0;
+    std::string tevAddress = fmt::format("127.0.0.1:{}", KAZEN_TEV_PORT);
+    PropertyList cliOptions;
+    PropertyList accelOptions;
     for (int i = 1; i < argc; ++i) {
-        filesystem::path path(argv[i]);
+        std::string arg = argv[i];
         try {
-            if (path.extension() == "xml") {
-                sceneName = argv[i];
+            /* Fetch the value of an option that takes an argument */
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw Exception("Missing value for option \"{}\"", arg);
+                return argv[++i];
+            };
+
+            if (arg == "-h" || arg == "--help") {
+                printUsage(argv[0]);
+                return 0;
+            } else if (arg == "--progressive") {
+                cliOptions.setBoolean("progressive", true);
+            } else if (arg == "--pass-spp") {
+                cliOptions.setInteger("passSampleCount", string::toInt(value()));
+            } else if (arg == "--spp") {
+                cliOptions.setInteger("targetSampleCount", string::toInt(value()));
+            } else if (arg == "--time-limit") {
+                cliOptions.setFloat("timeLimit", string::toFloat(value()));
+            } else if (arg == "--adaptive") {
+                cliOptions.setBoolean("adaptive", true);
+                cliOptions.setFloat("adaptiveThreshold", string::toFloat(value()));
+            } else if (arg == "--block-size") {
+                cliOptions.setInteger("blockSize", string::toInt(value()));
+            } else if (arg == "--no-sample-split") {
+                cliOptions.setBoolean("sampleSplitting", false);
+            } else if (arg == "--pixel-order") {
+                cliOptions.setString("pixelOrder", value());
+            } else if (arg == "--accumulation") {
+                cliOptions.setString("accumulation", value());
+            } else if (arg == "--wavefront") {
+                cliOptions.setBoolean("wavefront", true);
+            } else if (arg == "--checkpoint") {
+                cliOptions.setFloat("checkpointInterval", string::toFloat(value()));
+            } else if (arg == "--resume") {
+                cliOptions.setBoolean("resume", true);
+            } else if (arg == "--snapshot") {
+                cliOptions.setFloat("snapshotInterval", string::toFloat(value()));
+            } else if (arg == "--snapshot-blocks") {
+                cliOptions.setInteger("snapshotBlocks", string::toInt(value()));
+            } else if (arg == "--crop") {
+                cliOptions.setInteger("cropX", string::toInt(value()));
+                cliOptions.setInteger("cropY", string::toInt(value()));
+                cliOptions.setInteger("cropWidth", string::toInt(value()));
+                cliOptions.setInteger("cropHeight", string::toInt(value()));
+            } else if (arg == "--sample-range") {
+                cliOptions.setInteger("sampleRangeBegin", string::toInt(value()));
+                cliOptions.setInteger("sampleRangeEnd", string::toInt(value()));
+            } else if (arg == "--partial") {
+                cliOptions.setBoolean("partial", true);
+            } else if (arg == "--output") {
+                outputName = value();
+            } else if (arg == "--exr") {
+                cliOptions.setString("exr", value());
+            } else if (arg == "--cost-aov") {
+                cliOptions.setBoolean("costAOV", true);
+            } else if (arg == "--resolution") {
+                resolution.x() = string::toInt(value());
+                resolution.y() = string::toInt(value());
+            } else if (arg == "--camera") {
+                cameraIds.push_back(value());
+            } else if (arg == "--all-cameras") {
+                allCameras = true;
+            } else if (arg == "--turntable") {
+                frameCount = std::max(1, string::toInt(value()));
+            } else if (arg == "--turntable-axis") {
+                turntableAxis.x() = string::toFloat(value());
+                turntableAxis.y() = string::toFloat(value());
+                turntableAxis.z() = string::toFloat(value());
+                if (turntableAxis.isZero())
+                    throw Exception("The turntable axis must not be zero");
+            } else if (arg == "--serve") {
+                servePort = string::toInt(value());
+            } else if (arg == "--tev") {
+                tevAddress = value();
+            } else if (arg == "--accel") {
+                accelOptions.setString("accel", value());
+            } else if (arg == "--accel-quality") {
+                accelOptions.setString("accelQuality", value());
+            } else if (arg == "--accel-compact") {
+                accelOptions.setBoolean("accelCompact", true);
+            } else if (arg == "--no-accel-robust") {
+                accelOptions.setBoolean("accelRobust", false);
+            } else if (arg == "--embree-config") {
+                accelOptions.setString("embreeConfig", value());
+            } else if (arg == "--threads") {
+                threadCount = string::toInt(value());
+            } else if (arg == "--pin-threads") {
+                pinThreads = true;
+            } else if (arg == "--numa") {
+                cliOptions.setBoolean("numa", true);
+            } else if (arg == "--trace") {
+                traceName = value();
+            } else if (filesystem::path(arg).extension() == "xml") {
+                sceneName = arg;
 
                 /* Add the parent directory of the scene file to the
                    file resolver. That way, the XML file can reference
                    resources (OBJ files, textures) using relative paths */
-                getFileResolver()->prepend(path.parent_path());
+                getFileResolver()->prepend(filesystem::path(arg).parent_path());
             } else {
-                cerr << "Fatal error: unknown file \"" << argv[i]
+                cerr << "Fatal error: unknown file \"" << arg
                      << "\", expected an extension of type .xml or .exr" << endl;
             }
         } catch (const std::exception &e) {
@@ -68,11 +282,50 @@ int main(int argc, char **argv) {
         return -1;
     } else {
         try {
+            /* Thread and build settings must be in place before Embree builds the scene */
+            threading::configure(threadCount, pinThreads);
+            AccelOptions::setOverrides(accelOptions);
+            if (!traceName.empty())
+                profiler::start();
+
             std::unique_ptr<Object> root(loadFromXML(sceneName));
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == Object::EScene)
+            if (root->getClassType() == Object::EScene) {
                 // std::cout << root->toString() << std::endl;
-                renderer::render(static_cast<Scene *>(root.get()), sceneName);
+                Scene *scene = static_cast<Scene *>(root.get());
+                if (resolution.x() > 0 && resolution.y() > 0)
+                    for (Camera *camera : scene->getCameras())
+                        camera->setOutputSize(resolution);
+
+                /* Render settings of the scene, overridden by the command line */
+                renderer::RenderOptions options(scene->getPropertyList());
+                options.configure(cliOptions);
+
+                /* Ctrl-C (or a preempting scheduler) ends the render early,
+                   keeping what is done when it can be saved or displayed */
+                if (options.progressive || options.checkpointInterval > 0.f) {
+                    std::signal(SIGINT, stopHandler);
+                    std::signal(SIGTERM, stopHandler);
+                }
+
+                /* Batch mode: several images of the scene, which is loaded only once */
+                std::string filename = outputName.empty() ? sceneName : outputName;
+                if (servePort > 0) {
+                    server::run(scene, options, servePort, tevAddress);
+                } else if (allCameras || !cameraIds.empty() || frameCount > 0) {
+                    renderer::renderBatch(scene, batchJobs(scene, allCameras, cameraIds,
+                        std::max(frameCount, 1), turntableAxis, filename), options);
+                } else {
+                    renderer::render(scene, filename, options);
+                }
+            }
+
+            /* Images are written in the background */
+            if (!output::wait())
+                return -1;
+
+            if (!traceName.empty())
+                profiler::save(traceName);
         } catch (const std::exception &e) {
             cerr << e.what() << endl;
             return -1;
@@ -0,0 +1,53 @@
+#include <kazen/common.h>
+#include <kazen/block.h>
+#include <kazen/bitmap.h>
+#include <OpenImageIO/imageio.h>
+
+using namespace kazen;
+
+/*
+ * Combine the partial renders of an image (see "kazen --partial")
+ *
+ * Every input holds the unnormalized sums and filter weights of a crop
+ * window and/or a range of sample indices. Summing them up before the
+ * normalization yields the same image as a single render of the frame.
+ */
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        cerr << "Syntax: " << argv[0] << " <output> <partial.exr> [<partial.exr> ...]" << endl;
+        return -1;
+    }
+
+    try {
+        /* The image size is stored as the display window of every partial */
+        auto in = OIIO::ImageInput::open(argv[2]);
+        if (!in)
+            throw Exception("Unable to open \"{}\"", argv[2]);
+        Vector2i outputSize(in->spec().full_width, in->spec().full_height);
+        in->close();
+
+        ImageBlock result(outputSize, nullptr);
+        result.clear();
+        for (int i = 2; i < argc; ++i) {
+            Vector2i size = result.addAccumulation(argv[i]);
+            if (size != outputSize)
+                throw Exception("\"{}\" belongs to a {}x{} image, expected {}x{}",
+                    argv[i], size.x(), size.y(), outputSize.x(), outputSize.y());
+        }
+        LOG("Merged {} partial renders.", argc - 2);
+
+        /* Determine the filename of the output bitmap */
+        std::string outputName = argv[1];
+        size_t lastdot = outputName.find_last_of(".");
+        if (lastdot != std::string::npos)
+            outputName.erase(lastdot, std::string::npos);
+
+        std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+        bitmap->saveEXR(outputName);
+        bitmap->savePNG(outputName);
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
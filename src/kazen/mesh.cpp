@@ -4,7 +4,7 @@
 #include <kazen/bsdf.h>
 #include <kazen/light.h>
 #include <kazen/warp.h>
-#include <kazen/timer.h>
+#include <kazen/profiler.h>
 #include <Eigen/Geometry>
 #include <filesystem/resolver.h>
 #include <unordered_map>
@@ -44,6 +44,22 @@ void Mesh::activate() {
     }
 }
 
+uint32_t Mesh::getVisibility() const {
+    if (m_light && !m_light->getPrimaryVisibility())
+        return m_visibility & EVisibleIndirect;
+    return m_visibility;
+}
+
+void Mesh::configureVisibility(const PropertyList &propList) {
+    m_visibility = 0;
+    if (propList.getBoolean("visibleCamera", true))
+        m_visibility |= EVisibleCamera;
+    if (propList.getBoolean("visibleShadow", true))
+        m_visibility |= EVisibleShadow;
+    if (propList.getBoolean("visibleIndirect", true))
+        m_visibility |= EVisibleIndirect;
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
@@ -91,6 +107,156 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     return t >= ray.mint && t <= ray.maxt;
 }
 
+void Mesh::computeIntersection(const Hit &hit, Intersection &its) const {
+    its.t = hit.t;
+    its.mesh = this;
+
+    its.uv = hit.uv; // prim_uv
+    uint32_t f = hit.primID;  // Triangle index of the closest intersection
+
+    /* At this point, we now know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-its.uv.sum(), its.uv;
+
+    /* References to all relevant mesh buffers */
+    const MatrixXf &V  = m_V;
+    const MatrixXf &N  = m_N;
+    const MatrixXf &UV = m_UV;
+    const MatrixXu &F  = m_F;
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+    // /* Compute the intersection positon accurately
+    //    using barycentric coordinates */
+    // its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+    
+    // [Hacking the Shadow Terminator. Johannes Hanika. 2021] https://jo.dreggn.org/home/2021_terminator.pdf
+    Point3f orignP = bary.x()*p0 + bary.y()*p1 + bary.z()*p2;
+    its.p = orignP;
+    /* The offset needs shading normals, meshes without them keep the plain point */
+    if (N.size() > 0) {
+        Normal3f n0 = N.col(idx0), n1 = N.col(idx1), n2 = N.col(idx2);
+        // get distance vectors from triangle vertices
+        Vector3f tmpu=orignP-p0, tmpv=orignP-p1, tmpw=orignP-p2;
+        // project these onto the tangent planes, defined by the shading normals
+        float dotu = std::min(0.f, tmpu.dot(n0));
+        float dotv = std::min(0.f, tmpv.dot(n1));
+        float dotw = std::min(0.f, tmpw.dot(n2));
+        tmpu -= dotu*n0;
+        tmpv -= dotv*n1;
+        tmpw -= dotw*n2;
+        // finally P' is the barycentric mean of these three
+        its.p = orignP + bary.x()*tmpu + bary.y()*tmpv + bary.z()*tmpw;
+    }
+
+    /* Compute the geometry frame */
+    Vector3f dp0 = p1 - p0, 
+             dp1 = p2 - p0;
+    its.geoFrame = Frame(dp0.cross(dp1).normalized());
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (UV.size() > 0)
+        its.uv = bary.x() * UV.col(idx0) + 
+                 bary.y() * UV.col(idx1) + 
+                 bary.z() * UV.col(idx2);
+    
+    if (likely(N.size() > 0 && UV.size() > 0)) {
+        Point2f uv0 = UV.col(idx0), 
+                uv1 = UV.col(idx1), 
+                uv2 = UV.col(idx2);
+
+        Vector3f dp0 = p1 - p0, 
+                 dp1 = p2 - p0;
+        
+        Point2f duv0 = uv1 - uv0, 
+                duv1 = uv2 - uv0;
+
+        Normal3f shNormal = bary.x() * N.col(idx0) + bary.y() * N.col(idx1) + bary.z() * N.col(idx2);
+        
+        float length = dp0.cross(dp1).norm();
+        if (length > 0.f) {
+            
+            float determinant = duv0.x()*duv1.y() - duv0.y()*duv1.x();
+            if (determinant > 0.f) {
+                float invDet = 1.0f / determinant;
+                its.dpdu = ( duv1.y() * dp0 - duv0.y() * dp1) * invDet;
+                its.dpdv = (-duv1.x() * dp0 + duv0.x() * dp1) * invDet;
+
+                /* TODO: Add dndu dndv */
+                // float invLN = 1.f / shNormal.norm(); 
+                // shNormal.normalize();
+
+                // Vector3f dndu = (n1 - n0) * invLN;
+                // Vector3f dndv = (n2 - n0) * invLN;
+                // dndu -= shNormal * shNormal.dot(dndu);
+                // dndv -= shNormal * shNormal.dot(dndv);
+
+                // its.dndu = (duv1.y()*dndu - duv0.y()*dndv) * invDet;
+                // its.dndv = (-duv1.x()*dndu + duv0.x()*dndv) * invDet;
+
+                its.shFrame.n = shNormal.normalized();
+                its.shFrame.s = (its.dpdu - shNormal * shNormal.dot(its.dpdu)).normalized();
+                its.shFrame.t = its.shFrame.n.cross(its.shFrame.s).normalized(); 
+            } else {
+                /* The user-specified parameterization is degenerate. Pick
+                arbitrary tangents that are perpendicular to the geometric normal */
+                // coordinateSystem(n.normalized(), its.dpdu, its.dpdv);
+
+                its.shFrame = Frame(shNormal.normalized());
+                its.dpdu = its.shFrame.s; 
+                its.dpdv = its.shFrame.t;
+                its.dndu = Vector3f(0.f);
+                its.dndv = Vector3f(0.f);  
+            }                
+        } else {
+            its.shFrame = Frame(shNormal.normalized());
+        }
+    }
+    else {
+        if (N.size() > 0) {
+            /* Compute the shading frame. Note that for simplicity,
+            the current implementation doesn't attempt to provide
+            tangents that are continuous across the surface. That
+            means that this code will need to be modified to be able
+            use anisotropic BRDFs, which need tangent continuity */
+
+            its.shFrame = Frame(
+                (bary.x() * N.col(idx0) +
+                bary.y() * N.col(idx1) +
+                bary.z() * N.col(idx2)).normalized());
+        } 
+        else {
+            /* No normals provided. Use the geometric frame */
+            its.shFrame = its.geoFrame;
+        }
+    }
+
+    /* Instanced meshes are stored in the space of their shape group */
+    if (hit.toWorld) {
+        const Transform &trafo = *hit.toWorld;
+        its.p = trafo * its.p;
+        its.dpdu = trafo * its.dpdu;
+        its.dpdv = trafo * its.dpdv;
+        its.geoFrame = Frame(Normal3f(trafo * its.geoFrame.n).normalized());
+
+        /* Normals transform with the inverse transpose, the tangent
+           is made orthogonal to the new normal again */
+        Normal3f n = Normal3f(trafo * its.shFrame.n).normalized();
+        Vector3f s = trafo * its.shFrame.s;
+        s = (s - n * n.dot(s)).normalized();
+        its.shFrame = Frame(s, n.cross(s), n);
+    }
+}
+
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
     BoundingBox3f result(m_V.col(m_F(0, index)));
     result.expandBy(m_V.col(m_F(1, index)));
@@ -208,11 +374,12 @@ public:
         if (is.fail())
             throw Exception("Unable to open OBJ file \"{}\"!", filename.str());
         Transform trafo = propList.getTransform("toWorld", Transform());
+        configureVisibility(propList);
 
         // cout << "Loading \"" << filename << "\" ==> ";
         // LOG("Loading Mesh: \"{}\" ... ", filename.str());
         cout.flush();
-        Timer timer;
+        profiler::Scope scope("WavefrontOBJ", filename.str());
 
         std::vector<Vector3f>   positions;
         std::vector<Vector2f>   texcoords;
@@ -295,11 +462,11 @@ public:
 
         m_name = filename.str();
         // cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-        //      << timer.elapsedString() << " and "
+        //      << util::timeString(scope.elapsed()) << " and "
         //      << util::memString(m_F.size() * sizeof(uint32_t) +
         //                   sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
         //      << ")" << endl;
-        LOG("Mesh ready.    (took {}): \"{}\"", util::timeString(timer.elapsed()), filename.str());
+        LOG("Mesh ready.    (took {}): \"{}\"", util::timeString(scope.elapsed()), filename.str());
     }
 
 protected:
@@ -342,5 +509,26 @@ protected:
     };
 };
 
+void writeSphereOBJ(const std::string &filename, int rings) {
+    std::ofstream os(filename);
+    if (os.fail())
+        throw Exception("Unable to write \"{}\"", filename);
+    int segments = 2 * rings;
+    for (int i = 0; i <= rings; ++i) {
+        float theta = M_PI * i / rings;
+        for (int j = 0; j < segments; ++j) {
+            float phi = 2.f * M_PI * j / segments;
+            os << "v " << std::sin(theta) * std::cos(phi) << " " << std::sin(theta) * std::sin(phi)
+               << " " << std::cos(theta) << "\n";
+        }
+    }
+    for (int i = 0; i < rings; ++i) {
+        for (int j = 0; j < segments; ++j) {
+            int a = i * segments + j + 1, b = i * segments + (j + 1) % segments + 1;
+            os << "f " << a << " " << b << " " << b + segments << " " << a + segments << "\n";
+        }
+    }
+}
+
 KAZEN_REGISTER_CLASS(WavefrontOBJ, "obj");
 NAMESPACE_END(kazen)
@@ -0,0 +1,47 @@
+#include <kazen/output.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(output)
+
+static std::mutex writersMutex;
+static std::vector<std::thread> writers;
+static std::atomic<bool> failed(false);
+
+/* Run \c write on a thread of its own, errors are logged and remembered for wait() */
+template <typename Func> static void spawn(Func write) {
+    std::lock_guard<std::mutex> lock(writersMutex);
+    writers.emplace_back([write] {
+        try {
+            write();
+        } catch (const std::exception &e) {
+            cerr << "Error while saving the image: " << e.what() << endl;
+            failed = true;
+        }
+    });
+}
+
+void saveAsync(std::shared_ptr<const Bitmap> bitmap, const std::string &basename, bool exr, bool half,
+               std::vector<BitmapChannel> channels) {
+    spawn([bitmap, basename] { bitmap->savePNG(basename); });
+    if (exr) {
+        auto extra = std::make_shared<const std::vector<BitmapChannel>>(std::move(channels));
+        spawn([bitmap, basename, half, extra] { bitmap->saveEXR(basename, half, *extra); });
+    }
+}
+
+bool wait() {
+    std::vector<std::thread> pending;
+    /* Take the threads out, so that new writes may start meanwhile */ {
+        std::lock_guard<std::mutex> lock(writersMutex);
+        pending.swap(writers);
+    }
+    for (std::thread &writer : pending)
+        writer.join();
+    return !failed.exchange(false);
+}
+
+NAMESPACE_END(output)
+NAMESPACE_END(kazen)
@@ -1,5 +1,6 @@
 #include <kazen/parser.h>
 #include <kazen/proplist.h>
+#include <kazen/profiler.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
 #include <fstream>
@@ -8,6 +9,7 @@
 NAMESPACE_BEGIN(kazen)
 
 Object *loadFromXML(const std::string &filename) {
+    profiler::Scope scope("loadFromXML", filename);
 
     /* Load the XML file using 'pugi' (a tiny self-contained XML parser implemented in C++) */
     pugi::xml_document doc;
@@ -50,6 +52,8 @@ Object *loadFromXML(const std::string &filename) {
         ESampler                = Object::ESampler,
         ETexture                = Object::ETexture,
         EReconstructionFilter   = Object::EReconstructionFilter,
+        EShapeGroup             = Object::EShapeGroup,
+        EInstance               = Object::EInstance,
 
         /* Properties */
         EBoolean = Object::EClassTypeCount,
@@ -82,6 +86,8 @@ Object *loadFromXML(const std::string &filename) {
     tags["sampler"]     = ESampler;
     tags["texture"]     = ETexture;
     tags["rfilter"]     = EReconstructionFilter;
+    tags["shapegroup"]  = EShapeGroup;
+    tags["instance"]    = EInstance;
     tags["boolean"]     = EBoolean;
     tags["integer"]     = EInteger;
     tags["float"]       = EFloat;
@@ -153,6 +159,10 @@ Object *loadFromXML(const std::string &filename) {
 
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EShapeGroup)
+            node.append_attribute("type") = "shapegroup";
+        else if (tag == EInstance)
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
@@ -277,15 +287,7 @@ Object *loadFromXML(const std::string &filename) {
                             Eigen::Vector3f target = string::toVector3f(node.attribute("target").value());
                             Eigen::Vector3f up = string::toVector3f(node.attribute("up").value());
 
-                            Vector3f dir = (target - origin).normalized();
-                            Vector3f left = up.normalized().cross(dir).normalized();
-                            Vector3f newUp = dir.cross(left).normalized();
-
-                            Eigen::Matrix4f trafo;
-                            trafo << left, newUp, dir, origin,
-                                      0, 0, 0, 1;
-
-                            transform = Eigen::Affine3f(trafo) * transform;
+                            transform = Eigen::Affine3f(Transform::lookAt(origin, target, up).getMatrix()) * transform;
                         }
                         break;
 
@@ -0,0 +1,116 @@
+#include <kazen/profiler.h>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(profiler)
+
+/* Events a thread keeps at most, later ones are dropped and counted */
+static const size_t MaxThreadEvents = 1 << 20;
+
+struct Event {
+    const char *name;
+    std::string detail;
+    int64_t begin, end;
+};
+
+struct ThreadEvents {
+    int tid;
+    std::vector<Event> events;
+    size_t dropped = 0;
+};
+
+static const auto epoch = std::chrono::steady_clock::now();
+static std::atomic<bool> recording(false);
+
+/* Event buffers of every thread that recorded something. They are never
+   freed, the events of TBB workers that shut down are still needed */
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<ThreadEvents>> registry;
+
+static ThreadEvents &local() {
+    static thread_local ThreadEvents *events = nullptr;
+    if (unlikely(!events)) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.emplace_back(new ThreadEvents());
+        events = registry.back().get();
+        events->tid = (int) registry.size() - 1;
+    }
+    return *events;
+}
+
+void start() {
+    recording = true;
+}
+
+bool isRecording() {
+    return recording.load(std::memory_order_relaxed);
+}
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch).count();
+}
+
+void record(const char *name, std::string detail, int64_t begin, int64_t end) {
+    ThreadEvents &events = local();
+    if (events.events.size() >= MaxThreadEvents) {
+        events.dropped++;
+        return;
+    }
+    events.events.push_back({name, std::move(detail), begin, end});
+}
+
+/* Quote a string for JSON */
+static std::string quote(const std::string &value) {
+    std::string result = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        if ((unsigned char) c < 0x20)
+            result += fmt::format("\\u{:04x}", (int) c);
+        else
+            result += c;
+    }
+    return result + "\"";
+}
+
+void save(const std::string &filename) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::ofstream stream(filename);
+    if (stream.fail())
+        throw Exception("Unable to write the trace \"{}\"!", filename);
+
+    stream << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    size_t eventCount = 0, dropped = 0;
+    for (auto &thread : registry) {
+        if (thread->events.empty())
+            continue;
+        stream << (first ? "" : ",\n")
+               << fmt::format("{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": {}, "
+                              "\"args\": {{\"name\": \"thread {}\"}}}}",
+                              thread->tid, thread->tid);
+        first = false;
+
+        for (const Event &event : thread->events) {
+            stream << fmt::format(",\n{{\"name\": {}, \"ph\": \"X\", \"pid\": 0, \"tid\": {}, \"ts\": {}, \"dur\": {}",
+                                  quote(event.name), thread->tid, event.begin, event.end - event.begin);
+            if (!event.detail.empty())
+                stream << ", \"args\": {\"detail\": " << quote(event.detail) << "}";
+            stream << "}";
+        }
+        eventCount += thread->events.size();
+        dropped += thread->dropped;
+    }
+    stream << "\n]}\n";
+
+    LOG("Trace saved to {} ({} events, {} threads).", filename, eventCount, registry.size());
+    if (dropped > 0)
+        LOG("Trace buffers were full, {} events were dropped.", dropped);
+}
+
+NAMESPACE_END(profiler)
+NAMESPACE_END(kazen)
@@ -8,15 +8,111 @@
 #include <kazen/sampler.h>
 #include <kazen/progress.h>
 #include <kazen/integrator.h>
+#include <kazen/checkpoint.h>
+#include <kazen/threading.h>
+#include <kazen/stats.h>
+#include <kazen/profiler.h>
+#include <kazen/output.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+#include <tbb/info.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/spin_rw_mutex.h>
+#include <sstream>
+#include <cstdio>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
 
 
 NAMESPACE_BEGIN(kazen)
 NAMESPACE_BEGIN(renderer)
 
+/* Set asynchronously (e.g. from a signal handler) to end the render early */
+static std::atomic<bool> stopRequested(false);
+
+/* Adaptive sampling: noisy pixels receive at most this many times the sample count */
+static const uint32_t AdaptiveMaxSampleFactor = 4;
+
+void RenderOptions::configure(const PropertyList &propList) {
+    progressive = propList.getBoolean("progressive", progressive);
+    passSampleCount = (uint32_t) std::max(1, propList.getInteger("passSampleCount", (int) passSampleCount));
+    targetSampleCount = (uint32_t) std::max(0, propList.getInteger("targetSampleCount", (int) targetSampleCount));
+    timeLimit = std::max(0.f, propList.getFloat("timeLimit", timeLimit));
+    adaptive = propList.getBoolean("adaptive", adaptive);
+    adaptiveThreshold = propList.getFloat("adaptiveThreshold", adaptiveThreshold);
+    adaptiveMinSampleCount = (uint32_t) std::max(2, propList.getInteger("adaptiveMinSampleCount", (int) adaptiveMinSampleCount));
+    blockSize = std::max(1, propList.getInteger("blockSize", blockSize));
+    sampleSplitting = propList.getBoolean("sampleSplitting", sampleSplitting);
+
+    std::string order = string::toLower(propList.getString("pixelOrder", ""));
+    if (order == "scanline")
+        pixelOrder = EScanline;
+    else if (order == "morton")
+        pixelOrder = EMorton;
+    else if (order == "hilbert")
+        pixelOrder = EHilbert;
+    else if (!order.empty())
+        throw Exception("Unknown pixel order \"{}\" (expected scanline, morton or hilbert)", order);
+
+    wavefront = propList.getBoolean("wavefront", wavefront);
+    checkpointInterval = std::max(0.f, propList.getFloat("checkpointInterval", checkpointInterval));
+    resume = propList.getBoolean("resume", resume);
+    snapshotInterval = std::max(0.f, propList.getFloat("snapshotInterval", snapshotInterval));
+    snapshotBlocks = std::max(0, propList.getInteger("snapshotBlocks", snapshotBlocks));
+    cropOffset = Point2i(propList.getInteger("cropX", cropOffset.x()), propList.getInteger("cropY", cropOffset.y()));
+    cropSize = Vector2i(propList.getInteger("cropWidth", cropSize.x()), propList.getInteger("cropHeight", cropSize.y()));
+    sampleRangeBegin = (uint32_t) std::max(0, propList.getInteger("sampleRangeBegin", (int) sampleRangeBegin));
+    sampleRangeEnd = (uint32_t) std::max(0, propList.getInteger("sampleRangeEnd", (int) sampleRangeEnd));
+    partial = propList.getBoolean("partial", partial);
+    numa = propList.getBoolean("numa", numa);
+    costAOV = propList.getBoolean("costAOV", costAOV);
+
+    std::string strategy = string::toLower(propList.getString("accumulation", ""));
+    if (strategy == "locked")
+        accumulation = ELocked;
+    else if (strategy == "striped")
+        accumulation = EStriped;
+    else if (strategy == "perthread")
+        accumulation = EPerThread;
+    else if (!strategy.empty())
+        throw Exception("Unknown accumulation strategy \"{}\" (expected locked, striped or perthread)", strategy);
+
+    std::string exr = string::toLower(propList.getString("exr", ""));
+    if (exr == "none")
+        exrFormat = ENoEXR;
+    else if (exr == "half")
+        exrFormat = EHalfEXR;
+    else if (exr == "float")
+        exrFormat = EFloatEXR;
+    else if (!exr.empty())
+        throw Exception("Unknown EXR format \"{}\" (expected none, half or float)", exr);
+}
+
+std::string RenderOptions::toString() const {
+    return fmt::format(
+        "RenderOptions[progressive={}, passSampleCount={}, targetSampleCount={}, timeLimit={}, "
+        "adaptive={}, adaptiveThreshold={}, adaptiveMinSampleCount={}, blockSize={}, sampleSplitting={}, pixelOrder={}, accumulation={}, wavefront={}, "
+        "checkpointInterval={}, resume={}, snapshotInterval={}, snapshotBlocks={}, crop=[{}, {}, {}, {}], sampleRange=[{}, {}), partial={}, numa={}, exr={}, costAOV={}]",
+        progressive, passSampleCount, targetSampleCount, timeLimit,
+        adaptive, adaptiveThreshold, adaptiveMinSampleCount, blockSize, sampleSplitting, (int) pixelOrder,
+        (int) accumulation, wavefront, checkpointInterval, resume, snapshotInterval, snapshotBlocks,
+        cropOffset.x(), cropOffset.y(), cropSize.x(), cropSize.y(), sampleRangeBegin, sampleRangeEnd, partial, numa, (int) exrFormat, costAOV);
+}
+
+void requestStop() {
+    stopRequested = true;
+}
+
+void clearStop() {
+    stopRequested = false;
+}
+
 void renderSample(const Scene *scene, Sampler *sampler, ImageBlock &block, const Point2i &pixelPosition) {
     const Integrator *integrator = scene->getIntegrator();
     const Camera *camera = scene->getCamera();
@@ -30,6 +126,7 @@ void renderSample(const Scene *scene, Sampler *sampler, ImageBlock &block, const
     /* Sample a ray from the camera */
     Ray3f ray;
     Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+    stats::add(stats::ECameraRays);
 
     /* Compute the incident radiance */
     value *= integrator->Li(scene, sampler, ray);
@@ -40,27 +137,241 @@ void renderSample(const Scene *scene, Sampler *sampler, ImageBlock &block, const
 }
 
 
-void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+/*
+ * Periodic snapshots of the image in progress, written to <name>_snapshot.exr/.png
+ * by a background thread. The frame buffer is only locked while it is copied,
+ * normalizing and encoding happen while the workers go on merging blocks.
+ */
+class Snapshotter {
+public:
+    Snapshotter(const ImageBlock &result, const ReconstructionFilter *filter,
+                const std::string &basename, const RenderOptions &options)
+        : m_result(result), m_copy(result.getSize(), filter), m_basename(basename + "_snapshot"),
+          m_options(options) {
+        m_copy.setOffset(result.getOffset());
+        if (options.snapshotInterval > 0.f || options.snapshotBlocks > 0)
+            m_thread = std::thread([this] { run(); });
+    }
+
+    ~Snapshotter() {
+        if (!m_thread.joinable())
+            return;
+        /* Critical section: wake up the thread */ {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_condition.notify_one();
+        m_thread.join();
+    }
+
+    /// Called with the running count of finished blocks
+    void blockDone(size_t blocksDone) {
+        if (m_options.snapshotBlocks <= 0 || blocksDone % m_options.snapshotBlocks != 0)
+            return;
+        /* Critical section: request a snapshot */ {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_requested = true;
+        }
+        m_condition.notify_one();
+    }
+
+private:
+    void run() {
+        auto ready = [this] { return m_stop || m_requested; };
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+            if (m_options.snapshotInterval > 0.f)
+                m_condition.wait_for(lock, std::chrono::duration<float>(m_options.snapshotInterval), ready);
+            else
+                m_condition.wait(lock, ready);
+            if (m_stop)
+                break;
+            m_requested = false;
+
+            lock.unlock();
+            save();
+            lock.lock();
+        }
+    }
+
+    void save() {
+        profiler::Scope scope("snapshot");
+        try {
+            m_result.copyTo(m_copy);
+            std::unique_ptr<Bitmap> bitmap(m_copy.toBitmap());
+
+            /* Readers must never see a partially written file: write under
+               a temporary name and rename once the file is complete */
+            std::string tempName = m_basename + ".tmp";
+            std::vector<std::string> extensions = { ".png" };
+            bitmap->savePNG(tempName);
+            if (m_options.exrFormat != RenderOptions::ENoEXR) {
+                bitmap->saveEXR(tempName, m_options.exrFormat == RenderOptions::EHalfEXR);
+                extensions.push_back(".exr");
+            }
+            for (const std::string &extension : extensions)
+                if (std::rename((tempName + extension).c_str(), (m_basename + extension).c_str()) != 0)
+                    throw Exception("Unable to replace \"{}{}\"", m_basename, extension);
+        } catch (const std::exception &e) {
+            cerr << "Error while saving a snapshot: " << e.what() << endl;
+        }
+    }
+
+    const ImageBlock &m_result;
+    ImageBlock m_copy;
+    std::string m_basename;
+    const RenderOptions &m_options;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_requested = false;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+/* Cost heatmap AOV: render a sample and record its time, rays and bounces */
+static void renderSampleWithCost(const Scene *scene, Sampler *sampler, ImageBlock &block, const Point2i &pixelPosition) {
+    const stats::Counters &counters = stats::local();
+    uint64_t rays = counters.counters[stats::EIntersectRays] + counters.counters[stats::EShadowRays];
+    uint64_t bounces = counters.bounces;
+    auto start = std::chrono::steady_clock::now();
+
+    renderSample(scene, sampler, block, pixelPosition);
+
+    PixelCost cost;
+    cost.seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+    cost.rays = (uint32_t) (counters.counters[stats::EIntersectRays] + counters.counters[stats::EShadowRays] - rays);
+    cost.bounces = (uint32_t) (counters.bounces - bounces);
+    cost.samples = 1;
+    block.putCost(pixelPosition, cost);
+}
+
+std::vector<Point2i> blockPixels(const ImageBlock &block, RenderOptions::EPixelOrder order) {
     Point2i offset = block.getOffset();
     Vector2i size  = block.getSize();
     uint32_t pixelCount = size.x() * size.y();
 
+    /* Space-filling curves cover the enclosing power-of-two square,
+       positions outside of the block are skipped */
+    uint32_t curveSize = math::roundUpPow2((uint32_t) size.maxCoeff());
+    if (order != RenderOptions::EScanline)
+        pixelCount = curveSize * curveSize;
+
+    std::vector<Point2i> pixels;
+    pixels.reserve(size.x() * size.y());
+    for (uint32_t i=0; i<pixelCount; ++i) {
+        /* Get current pixel position in block */
+        uint32_t x, y;
+        switch (order) {
+            case RenderOptions::EMorton:  math::mortonDecode(i, x, y); break;
+            case RenderOptions::EHilbert: math::hilbertDecode(curveSize, i, x, y); break;
+            default: x = i % size.x(); y = i / size.x(); break;
+        }
+        if (x >= (uint32_t) size.x() || y >= (uint32_t) size.y())
+            continue;
+
+        pixels.push_back(Point2i(x, y) + offset);
+    }
+    return pixels;
+}
+
+/* Adaptive sampling: has the pixel estimate converged? */
+static bool converged(const ImageBlock &block, const ImageBlock *history, const Point2i &pos,
+        uint32_t sampleIndex, const RenderOptions &options) {
+    if (!options.adaptive || sampleIndex < options.adaptiveMinSampleCount)
+        return false;
+
+    PixelMoments moments = block.getMoments(pos);
+    if (history)
+        moments += history->getMoments(pos);
+    return moments.relativeError() < options.adaptiveThreshold;
+}
+
+/* Adaptive sampling: number of samples taken in a region of the frame buffer */
+static size_t samplesTaken(const ImageBlock &result, const Point2i &offset, const Vector2i &size) {
+    size_t count = 0;
+    for (int y=0; y<size.y(); ++y)
+        for (int x=0; x<size.x(); ++x)
+            count += result.getMoments(offset + Vector2i(x, y)).count;
+    return count;
+}
+
+/* Wavefront mode: a wave holds one sample of every pixel of the block,
+   its camera rays are handed to the integrator as a single batch */
+static void renderBlockWavefront(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleBegin, uint32_t sampleEnd,
+        const RenderOptions &options, const ImageBlock *history) {
+    const Integrator *integrator = scene->getIntegrator();
+    const Camera *camera = scene->getCamera();
+    std::vector<Point2i> pixels = blockPixels(block, options.pixelOrder);
+
+    std::vector<Ray3f> rays;
+    std::vector<PixelSample> samples;
+    std::vector<Point2f> positions;
+    std::vector<Color3f> weights, values;
+    for (uint32_t j=sampleBegin; j<sampleEnd; ++j) {
+        rays.clear();
+        samples.clear();
+        positions.clear();
+        weights.clear();
+
+        /* Generate the camera rays of this wave */
+        for (const Point2i &pos : pixels) {
+            if (converged(block, history, pos, j, options))
+                continue;
+
+            sampler->generateSample(pos, j);
+            Point2f pixelSample = Point2f(float(pos.x()), float(pos.y())) + sampler->nextPixel2D();
+            Point2f apertureSample = sampler->next2D();
+
+            Ray3f ray;
+            weights.push_back(camera->sampleRay(ray, pixelSample, apertureSample));
+            rays.push_back(ray);
+            samples.push_back({pos, j});
+            positions.push_back(pixelSample);
+        }
+
+        /* Every pixel has converged */
+        if (rays.empty())
+            break;
+        stats::add(stats::ECameraRays, rays.size());
+
+        /* Compute the incident radiance of the whole wave */
+        values.resize(rays.size());
+        integrator->Li(scene, sampler, rays.data(), samples.data(), values.data(), rays.size());
+
+        /* Store in the image block */
+        for (size_t i=0; i<rays.size(); ++i)
+            block.put(positions[i], weights[i] * values[i]);
+    }
+}
+
+void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleBegin, uint32_t sampleEnd,
+        const RenderOptions &options, const ImageBlock *history) {
+    profiler::Scope scope("renderBlock");
+
     /* Clear the block contents */
     block.clear();
 
+    /* Costs are measured per sample, which waves of rays cannot tell apart */
+    if (options.wavefront && !block.hasCosts()) {
+        renderBlockWavefront(scene, sampler, block, sampleBegin, sampleEnd, options, history);
+        return;
+    }
+
     /* For each pixel and pixel sample sample */
-    for (uint32_t i=0; i<pixelCount; ++i) {
-        /* Get current pixel position in block */
-        // TODO: using morton encode to get appropriate pixel position
-        Point2i pos = Point2i(i%size.x(), i/size.x());
-        pos += offset;
+    for (const Point2i &pos : blockPixels(block, options.pixelOrder)) {
+        for (uint32_t j=sampleBegin; j<sampleEnd; ++j) {
+            /* Adaptive sampling: stop once the pixel estimate has converged */
+            if (converged(block, history, pos, j, options))
+                break;
 
-        for (uint32_t j=0; j<sampler->getSampleCount(); ++j) {    
             /* Prepare to a new pixel sample */
             sampler->generateSample(pos, j);
             
             /* Render all contained pixels */
-            renderSample(scene, sampler, block, pos);
+            if (block.hasCosts())
+                renderSampleWithCost(scene, sampler, block, pos);
+            else
+                renderSample(scene, sampler, block, pos);
             
             /* Advance to the next sample */
             sampler->advance();
@@ -69,87 +380,431 @@ void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
 }
 
 
-void render(Scene *scene, const std::string &filename) {    
+void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block, uint32_t sampleBegin, uint32_t sampleEnd) {
+    renderBlock(scene, sampler, block, sampleBegin, sampleEnd, RenderOptions());
+}
+
+
+void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+    renderBlock(scene, sampler, block, 0, sampler->getSampleCount());
+}
+
+
+RenderSummary render(Scene *scene, const std::string &filename, const RenderOptions &options, RenderObserver *observer) {
+    RenderSummary summary;
     const Camera *camera = scene->getCamera();
     Vector2i outputSize = camera->getOutputSize();
     scene->getIntegrator()->preprocess(scene);
 
-    /* Create a block generator (i.e. a work scheduler) */
-    BlockGenerator blockGenerator(outputSize, KAZEN_BLOCK_SIZE);
-
-    /* Allocate memory for the entire output image and clear it */
-    ImageBlock result(outputSize, camera->getReconstructionFilter());
+    /* Determine the filename of the output bitmap */
+    std::string outputName = filename;
+    size_t lastdot = outputName.find_last_of(".");
+    if (lastdot != std::string::npos)
+        outputName.erase(lastdot, std::string::npos);
+    if (outputName.empty() && (options.checkpointInterval > 0.f || options.resume || options.partial ||
+                               options.snapshotInterval > 0.f || options.snapshotBlocks > 0))
+        throw Exception("Checkpoints, snapshots and partial renders need an output file name");
+
+    /* Region of the image to render (a crop window when rendering distributed) */
+    Point2i cropOffset = options.cropOffset;
+    Vector2i cropSize = options.cropSize;
+    if (cropSize.x() <= 0 || cropSize.y() <= 0) {
+        cropOffset = Point2i(0, 0);
+        cropSize = outputSize;
+    }
+    if ((cropOffset.array() < 0).any() || ((cropOffset + cropSize).array() > outputSize.array()).any())
+        throw Exception("Crop window [{}, {}] {}x{} exceeds the image size {}x{}",
+            cropOffset.x(), cropOffset.y(), cropSize.x(), cropSize.y(), outputSize.x(), outputSize.y());
+
+    /* Sample indices [firstSample, sampleCount) of every pixel, split into passes in
+       progressive mode. Samplers are indexed by the sample index, so disjoint ranges
+       rendered by different processes draw independent samples */
+    uint32_t sampleCount = scene->getSampler()->getSampleCount();
+    if (options.targetSampleCount > 0)
+        sampleCount = std::min(sampleCount, options.targetSampleCount);
+    if (options.sampleRangeEnd > 0)
+        sampleCount = std::min(sampleCount, options.sampleRangeEnd);
+    uint32_t firstSample = options.sampleRangeBegin;
+    if (firstSample >= sampleCount)
+        throw Exception("Sample range [{}, {}) is empty", firstSample, sampleCount);
+    uint32_t passSampleCount = options.progressive ?
+        std::min(options.passSampleCount, sampleCount - firstSample) : sampleCount - firstSample;
+    uint32_t passCount = (sampleCount - firstSample + passSampleCount - 1) / passSampleCount;
+
+    /* Allocate memory for the rendered region of the image and clear it */
+    ImageBlock result(cropSize, camera->getReconstructionFilter(), options.adaptive, options.costAOV);
+    result.setOffset(cropOffset);
     result.clear();
 
+    /* Striped accumulation: blocks only contend with blocks on the same rows */
+    if (options.accumulation == RenderOptions::EStriped)
+        result.setStripeHeight(options.blockSize);
+
+    /* Per-thread accumulation: every worker merges into a private frame buffer */
+    tbb::enumerable_thread_specific<ImageBlock> buffers(cropSize,
+        camera->getReconstructionFilter(), options.adaptive, options.costAOV);
+
+    /* Worker arenas: one for the whole machine, or one per NUMA node whose
+       workers start with their own band of the image (see BlockQueues) */
+    std::vector<tbb::numa_node_id> nodes(1, tbb::task_arena::automatic);
+    if (options.numa)
+        nodes = tbb::info::numa_nodes();
+    std::vector<std::unique_ptr<tbb::task_arena>> arenas;
+    std::vector<std::unique_ptr<tbb::task_scheduler_observer>> pinning;
+    std::vector<int> arenaWorkers;
+    int workerCount = 0;
+    for (tbb::numa_node_id node : nodes) {
+        int concurrency = threading::getThreadCount();
+        if (options.numa)
+            concurrency = std::max(1, std::min(tbb::info::default_concurrency(node),
+                                               concurrency / (int) nodes.size()));
+        arenas.emplace_back(new tbb::task_arena(tbb::task_arena::constraints(node, concurrency)));
+        arenaWorkers.push_back(concurrency);
+
+        /* NUMA arenas are bound to their node by TBB, pin the others to cores */
+        if (!options.numa)
+            pinning.push_back(threading::pinArena(*arenas.back(), workerCount));
+        workerCount += concurrency;
+    }
+    if (options.numa)
+        LOG("NUMA: {} nodes, {} workers.", nodes.size(), workerCount);
+
+    /* Render progress as recorded in checkpoints. The tail of every band's
+       spiral is split once per worker so that nobody idles at the end of a pass */
+    bool checkpointing = options.checkpointInterval > 0.f;
+    std::string checkpointName = outputName + ".ckpt";
+    Checkpoint state;
+    state.outputSize = outputSize;
+    state.cropOffset = cropOffset;
+    state.blockSize = options.blockSize;
+    state.splitCount = workerCount / (int) arenas.size();
+    state.queueCount = (int) arenas.size();
+    state.firstSample = firstSample;
+    state.sampleCount = sampleCount;
+    state.passSampleCount = passSampleCount;
+    state.sampler = scene->getSampler()->toString();
+
+    /* Continue from the last checkpoint, reusing its block layout */
+    if (options.resume) {
+        Checkpoint checkpoint;
+        if (!checkpoint.load(checkpointName)) {
+            LOG("No checkpoint at {}, starting from scratch.", checkpointName);
+        } else {
+            if (!checkpoint.isCompatible(state))
+                throw Exception("Checkpoint \"{}\" was written with different render settings", checkpointName);
+            std::istringstream stream(checkpoint.image);
+            result.unserialize(stream);
+            state.splitCount = checkpoint.splitCount;
+            state.queueCount = checkpoint.queueCount;
+            state.pass = checkpoint.pass;
+            state.blocksDone = std::move(checkpoint.blocksDone);
+            LOG("Resuming from {} at {}/{} spp.", checkpointName, firstSample + state.pass * passSampleCount, sampleCount);
+        }
+    }
+
+    /* Count only the work of this render */
+    stats::reset();
+
     /* Do the following in parallel and asynchronously */
     std::thread render_thread([&] {
         auto progress = Progress("Rendering...");
         std::mutex mutex;
         Timer timer;
 
-        /* Total number of blocks to be handled, including multiple passes. */
-        size_t totalBlocks = blockGenerator.getBlockCount();
-        size_t blocksDone = 0;
-
-        tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
+        /* The time budget is only honored in progressive mode, stop
+           requests also when the progress can be kept in a checkpoint */
+        auto expired = [&]() {
+            if (stopRequested)
+                return options.progressive || checkpointing;
+            return options.progressive &&
+                options.timeLimit > 0.f && timer.elapsed() >= 1000.0 * options.timeLimit;
+        };
 
-        auto map = [&](const tbb::blocked_range<int> &range) {
-            /* Allocate memory for a small image block to be rendered by the current thread */
-            ImageBlock block(Vector2i(KAZEN_BLOCK_SIZE),
-                camera->getReconstructionFilter());
+        /* Write the image in progress now and then */
+        Snapshotter snapshotter(result, camera->getReconstructionFilter(), outputName, options);
+
+        /* Create the block queues (i.e. the work scheduler) */
+        BlockQueues blockQueues(cropSize, options.blockSize, state.splitCount, state.queueCount, cropOffset);
+        state.blocksDone.resize(blockQueues.getBlockCount(), 0);
+
+        /* Blocks are merged under a shared lock, a checkpoint copies
+           the render state under an exclusive one */
+        tbb::spin_rw_mutex stateMutex;
+        std::atomic<double> checkpointDue(1000.0 * options.checkpointInterval);
+        std::atomic<bool> saving(false);
+        std::atomic<bool> firstBlockDone(false);
+        auto saveCheckpoint = [&]() {
+            profiler::Scope scope("Checkpoint::save");
+            Checkpoint checkpoint;
+            /* Critical section: copy the render state */ {
+                tbb::spin_rw_mutex::scoped_lock lock(stateMutex, true);
+                checkpoint = state;
+                std::ostringstream stream;
+                result.serialize(stream);
+                checkpoint.image = stream.str();
+            }
+            checkpoint.save(checkpointName);
+            checkpointDue = timer.elapsed() + 1000.0 * options.checkpointInterval;
+        };
 
-            /* Create a clone of the sampler for the current thread */
-            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+        /* Small images have fewer blocks than workers: hand out every block several
+           times, each time for another range of its samples. Samplers are indexed by
+           the sample index and merging adds up samples, so the image is the same */
+        int splitCount = 1;
+        if (options.sampleSplitting && !options.adaptive && !checkpointing && !options.resume &&
+            blockQueues.getBlockCount() < workerCount) {
+            /* A few work items per worker, to balance blocks of different cost */
+            int wanted = (4 * workerCount + blockQueues.getBlockCount() - 1) / blockQueues.getBlockCount();
+            splitCount = std::max(1, std::min(wanted, (int) passSampleCount));
+            if (splitCount > 1)
+                LOG("{} blocks for {} workers, rendering {} sample ranges per block.",
+                    blockQueues.getBlockCount(), workerCount, splitCount);
+        }
 
-            for (int i=range.begin(); i<range.end(); ++i) {
-                /* Request an image block from the block generator */
-                blockGenerator.next(block);
+        /* Total number of blocks to be handled, including multiple passes. */
+        size_t totalBlocks = (size_t) blockQueues.getBlockCount() * splitCount * passCount;
+        size_t blocksDone = (size_t) blockQueues.getBlockCount() * splitCount * state.pass +
+            std::count(state.blocksDone.begin(), state.blocksDone.end(), 1);
+        uint32_t samplesDone = firstSample + state.pass * passSampleCount;
+
+        /* Adaptive sampling: the samples that converged pixels did not take go to the
+           noisy ones, in extra passes past the sample count. This needs a sampler that
+           can extend its sequence, and nothing that relies on a fixed sample count */
+        bool redistribute = options.adaptive && scene->getSampler()->isUnbounded() &&
+            options.sampleRangeEnd == 0 && !checkpointing && !options.resume;
+        size_t sampleBudget = (size_t) (sampleCount - firstSample) * cropSize.prod();
+        uint32_t extraPassSampleCount = std::max(1u, std::min(passSampleCount, options.adaptiveMinSampleCount));
+        size_t extraSamplesBefore = 0;
+
+        for (uint32_t pass=state.pass; ; ++pass) {
+            /* Every pass adds samples [sampleBegin, sampleEnd) to all pixels */
+            uint32_t sampleBegin = firstSample + pass * passSampleCount;
+            uint32_t sampleEnd = std::min(sampleBegin + passSampleCount, sampleCount);
+            if (pass >= passCount) {
+                /* Extra pass: stop once the budget is spent or no pixel took samples */
+                if (!redistribute)
+                    break;
+                uint32_t extraPass = pass - passCount;
+                sampleBegin = sampleCount + extraPass * extraPassSampleCount;
+                sampleEnd = std::min(sampleBegin + extraPassSampleCount, AdaptiveMaxSampleFactor * sampleCount);
+                size_t taken = samplesTaken(result, cropOffset, cropSize);
+                if (sampleBegin >= sampleEnd || taken >= sampleBudget || (extraPass > 0 && taken == extraSamplesBefore))
+                    break;
+                extraSamplesBefore = taken;
+            }
 
-                /* Inform the sampler about the block to be rendered */
-                sampler->prepare(block);
+            blockQueues.reset(splitCount);
+            std::atomic<bool> aborted(false);
+
+            /* Worker loop, pulling blocks until none are left */
+            auto map = [&](int queue) {
+                /* Allocate memory for a small image block to be rendered by the current thread */
+                ImageBlock block(Vector2i(options.blockSize),
+                    camera->getReconstructionFilter(), options.adaptive, options.costAOV);
+
+                /* Create a clone of the sampler for the current thread */
+                std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+
+                while (true) {
+                    /* Out of budget: skip the remaining blocks of this pass. The first
+                       pass always completes so that every pixel receives samples,
+                       unless the finished blocks are kept in a checkpoint */
+                    if (expired() && (pass > 0 || checkpointing)) {
+                        aborted = true;
+                        break;
+                    }
+
+                    /* Request an image block, preferably from the queue of this arena */
+                    int index, split;
+                    if (!blockQueues.next(block, queue, &index, &split))
+                        break;
+
+                    /* Already merged before the checkpoint was taken */
+                    if (splitCount == 1 && state.blocksDone[index])
+                        continue;
+
+                    /* Inform the sampler about the block to be rendered */
+                    sampler->prepare(block);
+
+                    /* Render all contained blocks, or one range of their samples */
+                    uint32_t sampleCount = sampleEnd - sampleBegin;
+                    renderBlock(scene, sampler.get(), block,
+                        sampleBegin + sampleCount * split / splitCount,
+                        sampleBegin + sampleCount * (split + 1) / splitCount, options, &result);
+
+                    /* The image block has been processed. Now add it to
+                       the "big" block that represents the entire image */ {
+                        profiler::Scope scope("ImageBlock::put");
+                        tbb::spin_rw_mutex::scoped_lock lock;
+                        if (checkpointing)
+                            lock.acquire(stateMutex, false);
+
+                        if (options.accumulation == RenderOptions::EPerThread) {
+                            bool exists;
+                            ImageBlock &buffer = buffers.local(exists);
+                            if (!exists) {
+                                buffer.setOffset(cropOffset);
+                                buffer.clear();
+                            }
+                            buffer.put(block);
+                        } else {
+                            result.put(block);
+                            /* Per-thread buffers only reach the result at the end of a pass */
+                            state.blocksDone[index] = 1;
+                        }
+                    }
+
+                    if (observer && options.accumulation != RenderOptions::EPerThread)
+                        observer->blockDone(result, block.getOffset(), block.getSize());
+
+                    if (!firstBlockDone.load(std::memory_order_relaxed) && !firstBlockDone.exchange(true))
+                        summary.firstBlockSeconds = timer.elapsed() / 1000.0;
+
+                    /* Periodic checkpoint, written by the first worker to notice */
+                    if (checkpointing && timer.elapsed() >= checkpointDue && !saving.exchange(true)) {
+                        saveCheckpoint();
+                        saving = false;
+                    }
+
+                    /* Critical section: update progress bar */ {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        blocksDone++;
+                        progress.update(std::min(1.f, blocksDone / (float)totalBlocks));
+                        snapshotter.blockDone(blocksDone);
+                    }
+                }
+            };
+
+            /// Default: parallel rendering, one task per worker of every arena
+            std::vector<tbb::task_group> groups(arenas.size());
+            for (size_t i=0; i<arenas.size(); ++i) {
+                arenas[i]->execute([&, i] {
+                    groups[i].run([&, i] {
+                        tbb::parallel_for(tbb::blocked_range<int>(0, arenaWorkers[i], 1),
+                            [&, i](const tbb::blocked_range<int> &) { map((int) i); },
+                            tbb::simple_partitioner());
+                    });
+                });
+            }
+            for (size_t i=0; i<arenas.size(); ++i)
+                arenas[i]->execute([&, i] { groups[i].wait(); });
+
+            /// (equivalent to the following single-threaded call)
+            // map(0);
+
+            /* Sum up the per-thread frame buffers row by row, so that the next
+               pass (and adaptive sampling) sees all samples of this one. The
+               lock keeps snapshots from copying a half-summed frame buffer.
+               The blocks of an aborted pass are not marked as done in the
+               checkpoint and are rendered again on resume, so they are dropped */
+            if (options.accumulation == RenderOptions::EPerThread) {
+                if (!(aborted && checkpointing)) {
+                    profiler::Scope scope("ImageBlock::addRows");
+                    std::lock_guard<ImageBlock> lock(result);
+                    tbb::parallel_for(tbb::blocked_range<int>(0, (int) result.rows()),
+                        [&](const tbb::blocked_range<int> &rows) {
+                            for (const ImageBlock &buffer : buffers)
+                                result.addRows(buffer, rows.begin(), rows.end());
+                        });
+                    if (observer)
+                        observer->blockDone(result, cropOffset, cropSize);
+                }
+                for (ImageBlock &buffer : buffers)
+                    buffer.clear();
+            }
 
-                /* Render all contained blocks */
-                renderBlock(scene, sampler.get(), block);
+            if (aborted)
+                break;
+            samplesDone = std::min(sampleEnd, sampleCount);
 
-                /* The image block has been processed. Now add it to
-                   the "big" block that represents the entire image */
-                result.put(block);
+            /* The pass is complete, the next one starts without finished blocks */
+            state.pass = pass + 1;
+            std::fill(state.blocksDone.begin(), state.blocksDone.end(), 0);
+            if (checkpointing && state.pass < passCount && timer.elapsed() >= checkpointDue)
+                saveCheckpoint();
 
-                /* Critical section: update progress bar */ {
-                    std::lock_guard<std::mutex> lock(mutex);
-                    blocksDone++;
-                    progress.update(blocksDone / (float)totalBlocks);
-                }
-            }
-        };
+            /* Finished passes are kept, even if the budget ends here */
+            if (expired())
+                break;
+        }
 
-        /// Default: parallel rendering
-        tbb::parallel_for(range, map);
+        if (samplesDone < sampleCount)
+            LOG("Render stopped early after {}/{} spp.", samplesDone, sampleCount);
 
-        /// (equivalent to the following single-threaded call)
-        // map(range);
+        /* Keep the progress of an unfinished render, drop the checkpoint of a finished one */
+        if (checkpointing && samplesDone < sampleCount) {
+            saveCheckpoint();
+            LOG("Checkpoint saved to {}, continue with --resume.", checkpointName);
+        } else if ((checkpointing || options.resume) && samplesDone == sampleCount) {
+            std::remove(checkpointName.c_str());
+        }
 
+        if (options.adaptive)
+            LOG("Adaptive sampling: {:.1f} spp on average.",
+                samplesTaken(result, cropOffset, cropSize) / (double) cropSize.prod());
         LOG("Render ready.  (took {})", timer.elapsedString());
+        summary.seconds = timer.elapsed() / 1000.0;
+        summary.sampleCount = samplesDone - firstSample;
+        if (!outputName.empty())
+            stats::report(outputName, summary.seconds);
     });
 
     /* Shut down the user interface */
     render_thread.join();
 
-    /* Now turn the rendered image block into
-       a properly normalized bitmap */
-    std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+    if (observer)
+        observer->renderDone(result);
+    if (outputName.empty())
+        return summary;
 
-    /* Determine the filename of the output bitmap */
-    std::string outputName = filename;
-    size_t lastdot = outputName.find_last_of(".");
-    if (lastdot != std::string::npos)
-        outputName.erase(lastdot, std::string::npos);
+    /* Partial render: keep the unnormalized sums, kazen_merge combines them */
+    if (options.partial) {
+        result.saveAccumulation(outputName + ".exr", outputSize);
+        return summary;
+    }
 
-    /* Save using the OpenEXR format */
-    // bitmap->saveEXR(outputName);
+    /* Now turn the rendered image block into
+       a properly normalized bitmap */
+    std::shared_ptr<Bitmap> bitmap(result.toBitmap());
+
+    /* Save the OpenEXR and the tonemapped (sRGB) PNG output in the
+       background, the caller may go on with the next job meanwhile */
+    std::vector<BitmapChannel> channels;
+    if (options.costAOV)
+        channels = result.getCostChannels();
+    output::saveAsync(bitmap, outputName, options.exrFormat != RenderOptions::ENoEXR || options.costAOV,
+                      options.exrFormat == RenderOptions::EHalfEXR, std::move(channels));
+    return summary;
+}
 
-    /* Save tonemapped (sRGB) output using the PNG format */
-    bitmap->savePNG(outputName);
+std::vector<RenderSummary> renderBatch(Scene *scene, const std::vector<BatchJob> &jobs, const RenderOptions &options) {
+    std::vector<RenderSummary> summaries;
+    Camera *active = scene->getCamera();
+    std::vector<std::pair<Camera *, Transform>> placements;
+    for (Camera *camera : scene->getCameras())
+        placements.emplace_back(camera, camera->getCameraToWorld());
+
+    /* Put the cameras back where the scene had them, also on errors */
+    auto restore = [&]() {
+        for (auto &placement : placements)
+            placement.first->setCameraToWorld(placement.second);
+        scene->setCamera(active);
+    };
+
+    try {
+        for (size_t i=0; i<jobs.size() && !stopRequested; ++i) {
+            const BatchJob &job = jobs[i];
+            LOG("Batch job {}/{}: {}", i + 1, jobs.size(), job.filename);
+            scene->setCamera(job.camera);
+            job.camera->setCameraToWorld(job.cameraToWorld);
+            summaries.push_back(render(scene, job.filename, options));
+        }
+    } catch (...) {
+        restore();
+        throw;
+    }
+    restore();
+    return summaries;
 }
 
 NAMESPACE_END(renderer)
@@ -19,6 +19,7 @@ class Independent : public Sampler {
 public:
     Independent(const PropertyList &propList) {
         m_sampleCount = (uint32_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint64_t) propList.getInteger("seed", 1);
     }
 
     virtual ~Independent() { }
@@ -26,11 +27,12 @@ public:
     std::unique_ptr<Sampler> clone() const {
         std::unique_ptr<Independent> cloned(new Independent());
         cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
         cloned->m_random = m_random;
         return cloned;
     }
 
-    void prepare( const ImageBlock &block) {
+    void prepare( const ImageBlock &) {
         // m_random.seed(
         //     block.getOffset().x(),
         //     block.getOffset().y()
@@ -60,8 +62,11 @@ public:
         return next2D();
     }
 
+    /* Every sample index has its own random stream */
+    bool isUnbounded() const { return true; }
+
     std::string toString() const {
-        return fmt::format("Independent[sampleCount={}]", m_sampleCount);
+        return fmt::format("Independent[sampleCount={}, seed={}]", m_sampleCount, m_seed);
     }
 protected:
     Independent() { }
@@ -104,7 +109,7 @@ public:
     }
 
     /* No-op for this sampler */
-    void prepare( const ImageBlock &block) {}
+    void prepare( const ImageBlock &) {}
     void generate() {}
     void advance() {}
 
@@ -143,7 +148,7 @@ public:
     }
 
     std::string toString() const {
-        return fmt::format("Stratified");
+        return fmt::format("Stratified[sampleCount={}, seed={}]", m_sampleCount, m_seed);
     }
 
 protected:
@@ -200,7 +205,7 @@ public:
     }
 
     /* No-op for this sampler */
-    void prepare( const ImageBlock &block) {}
+    void prepare( const ImageBlock &) {}
     void generate() {}
     void advance() {}
 
@@ -255,7 +260,7 @@ public:
     }
 
     std::string toString() const {
-        return fmt::format("Correlated");
+        return fmt::format("Correlated[sampleCount={}, seed={}]", m_sampleCount, m_seed);
     }
 
 protected:
@@ -298,7 +303,7 @@ public:
             Point2f p = getPMJ02BNSample(0, i);
             p *= m_pixelTileSize;
             int pixelOffset = int(p.x()) + int(p.y()) * m_pixelTileSize;
-            if (nStored[pixelOffset] == m_sampleCount) {
+            if (nStored[pixelOffset] == (int) m_sampleCount) {
                 assert(!math::isPowerOf4(m_sampleCount));
                 continue;
             }
@@ -309,9 +314,9 @@ public:
         }  
 
         for (size_t i = 0; i < nStored.size(); ++i)
-            assert(nStored[i] == m_sampleCount);
+            assert(nStored[i] == (int) m_sampleCount);
         for ( int c : nStored)
-            assert(c == m_sampleCount);
+            assert(c == (int) m_sampleCount);
     }
 
     ~PMJ02BN() { }
@@ -326,7 +331,7 @@ public:
     }
 
     /* No-op for this sampler */
-    void prepare( const ImageBlock &block) {}
+    void prepare( const ImageBlock &) {}
     void generate() {}
     void advance() {}
 
@@ -377,7 +382,7 @@ public:
     }
 
     std::string toString() const {
-        return fmt::format("PMJ02BN");
+        return fmt::format("PMJ02BN[sampleCount={}, seed={}]", m_sampleCount, m_seed);
     }
 
 protected:
@@ -13,20 +13,38 @@
 
 NAMESPACE_BEGIN(kazen)
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
+Scene::Scene(const PropertyList &propList) : m_propList(propList) {
+    AccelOptions options(propList);
+    options.configure(AccelOptions::getOverrides());
+    m_accel = new Accel(options);
 }
 
 Scene::~Scene() {
     OIIO::TextureSystem::destroy(getTextureSystem());
 
     delete m_accel;
+    for (Instance *instance : m_instances)
+        delete instance;
+    for (ShapeGroup *group : m_shapeGroups)
+        delete group;
     delete m_sampler;
-    delete m_camera;
+    for (Camera *camera : m_cameras)
+        delete camera;
     delete m_integrator;
 }
 
 void Scene::activate() {
+    /* Resolve the shape groups referenced by instances */
+    for (Instance *instance : m_instances) {
+        auto it = std::find_if(m_shapeGroups.begin(), m_shapeGroups.end(), [&](const ShapeGroup *group) {
+            return group->getId() == instance->getShapeGroupId();
+        });
+        if (it == m_shapeGroups.end())
+            throw Exception("Instance of an unknown shape group \"{}\"!", instance->getShapeGroupId());
+        instance->setShapeGroup(*it);
+        m_accel->addInstance(instance);
+    }
+
     m_accel->build();
 
     if (!m_integrator)
@@ -51,6 +69,12 @@ void Scene::activate() {
     // cout << endl;
 }
 
+void Scene::setCamera(Camera *camera) {
+    if (std::find(m_cameras.begin(), m_cameras.end(), camera) == m_cameras.end())
+        throw Exception("Scene::setCamera(): the camera does not belong to the scene!");
+    m_camera = camera;
+}
+
 const Color3f Scene::getBackgroundColor(const Vector3f &dir) const {
     if (!m_background)
         return Color3f(0.f);
@@ -87,6 +111,20 @@ void Scene::addChild(Object *obj) {
             }
             break;
         
+        case EShapeGroup: {
+                ShapeGroup *group = static_cast<ShapeGroup *>(obj);
+                for (const ShapeGroup *other : m_shapeGroups) {
+                    if (other->getId() == group->getId())
+                        throw Exception("There is already a shape group \"{}\"!", group->getId());
+                }
+                m_shapeGroups.push_back(group);
+            }
+            break;
+
+        case EInstance:
+            m_instances.push_back(static_cast<Instance *>(obj));
+            break;
+
         case ELight: {
                 //Lights *light = static_cast<Lights *>(obj);
                 /* TBD */
@@ -101,9 +139,10 @@ void Scene::addChild(Object *obj) {
             break;
 
         case ECamera:
-            if (m_camera)
-                throw Exception("There can only be one camera per scene!");
-            m_camera = static_cast<Camera *>(obj);
+            /* Further cameras are only used by batch renders */
+            m_cameras.push_back(static_cast<Camera *>(obj));
+            if (!m_camera)
+                m_camera = m_cameras.back();
             break;
         
         case EIntegrator:
@@ -0,0 +1,479 @@
+#include <kazen/common.h>
+#include <kazen/scene.h>
+#include <kazen/camera.h>
+#include <kazen/parser.h>
+#include <kazen/renderer.h>
+#include <kazen/output.h>
+#include <kazen/stats.h>
+#include <kazen/threading.h>
+#include <filesystem/resolver.h>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace kazen;
+
+/*
+ * End-to-end benchmark over a set of scenes
+ *
+ * Every scene is loaded and rendered at a fixed sample count and resolution in
+ * a child process of its own, so that peak memory and the time to load belong
+ * to that scene alone. The results are written as JSON and can be compared
+ * against a baseline from an earlier run. Being built on fork() and wait4(),
+ * the tool is POSIX only and is not built on Windows.
+ */
+
+/// Measurements of one scene
+struct SceneResult {
+    std::string scene;
+    bool ok = false;
+    double wallSeconds = 0.0;        // load, render and save, as seen by the parent
+    double renderSeconds = 0.0;      // the render loop alone
+    double firstPixelSeconds = 0.0;  // render start to the first block in the frame buffer
+    double samplesPerSecond = 0.0;
+    double raysPerSecond = 0.0;
+    double peakRssMB = 0.0;
+    double accelSeconds = 0.0;       // BVH build
+    double accelMB = 0.0;            // memory embree holds after the build
+    uint32_t spp = 0;                // samples per pixel rendered, fewer than requested if the sampler has fewer
+
+    /// Metrics by name, in the order they are reported
+    std::vector<std::pair<std::string, double>> metrics() const {
+        return {{"wallSeconds", wallSeconds}, {"renderSeconds", renderSeconds},
+                {"firstPixelSeconds", firstPixelSeconds}, {"samplesPerSecond", samplesPerSecond},
+                {"raysPerSecond", raysPerSecond}, {"peakRssMB", peakRssMB},
+                {"accelSeconds", accelSeconds}, {"accelMB", accelMB}};
+    }
+};
+
+/// Does a larger value of the metric mean better performance?
+static bool higherIsBetter(const std::string &metric) {
+    return metric == "samplesPerSecond" || metric == "raysPerSecond";
+}
+
+struct BenchOptions {
+    uint32_t spp = 16;
+    Vector2i resolution = Vector2i(480, 270);
+    int threads = 0;
+    std::string outputDir = "scenebench";
+
+    /// Render options that override the scene's, by property name (e.g. pixelOrder: morton)
+    std::map<std::string, std::string> renderOptions;
+};
+
+/* The overridden render options as properties of the scene */
+static PropertyList renderOverrides(const BenchOptions &bench) {
+    PropertyList propList;
+    for (auto &option : bench.renderOptions) {
+        if (option.first == "blockSize")
+            propList.setInteger(option.first, string::toInt(option.second));
+        else
+            propList.setString(option.first, option.second);
+    }
+    return propList;
+}
+
+/* Name of the output files of a scene: its file name without extension */
+static std::string sceneStem(const std::string &scene) {
+    std::string name = filesystem::path(scene).filename();
+    size_t lastdot = name.find_last_of(".");
+    return lastdot == std::string::npos ? name : name.substr(0, lastdot);
+}
+
+/* Body of the child process: render the scene and write the timings to \c fd */
+static int renderChild(const std::string &scene, const BenchOptions &bench, int fd) {
+    try {
+        threading::configure(bench.threads, false);
+        getFileResolver()->prepend(filesystem::path(scene).parent_path());
+
+        std::unique_ptr<Object> root(loadFromXML(scene));
+        if (root->getClassType() != Object::EScene)
+            throw Exception("\"{}\" does not describe a scene", scene);
+        Scene *sceneObject = static_cast<Scene *>(root.get());
+        sceneObject->getCamera()->setOutputSize(bench.resolution);
+
+        /* Keep the render settings of the scene, but always render the full frame once */
+        renderer::RenderOptions options(sceneObject->getPropertyList());
+        options.configure(renderOverrides(bench));
+        options.progressive = false;
+        options.targetSampleCount = bench.spp;
+        options.timeLimit = 0.f;
+        options.checkpointInterval = 0.f;
+        options.resume = false;
+        options.cropSize = Vector2i(0, 0);
+        options.sampleRangeBegin = options.sampleRangeEnd = 0;
+        options.partial = false;
+
+        renderer::RenderSummary summary = renderer::render(sceneObject,
+            bench.outputDir + "/" + sceneStem(scene), options);
+        if (!output::wait())
+            return 1;
+
+        stats::Counters counters = stats::collect();
+        uint64_t rays = counters.counters[stats::EIntersectRays] + counters.counters[stats::EShadowRays];
+        const Accel *accel = sceneObject->getAccel();
+        std::string line = fmt::format("{} {} {} {} {} {} {}\n", summary.seconds, summary.firstBlockSeconds,
+                                       counters.counters[stats::ECameraRays], rays,
+                                       accel->getBuildTime() / 1000.0, accel->getMemoryUsage() / (1024.0 * 1024.0),
+                                       summary.sampleCount);
+        return write(fd, line.data(), line.size()) == (ssize_t) line.size() ? 0 : 1;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return 1;
+    }
+}
+
+/* Render \c scene in a child process and collect its measurements */
+static SceneResult runScene(const std::string &scene, const BenchOptions &bench) {
+    SceneResult result;
+    result.scene = scene;
+
+    int fds[2];
+    if (pipe(fds) != 0)
+        throw Exception("Unable to create a pipe");
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+        throw Exception("Unable to fork");
+
+    if (pid == 0) {
+        /* The log of the render goes to a file next to the image */
+        close(fds[0]);
+        std::string logName = bench.outputDir + "/" + sceneStem(scene) + ".log";
+        int log = open(logName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0) {
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+        }
+        int status = renderChild(scene, bench, fds[1]);
+        std::cout.flush();
+        _exit(status);
+    }
+
+    close(fds[1]);
+    std::string output;
+    char buffer[256];
+    ssize_t count;
+    while ((count = read(fds[0], buffer, sizeof(buffer))) > 0)
+        output.append(buffer, count);
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.peakRssMB = usage.ru_maxrss / 1024.0; /* kilobytes on Linux */
+
+    double samples = 0.0, rays = 0.0;
+    std::istringstream is(output);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+        (is >> result.renderSeconds >> result.firstPixelSeconds >> samples >> rays
+            >> result.accelSeconds >> result.accelMB >> result.spp)) {
+        result.ok = true;
+        if (result.renderSeconds > 0.0) {
+            result.samplesPerSecond = samples / result.renderSeconds;
+            result.raysPerSecond = rays / result.renderSeconds;
+        }
+    }
+    return result;
+}
+
+static std::string toJSON(const std::vector<SceneResult> &results, const BenchOptions &bench) {
+    std::string json = "{\n";
+    json += fmt::format("  \"spp\": {},\n", bench.spp);
+    json += fmt::format("  \"resolution\": [{}, {}],\n", bench.resolution.x(), bench.resolution.y());
+    json += "  \"renderOptions\": {";
+    for (auto it = bench.renderOptions.begin(); it != bench.renderOptions.end(); ++it)
+        json += fmt::format("{}\"{}\": \"{}\"", it == bench.renderOptions.begin() ? "" : ", ", it->first, it->second);
+    json += "},\n";
+    json += "  \"scenes\": {";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const SceneResult &result = results[i];
+        json += fmt::format("{}\n    \"{}\": {{", i > 0 ? "," : "", result.scene);
+        json += fmt::format("\"ok\": {}, \"spp\": {}", result.ok ? "true" : "false", result.spp);
+        for (auto &metric : result.metrics())
+            json += fmt::format(", \"{}\": {:.6g}", metric.first, metric.second);
+        json += "}";
+    }
+    json += "\n  }\n}\n";
+    return json;
+}
+
+/*
+ * Minimal reader for the JSON written above: objects, arrays, strings,
+ * numbers and literals. Numbers and strings are kept by the dotted path of
+ * their key (e.g. "scenes.<scene>.wallSeconds"), which is all a comparison
+ * needs.
+ */
+class JSONReader {
+public:
+    JSONReader(const std::string &text) : m_text(text) { }
+
+    std::map<std::string, double> read() {
+        value("");
+        skipSpace();
+        if (m_pos != m_text.size())
+            fail("trailing characters");
+        return m_numbers;
+    }
+
+    /// The strings of the last read(), by path
+    const std::map<std::string, std::string> &strings() const { return m_strings; }
+
+private:
+    void fail(const char *what) {
+        throw Exception("JSON error at offset {}: {}", m_pos, what);
+    }
+
+    void skipSpace() {
+        while (m_pos < m_text.size() && std::isspace((unsigned char) m_text[m_pos]))
+            ++m_pos;
+    }
+
+    bool accept(char c) {
+        skipSpace();
+        if (m_pos < m_text.size() && m_text[m_pos] == c) {
+            ++m_pos;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!accept(c))
+            fail(fmt::format("expected '{}'", c).c_str());
+    }
+
+    std::string string() {
+        expect('"');
+        std::string result;
+        while (m_pos < m_text.size() && m_text[m_pos] != '"') {
+            if (m_text[m_pos] == '\\' && m_pos + 1 < m_text.size())
+                ++m_pos;
+            result += m_text[m_pos++];
+        }
+        expect('"');
+        return result;
+    }
+
+    void value(const std::string &path) {
+        skipSpace();
+        if (m_pos >= m_text.size())
+            fail("unexpected end");
+        char c = m_text[m_pos];
+        if (c == '{') {
+            ++m_pos;
+            if (accept('}'))
+                return;
+            do {
+                std::string key = string();
+                expect(':');
+                value(path.empty() ? key : path + "." + key);
+            } while (accept(','));
+            expect('}');
+        } else if (c == '[') {
+            ++m_pos;
+            if (accept(']'))
+                return;
+            int index = 0;
+            do {
+                value(path + "." + std::to_string(index++));
+            } while (accept(','));
+            expect(']');
+        } else if (c == '"') {
+            m_strings[path] = string();
+        } else if (std::isalpha((unsigned char) c)) {
+            size_t begin = m_pos;
+            while (m_pos < m_text.size() && std::isalpha((unsigned char) m_text[m_pos]))
+                ++m_pos;
+            std::string literal = m_text.substr(begin, m_pos - begin);
+            if (literal == "true" || literal == "false")
+                m_numbers[path] = literal == "true" ? 1.0 : 0.0;
+            else if (literal != "null")
+                fail("unknown literal");
+        } else {
+            char *end = nullptr;
+            double number = std::strtod(m_text.c_str() + m_pos, &end);
+            if (end == m_text.c_str() + m_pos)
+                fail("expected a value");
+            m_pos = end - m_text.c_str();
+            m_numbers[path] = number;
+        }
+    }
+
+    const std::string &m_text;
+    size_t m_pos = 0;
+    std::map<std::string, double> m_numbers;
+    std::map<std::string, std::string> m_strings;
+};
+
+/*
+ * Compare against a baseline, return the number of regressions. The default
+ * relative tolerance can be overridden per metric by a "tolerances" object
+ * in the baseline, e.g. "tolerances": {"firstPixelSeconds": 0.5}
+ */
+static int compare(const std::vector<SceneResult> &results, const BenchOptions &bench,
+                   const std::string &baselineName, double tolerance) {
+    std::ifstream is(baselineName);
+    if (is.fail())
+        throw Exception("Unable to open the baseline \"{}\"", baselineName);
+    std::stringstream text;
+    text << is.rdbuf();
+    std::string json = text.str();
+    JSONReader reader(json);
+    std::map<std::string, double> baseline = reader.read();
+
+    if (baseline["spp"] != bench.spp || baseline["resolution.0"] != bench.resolution.x() ||
+        baseline["resolution.1"] != bench.resolution.y())
+        throw Exception("The baseline was recorded at {} spp and {}x{}, not at {} spp and {}x{}",
+            baseline["spp"], baseline["resolution.0"], baseline["resolution.1"],
+            bench.spp, bench.resolution.x(), bench.resolution.y());
+
+    /* Both runs have to override the same render options with the same values */
+    std::map<std::string, std::string> baselineOptions;
+    for (auto &entry : reader.strings())
+        if (entry.first.compare(0, 14, "renderOptions.") == 0)
+            baselineOptions[entry.first.substr(14)] = entry.second;
+    if (baselineOptions != bench.renderOptions)
+        throw Exception("The baseline was recorded with other render options than this run");
+
+    int regressions = 0;
+    LOG("Comparison with {}:", baselineName);
+    for (const SceneResult &result : results) {
+        if (!result.ok)
+            continue;
+
+        /* Timings at another sample count say nothing about a regression */
+        auto spp = baseline.find("scenes." + result.scene + ".spp");
+        if (spp != baseline.end() && spp->second != result.spp) {
+            LOG("  SKIPPED {}: rendered at {} spp, the baseline at {:.0f} spp", result.scene, result.spp, spp->second);
+            continue;
+        }
+        for (auto &metric : result.metrics()) {
+            auto it = baseline.find("scenes." + result.scene + "." + metric.first);
+            if (it == baseline.end() || it->second <= 0.0)
+                continue;
+
+            auto tol = baseline.find("tolerances." + metric.first);
+            double allowed = tol != baseline.end() ? tol->second : tolerance;
+            double change = metric.second / it->second - 1.0;
+            bool regressed = higherIsBetter(metric.first) ? change < -allowed : change > allowed;
+            if (regressed) {
+                LOG("  REGRESSION {} {}: {:.4g} -> {:.4g} ({:+.1f}%, allowed {:.1f}%)", result.scene,
+                    metric.first, it->second, metric.second, 100.0 * change, 100.0 * allowed);
+                ++regressions;
+            }
+        }
+    }
+    LOG("  {} regression(s).", regressions);
+    return regressions;
+}
+
+static void printUsage(const char *name) {
+    cout << "Syntax: " << name << " [options] <scene.xml> [<scene.xml> ...]\n"
+            "Options:\n"
+            "  --spp <n>               Samples per pixel, at most the sampler's (default: 16)\n"
+            "  --resolution <w> <h>    Image size (default: 480 270)\n"
+            "  --threads <n>           Number of worker threads (default: all cores)\n"
+            "  --pixel-order <name>    Pixel order inside a block: scanline, morton or hilbert\n"
+            "  --block-size <n>        Edge length of the blocks rendered by each thread\n"
+            "  --accumulation <name>   Frame buffer merging: locked, striped or perthread\n"
+            "  --output-dir <dir>      Images, logs and results.json (default: scenebench)\n"
+            "  --baseline <file>       Compare with the results of an earlier run\n"
+            "  --tolerance <t>         Allowed relative change per metric (default: 0.1)\n"
+            "  --save-baseline <file>  Also write the results to <file>\n"
+            "The 2022_q1 suite: scene/2022_q1/WarmStudio/WarmStudio.xml scene/2022_q1/parameters/*.xml\n"
+            "Render options not given keep the scene's values. Every scene renders in a child\n"
+            "process, so hardware counters can be taken per run, e.g. the L2 misses of a\n"
+            "pixel order with: perf stat -e l2_rqsts.miss " << name << " --pixel-order morton ..." << endl;
+}
+
+int main(int argc, char **argv) {
+    BenchOptions bench;
+    std::vector<std::string> scenes;
+    std::string baselineName, saveBaselineName;
+    double tolerance = 0.1;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc)
+                    throw Exception("Missing value for option \"{}\"", arg);
+                return argv[++i];
+            };
+
+            if (arg == "-h" || arg == "--help") {
+                printUsage(argv[0]);
+                return 0;
+            } else if (arg == "--spp") {
+                bench.spp = string::toInt(value());
+            } else if (arg == "--resolution") {
+                bench.resolution.x() = string::toInt(value());
+                bench.resolution.y() = string::toInt(value());
+            } else if (arg == "--threads") {
+                bench.threads = string::toInt(value());
+            } else if (arg == "--pixel-order") {
+                bench.renderOptions["pixelOrder"] = value();
+            } else if (arg == "--block-size") {
+                bench.renderOptions["blockSize"] = value();
+            } else if (arg == "--accumulation") {
+                bench.renderOptions["accumulation"] = value();
+            } else if (arg == "--output-dir") {
+                bench.outputDir = value();
+            } else if (arg == "--baseline") {
+                baselineName = value();
+            } else if (arg == "--tolerance") {
+                tolerance = string::toFloat(value());
+            } else if (arg == "--save-baseline") {
+                saveBaselineName = value();
+            } else {
+                scenes.push_back(arg);
+            }
+        }
+        if (scenes.empty()) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        renderer::RenderOptions().configure(renderOverrides(bench)); /* reject unknown names early */
+        mkdir(bench.outputDir.c_str(), 0755);
+
+        std::vector<SceneResult> results;
+        int failures = 0;
+        for (const std::string &scene : scenes) {
+            SceneResult result = runScene(scene, bench);
+            if (result.ok) {
+                LOG("{}: {:.2f} s, first pixel {:.3f} s, {:.3g} samples/s, {:.3g} rays/s, {:.0f} MB, "
+                    "BVH {:.3f} s and {:.0f} MB",
+                    scene, result.wallSeconds, result.firstPixelSeconds, result.samplesPerSecond,
+                    result.raysPerSecond, result.peakRssMB, result.accelSeconds, result.accelMB);
+                /* render() stops at the sample count of the scene's sampler */
+                if (result.spp != bench.spp)
+                    LOG("{}: WARNING: rendered at {} spp instead of {}, the sampler of the scene has fewer samples",
+                        scene, result.spp, bench.spp);
+            } else {
+                LOG("{}: FAILED, see {}/{}.log", scene, bench.outputDir, sceneStem(scene));
+                ++failures;
+            }
+            results.push_back(result);
+        }
+
+        std::string json = toJSON(results, bench);
+        std::ofstream(bench.outputDir + "/results.json") << json;
+        if (!saveBaselineName.empty())
+            std::ofstream(saveBaselineName) << json;
+
+        int regressions = baselineName.empty() ? 0 : compare(results, bench, baselineName, tolerance);
+        return failures > 0 || regressions > 0 ? 1 : 0;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+}
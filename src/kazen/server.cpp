@@ -0,0 +1,412 @@
+#include <kazen/server.h>
+#include <kazen/scene.h>
+#include <kazen/camera.h>
+#include <kazen/block.h>
+#include <kazen/timer.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#if !defined(__WINDOWS__)
+#  include <netdb.h>
+#  include <netinet/in.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#endif
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(server)
+
+#if !defined(__WINDOWS__)
+
+/* Name of the image in tev */
+static const char *ImageName = "kazen";
+
+/* Milliseconds between two tile updates sent to tev */
+static const double UpdateInterval = 100.0;
+
+/*
+ * Client side of the tev IPC protocol. Every packet starts with its total
+ * size (uint32) and type (char), strings are null-terminated and numbers
+ * are in host byte order, since tev runs on the same machine.
+ */
+class TevClient {
+public:
+    TevClient(const std::string &address) {
+        std::string host = address, port = std::to_string(KAZEN_TEV_PORT);
+        size_t colon = address.find_last_of(':');
+        if (colon != std::string::npos) {
+            host = address.substr(0, colon);
+            port = address.substr(colon + 1);
+        }
+
+        struct addrinfo hints, *addresses = nullptr;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+            throw Exception("Unable to resolve the tev address \"{}\"", address);
+        for (struct addrinfo *a = addresses; a && m_socket < 0; a = a->ai_next) {
+            m_socket = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (m_socket >= 0 && connect(m_socket, a->ai_addr, a->ai_addrlen) != 0) {
+                close(m_socket);
+                m_socket = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (m_socket < 0)
+            throw Exception("Unable to connect to tev at \"{}\" (is it running?)", address);
+        LOG("Connected to tev at {}.", address);
+    }
+
+    ~TevClient() {
+        if (m_socket >= 0)
+            close(m_socket);
+    }
+
+    /// Create an RGB image, replacing the previous one
+    void createImage(const Vector2i &size) {
+        Packet packet(ECreateImage);
+        packet.put<char>(1); /* grab focus */
+        packet.put(ImageName);
+        packet.put<int32_t>(size.x());
+        packet.put<int32_t>(size.y());
+        packet.put<int32_t>(3);
+        for (const char *channel : { "R", "G", "B" })
+            packet.put(channel);
+        send(packet);
+    }
+
+    /// Replace a rectangle of one channel of the image
+    void updateImage(const char *channel, const Point2i &offset, const Vector2i &size, const std::vector<float> &values) {
+        Packet packet(EUpdateImage);
+        packet.put<char>(0);
+        packet.put(ImageName);
+        packet.put(channel);
+        packet.put<int32_t>(offset.x());
+        packet.put<int32_t>(offset.y());
+        packet.put<int32_t>(size.x());
+        packet.put<int32_t>(size.y());
+        packet.put(values.data(), values.size());
+        send(packet);
+    }
+
+private:
+    enum EPacketType : char {
+        EUpdateImage = 3,
+        ECreateImage = 4
+    };
+
+    class Packet {
+    public:
+        Packet(char type) : m_data(sizeof(uint32_t) + 1) { m_data.back() = type; }
+
+        template <typename T> void put(const T &value) { put((const char *) &value, sizeof(T)); }
+        void put(const char *str) { put(str, std::strlen(str) + 1); }
+        void put(const float *values, size_t count) { put((const char *) values, sizeof(float) * count); }
+        void put(const char *data, size_t size) { m_data.insert(m_data.end(), data, data + size); }
+
+        /// Fill in the size and return the encoded packet
+        const std::vector<char> &finish() {
+            uint32_t size = (uint32_t) m_data.size();
+            std::memcpy(m_data.data(), &size, sizeof(size));
+            return m_data;
+        }
+    private:
+        std::vector<char> m_data;
+    };
+
+    /* A viewer that went away is reported once, the render goes on without it */
+    void send(Packet &packet) {
+        if (m_socket < 0)
+            return;
+        const std::vector<char> &data = packet.finish();
+        for (size_t done = 0; done < data.size(); ) {
+            ssize_t count = ::send(m_socket, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (count <= 0) {
+                cerr << "Lost the connection to tev" << endl;
+                close(m_socket);
+                m_socket = -1;
+                return;
+            }
+            done += (size_t) count;
+        }
+    }
+
+    int m_socket = -1;
+};
+
+/*
+ * Streams the blocks of a render to tev. Finished regions are collected, and
+ * the first worker to notice that an update is due copies the frame buffer
+ * and sends them (like the periodic checkpoints of the renderer).
+ */
+class TevPreview : public renderer::RenderObserver {
+public:
+    TevPreview(TevClient &tev, const Vector2i &size, const ReconstructionFilter *filter)
+        : m_tev(tev), m_copy(size, filter) { }
+
+    void blockDone(const ImageBlock &result, const Point2i &offset, const Vector2i &size) override {
+        /* Critical section: remember the region */ {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_dirty.push_back({ offset, size });
+        }
+
+        if (m_timer.elapsed() >= m_updateDue && !m_sending.exchange(true)) {
+            send(result);
+            m_updateDue = m_timer.elapsed() + UpdateInterval;
+            m_sending = false;
+        }
+    }
+
+    void renderDone(const ImageBlock &result) override {
+        send(result);
+    }
+
+private:
+    struct Region {
+        Point2i offset;
+        Vector2i size;
+    };
+
+    void send(const ImageBlock &result) {
+        std::vector<Region> dirty;
+        /* Critical section: take the regions collected so far */ {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            dirty.swap(m_dirty);
+        }
+        if (dirty.empty())
+            return;
+
+        m_copy.setOffset(result.getOffset());
+        result.copyTo(m_copy);
+
+        /* Samples are splatted into the filter border around a block, too */
+        Point2i imageBegin = result.getOffset();
+        Point2i imageEnd = result.getOffset() + result.getSize();
+        Vector2i border = Vector2i::Constant(result.getBorderSize());
+        std::vector<float> channels[3];
+        for (const Region &region : dirty) {
+            Point2i begin = (region.offset - border).cwiseMax(imageBegin);
+            Point2i end = (region.offset + region.size + border).cwiseMin(imageEnd);
+            Vector2i size = end - begin;
+            if ((size.array() <= 0).any())
+                continue;
+
+            for (auto &channel : channels)
+                channel.resize((size_t) size.prod());
+            for (int y=0; y<size.y(); ++y) {
+                for (int x=0; x<size.x(); ++x) {
+                    Point2i p = begin + Vector2i(x, y) - imageBegin + border;
+                    Color3f value = m_copy.coeff(p.y(), p.x()).divideByFilterWeight();
+                    for (int c=0; c<3; ++c)
+                        channels[c][(size_t) y * size.x() + x] = value[c];
+                }
+            }
+            m_tev.updateImage("R", begin, size, channels[0]);
+            m_tev.updateImage("G", begin, size, channels[1]);
+            m_tev.updateImage("B", begin, size, channels[2]);
+        }
+    }
+
+    TevClient &m_tev;
+    ImageBlock m_copy;
+    std::mutex m_mutex;
+    std::vector<Region> m_dirty;
+    Timer m_timer;
+    std::atomic<double> m_updateDue { 0.0 };
+    std::atomic<bool> m_sending { false };
+};
+
+/*
+ * Commands arrive on the calling thread and are queued as changes to the
+ * scene. The render thread applies them between two renders, so the scene
+ * never changes while workers read it.
+ */
+class PreviewServer {
+public:
+    PreviewServer(Scene *scene, const renderer::RenderOptions &options, const std::string &tevAddress)
+        : m_scene(scene), m_options(options), m_tev(tevAddress) {
+        /* Progressive passes, so that a new command stops the render quickly */
+        m_options.progressive = true;
+        m_options.checkpointInterval = 0.f;
+        m_options.resume = false;
+        m_options.partial = false;
+        m_options.snapshotInterval = 0.f;
+        m_options.snapshotBlocks = 0;
+        m_options.cropSize = Vector2i(0, 0);
+    }
+
+    void serve(int port) {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0)
+            throw Exception("Unable to create a socket");
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        /* Only local clients may control the renderer */
+        struct sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((uint16_t) port);
+        if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+            close(listener);
+            throw Exception("Unable to listen on port {}", port);
+        }
+        LOG("Preview server listening on 127.0.0.1:{}", port);
+
+        /* Render the scene as it was loaded until the first command arrives */
+        m_restart = true;
+        std::thread renderThread([this] { renderLoop(); });
+
+        while (!m_quit) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0)
+                continue;
+            handleClient(client);
+            close(client);
+        }
+        close(listener);
+        renderThread.join();
+    }
+
+private:
+    void renderLoop() {
+        while (true) {
+            std::vector<std::function<void()>> changes;
+            /* Critical section: wait for work. Stop requests from here on belong to later commands */ {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [this] { return m_restart || m_quit; });
+                if (m_quit)
+                    break;
+                m_restart = false;
+                changes.swap(m_changes);
+                renderer::clearStop();
+            }
+
+            try {
+                for (auto &change : changes)
+                    change();
+                Camera *camera = m_scene->getCamera();
+                m_tev.createImage(camera->getOutputSize());
+                TevPreview preview(m_tev, camera->getOutputSize(), camera->getReconstructionFilter());
+                renderer::render(m_scene, "", m_options, &preview);
+            } catch (const std::exception &e) {
+                cerr << "Preview render failed: " << e.what() << endl;
+            }
+        }
+    }
+
+    /* Answer the commands of one client, line by line */
+    void handleClient(int client) {
+        std::string buffer;
+        char data[1024];
+        ssize_t count;
+        while (!m_quit && (count = recv(client, data, sizeof(data), 0)) > 0) {
+            buffer.append(data, (size_t) count);
+            size_t newline;
+            while (!m_quit && (newline = buffer.find('\n')) != std::string::npos) {
+                std::string line = buffer.substr(0, newline);
+                buffer.erase(0, newline + 1);
+
+                std::string reply = "ok\n";
+                try {
+                    execute(line);
+                } catch (const std::exception &e) {
+                    reply = fmt::format("error: {}\n", e.what());
+                }
+                ::send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+            }
+        }
+    }
+
+    void execute(const std::string &line) {
+        std::istringstream is(line);
+        std::string command;
+        if (!(is >> command))
+            throw Exception("Empty command");
+
+        std::function<void()> change;
+        if (command == "lookat") {
+            float v[9];
+            for (float &value : v)
+                if (!(is >> value))
+                    throw Exception("lookat expects origin, target and up (9 numbers)");
+            Transform cameraToWorld = Transform::lookAt(Vector3f(v[0], v[1], v[2]),
+                Vector3f(v[3], v[4], v[5]), Vector3f(v[6], v[7], v[8]));
+            change = [this, cameraToWorld] { m_scene->getCamera()->setCameraToWorld(cameraToWorld); };
+        } else if (command == "camera") {
+            std::string id;
+            is >> id;
+            const std::vector<Camera *> &cameras = m_scene->getCameras();
+            auto it = std::find_if(cameras.begin(), cameras.end(), [&](const Camera *c) { return c->getId() == id; });
+            if (it == cameras.end())
+                throw Exception("The scene has no camera with id \"{}\"", id);
+            Camera *camera = *it;
+            change = [this, camera] { m_scene->setCamera(camera); };
+        } else if (command == "resolution") {
+            Vector2i size;
+            if (!(is >> size.x() >> size.y()) || (size.array() <= 0).any())
+                throw Exception("resolution expects a width and a height");
+            change = [this, size] { m_scene->getCamera()->setOutputSize(size); };
+        } else if (command == "spp" || command == "pass-spp") {
+            int value;
+            if (!(is >> value) || value <= 0)
+                throw Exception("{} expects a positive number", command);
+            if (command == "spp")
+                change = [this, value] { m_options.targetSampleCount = (uint32_t) value; };
+            else
+                change = [this, value] { m_options.passSampleCount = (uint32_t) value; };
+        } else if (command == "restart") {
+            change = [] { };
+        } else if (command == "quit") {
+            /* Critical section: let the render thread finish */ {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_quit = true;
+                renderer::requestStop();
+            }
+            m_condition.notify_one();
+            return;
+        } else {
+            throw Exception("Unknown command \"{}\"", command);
+        }
+
+        /* Critical section: queue the change and stop the render in flight */ {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_changes.push_back(change);
+            m_restart = true;
+            renderer::requestStop();
+        }
+        m_condition.notify_one();
+    }
+
+    Scene *m_scene;
+    renderer::RenderOptions m_options;
+    TevClient m_tev;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<std::function<void()>> m_changes;
+    bool m_restart = false;
+    std::atomic<bool> m_quit { false };
+};
+
+void run(Scene *scene, const renderer::RenderOptions &options, int port, const std::string &tevAddress) {
+    PreviewServer server(scene, options, tevAddress);
+    server.serve(port);
+}
+
+#else
+
+/* The server and the tev client are written against BSD sockets */
+void run(Scene *, const renderer::RenderOptions &, int, const std::string &) {
+    throw Exception("The preview server (--serve) is not available on Windows");
+}
+
+#endif
+
+NAMESPACE_END(server)
+NAMESPACE_END(kazen)
@@ -0,0 +1,126 @@
+#include <kazen/stats.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(stats)
+
+/* Counters of every thread that ever counted something. They are never
+   freed, TBB workers come and go and their counts must survive them */
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<Counters>> registry;
+
+static const char *counterNames[ECounterCount] = {
+    "cameraRays",
+    "intersectRays",
+    "shadowRays",
+    "bsdfEval",
+    "bsdfSample",
+    "bsdfPdf",
+    "textureLookups",
+    "russianRoulette"
+};
+
+static const char *counterLabels[ECounterCount] = {
+    "Camera rays",
+    "Intersection queries",
+    "Shadow queries",
+    "BSDF evaluations",
+    "BSDF samples",
+    "BSDF pdfs",
+    "Texture lookups",
+    "Russian roulette kills"
+};
+
+Counters &Counters::operator+=(const Counters &other) {
+    for (int i = 0; i < ECounterCount; ++i)
+        counters[i] += other.counters[i];
+    for (int i = 0; i < PathLengthBins; ++i)
+        pathLengths[i] += other.pathLengths[i];
+    bounces += other.bounces;
+    return *this;
+}
+
+Counters &local() {
+    static thread_local Counters *counters = nullptr;
+    if (unlikely(!counters)) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.emplace_back(new Counters());
+        counters = registry.back().get();
+    }
+    return *counters;
+}
+
+void reset() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (auto &counters : registry)
+        *counters = Counters();
+}
+
+Counters collect() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    Counters result;
+    for (auto &counters : registry)
+        result += *counters;
+    return result;
+}
+
+/* Rays traced per second in millions */
+static double mrays(const Counters &c, double seconds) {
+    uint64_t rays = c.counters[EIntersectRays] + c.counters[EShadowRays];
+    return seconds > 0.0 ? rays / seconds * 1e-6 : 0.0;
+}
+
+/* Number of used histogram bins */
+static int pathLengthBins(const Counters &c) {
+    int bins = PathLengthBins;
+    while (bins > 0 && c.pathLengths[bins - 1] == 0)
+        --bins;
+    return bins;
+}
+
+std::string toString(const Counters &c, double seconds) {
+    std::string result = fmt::format("Render statistics ({:.2f} s):\n", seconds);
+    for (int i = 0; i < ECounterCount; ++i)
+        result += fmt::format("  {:<26} {:>16}\n", counterLabels[i], c.counters[i]);
+    result += fmt::format("  {:<26} {:>16.2f}\n", "Mrays/s", mrays(c, seconds));
+
+    uint64_t paths = 0;
+    for (int i = 0; i < PathLengthBins; ++i)
+        paths += c.pathLengths[i];
+    if (paths > 0) {
+        result += fmt::format("  {:<26} {:>16.2f}\n", "Average path length", c.bounces / (double) paths);
+        result += "  Path lengths (bounces):\n";
+        for (int i = 0, bins = pathLengthBins(c); i < bins; ++i)
+            result += fmt::format("    {:>3}{} {:>16} ({:5.1f}%)\n", i, i == PathLengthBins - 1 ? "+" : " ",
+                                  c.pathLengths[i], 100.0 * c.pathLengths[i] / paths);
+    }
+    return result;
+}
+
+std::string toJSON(const Counters &c, double seconds) {
+    std::string result = "{\n";
+    result += fmt::format("  \"seconds\": {:.3f},\n", seconds);
+    for (int i = 0; i < ECounterCount; ++i)
+        result += fmt::format("  \"{}\": {},\n", counterNames[i], c.counters[i]);
+    result += fmt::format("  \"mraysPerSecond\": {:.3f},\n", mrays(c, seconds));
+    result += fmt::format("  \"bounces\": {},\n", c.bounces);
+    result += "  \"pathLengths\": [";
+    for (int i = 0, bins = pathLengthBins(c); i < bins; ++i)
+        result += fmt::format("{}{}", i > 0 ? ", " : "", c.pathLengths[i]);
+    result += "]\n}\n";
+    return result;
+}
+
+void report(const std::string &basename, double seconds) {
+    Counters counters = collect();
+    std::string text = toString(counters, seconds);
+    LOG("{}", text.substr(0, text.size() - 1));
+
+    std::ofstream(basename + "_stats.txt") << text;
+    std::ofstream(basename + "_stats.json") << toJSON(counters, seconds);
+}
+
+NAMESPACE_END(stats)
+NAMESPACE_END(kazen)
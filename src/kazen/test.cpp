@@ -1,7 +1,67 @@
-using namespace std;
+#include <kazen/test.h>
+#include <cstdlib>
+#include <random>
 
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(test)
 
-int main() {
-    return 0;
+struct TestCase {
+    const char *name;
+    void (*func)();
+};
+
+/* Constructed on first use, registrations run during static initialization */
+static std::vector<TestCase> &registry() {
+    static std::vector<TestCase> tests;
+    return tests;
+}
+
+static int failures = 0;
+
+Registration::Registration(const char *name, void (*func)()) {
+    registry().push_back({name, func});
 }
 
+void fail(const char *file, int line, const std::string &message) {
+    cerr << file << ":" << line << ": check failed: " << message << endl;
+    ++failures;
+}
+
+int run(const std::string &filter) {
+    int testCount = 0, failedTests = 0;
+    for (const TestCase &test : registry()) {
+        if (!filter.empty() && std::string(test.name).find(filter) == std::string::npos)
+            continue;
+
+        ++testCount;
+        int before = failures;
+        try {
+            test.func();
+        } catch (const std::exception &e) {
+            fail(test.name, 0, fmt::format("unexpected exception: {}", e.what()));
+        }
+
+        bool passed = failures == before;
+        cout << (passed ? "[ OK ] " : "[FAIL] ") << test.name << endl;
+        if (!passed)
+            ++failedTests;
+    }
+
+    cout << fmt::format("{}/{} tests passed", testCount - failedTests, testCount) << endl;
+    return failedTests;
+}
+
+std::string tempFilename(const std::string &name) {
+    static const uint32_t run = std::random_device()();
+    const char *dir = std::getenv("TMPDIR");
+    if (!dir)
+        dir = std::getenv("TEMP");
+    return fmt::format("{}/kazen_test_{:08x}_{}", dir ? dir : "/tmp", run, name);
+}
+
+NAMESPACE_END(test)
+NAMESPACE_END(kazen)
+
+int main(int argc, char **argv) {
+    return kazen::test::run(argc > 1 ? argv[1] : "") == 0 ? 0 : 1;
+}
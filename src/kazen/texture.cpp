@@ -1,5 +1,7 @@
 #include <kazen/object.h>
 #include <kazen/texture.h>
+#include <kazen/stats.h>
+#include <kazen/profiler.h>
 #include <OpenImageIO/imageio.h>
 #include <filesystem/resolver.h>
 
@@ -13,11 +15,11 @@ public:
         m_color = props.getColor("color", Color3f(0.5f));
     }
 
-    Color3f eval(const Point2f &uv) const override {
+    Color3f eval(const Point2f &) const override {
         return m_color;
     }
 
-    Color3f eval(const Vector3f &dir) const override {
+    Color3f eval(const Vector3f &) const override {
         return m_color;
     }
 
@@ -48,7 +50,9 @@ public:
         options.swrap = OIIO::TextureOpt::WrapPeriodic;
         options.twrap = OIIO::TextureOpt::WrapPeriodic;
 
+        KAZEN_PROFILE("ImageTexture::eval");
         float color[3] = {0.5f, 0.5f, 1.0f};
+        stats::add(stats::ETextureLookups);
         getTextureSystem()->texture(
             m_filename,
             options,
@@ -68,8 +72,10 @@ public:
         options.swrap = OIIO::TextureOpt::WrapPeriodic;
         options.twrap = OIIO::TextureOpt::WrapPeriodic;
 
+        KAZEN_PROFILE("ImageTexture::eval");
         float color[3] = {0.0f, 0.0f, 0.0f};
         Imath::V3f dir(dir_.x(), dir_.y(), dir_.z());
+        stats::add(stats::ETextureLookups);
         getTextureSystem()->environment(
             m_filename,
             options,
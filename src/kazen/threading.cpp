@@ -0,0 +1,108 @@
+#include <kazen/threading.h>
+#include <tbb/global_control.h>
+#include <tbb/info.h>
+#include <OpenImageIO/imageio.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+NAMESPACE_BEGIN(kazen)
+NAMESPACE_BEGIN(threading)
+
+static int threadLimit = 0;
+static bool pinning = false;
+static std::unique_ptr<tbb::global_control> parallelismControl;
+
+/* Cores that the process is allowed to run on */
+static std::vector<int> availableCores() {
+    std::vector<int> cores;
+#if defined(__linux__)
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &mask))
+                cores.push_back(cpu);
+    }
+#endif
+    return cores;
+}
+
+void configure(int threadCount, bool pinThreads) {
+    threadLimit = std::max(0, threadCount);
+    pinning = pinThreads;
+
+    /* Caps every arena, including the ones embree builds on with TBB tasking */
+    parallelismControl.reset();
+    if (threadLimit > 0)
+        parallelismControl.reset(new tbb::global_control(
+            tbb::global_control::max_allowed_parallelism, (size_t) threadLimit));
+
+    OIIO::attribute("threads", getThreadCount());
+    LOG("Threads: {}{}", getThreadCount(), pinning ? " (pinned)" : "");
+}
+
+int getThreadCount() {
+    return threadLimit > 0 ? threadLimit : tbb::info::default_concurrency();
+}
+
+bool getPinThreads() {
+    return pinning;
+}
+
+std::string getEmbreeConfig() {
+    std::string config = fmt::format("threads={}", threadLimit);
+    if (pinning)
+        config += ",set_affinity=1";
+    return config;
+}
+
+#if defined(__linux__)
+/* Pins every thread entering the observed arena to a core */
+class CorePinning : public tbb::task_scheduler_observer {
+public:
+    CorePinning(tbb::task_arena &arena, int firstCore)
+        : tbb::task_scheduler_observer(arena), m_cores(availableCores()), m_firstCore(firstCore) {
+        observe(true);
+    }
+
+    ~CorePinning() {
+        observe(false);
+    }
+
+    void on_scheduler_entry(bool) override {
+        int slot = tbb::this_task_arena::current_thread_index();
+        if (m_cores.empty() || slot < 0)
+            return;
+
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(m_cores[(m_firstCore + slot) % m_cores.size()], &mask);
+        sched_setaffinity(0, sizeof(mask), &mask);
+    }
+
+    void on_scheduler_exit(bool) override {
+        /* Workers may serve other arenas next, let them run anywhere again */
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        for (int core : m_cores)
+            CPU_SET(core, &mask);
+        sched_setaffinity(0, sizeof(mask), &mask);
+    }
+
+private:
+    std::vector<int> m_cores;
+    int m_firstCore;
+};
+#endif
+
+std::unique_ptr<tbb::task_scheduler_observer> pinArena(tbb::task_arena &arena, int firstCore) {
+#if defined(__linux__)
+    if (pinning)
+        return std::unique_ptr<tbb::task_scheduler_observer>(new CorePinning(arena, firstCore));
+#endif
+    return nullptr;
+}
+
+NAMESPACE_END(threading)
+NAMESPACE_END(kazen)
@@ -0,0 +1,147 @@
+#include <kazen/test.h>
+#include <kazen/accel.h>
+#include <kazen/parser.h>
+#include <kazen/scene.h>
+#include <fstream>
+#include <random>
+
+using namespace kazen;
+
+/*
+ * Three spheres placed as meshes, one of them hidden from camera rays and
+ * one from shadow rays. With instances, a shape group of two spheres (one
+ * hidden from shadow rays) is placed three times with non-uniform scales.
+ */
+static std::string sceneXML(const std::string &accel, bool instances, const std::vector<std::string> &meshes) {
+    std::string xml =
+        "<scene>\n"
+        "  <string name=\"accel\" value=\"" + accel + "\"/>\n"
+        "  <integrator type=\"normals\"/>\n"
+        "  <camera type=\"perspective\"/>\n"
+        "  <mesh type=\"obj\">\n"
+        "    <string name=\"filename\" value=\"" + meshes[0] + "\"/>\n"
+        "  </mesh>\n"
+        "  <mesh type=\"obj\">\n"
+        "    <string name=\"filename\" value=\"" + meshes[1] + "\"/>\n"
+        "    <boolean name=\"visibleCamera\" value=\"false\"/>\n"
+        "    <transform name=\"toWorld\"><scale value=\"0.5 1 2\"/><translate value=\"2 0 0\"/></transform>\n"
+        "  </mesh>\n"
+        "  <mesh type=\"obj\">\n"
+        "    <string name=\"filename\" value=\"" + meshes[2] + "\"/>\n"
+        "    <boolean name=\"visibleShadow\" value=\"false\"/>\n"
+        "    <transform name=\"toWorld\"><translate value=\"-1.5 1 0.5\"/></transform>\n"
+        "  </mesh>\n";
+    if (instances) {
+        xml +=
+            "  <shapegroup id=\"group\">\n"
+            "    <mesh type=\"obj\">\n"
+            "      <string name=\"filename\" value=\"" + meshes[3] + "\"/>\n"
+            "      <transform name=\"toWorld\"><scale value=\"0.4 0.4 0.4\"/></transform>\n"
+            "    </mesh>\n"
+            "    <mesh type=\"obj\">\n"
+            "      <string name=\"filename\" value=\"" + meshes[4] + "\"/>\n"
+            "      <boolean name=\"visibleShadow\" value=\"false\"/>\n"
+            "      <transform name=\"toWorld\"><scale value=\"0.3 0.3 0.3\"/><translate value=\"0.8 0 0\"/></transform>\n"
+            "    </mesh>\n"
+            "  </shapegroup>\n";
+        const char *placements[] = {
+            "<scale value=\"1 3 1\"/><translate value=\"0 -3 0\"/>",
+            "<scale value=\"2 0.5 1\"/><rotate axis=\"0 0 1\" angle=\"30\"/><translate value=\"0 3 1\"/>",
+            "<rotate axis=\"1 1 0\" angle=\"-45\"/><scale value=\"0.5 0.5 3\"/><translate value=\"-3 -2 -1\"/>"
+        };
+        for (const char *placement : placements)
+            xml += std::string("  <instance>\n"
+                               "    <string name=\"shapegroup\" value=\"group\"/>\n"
+                               "    <transform name=\"toWorld\">") + placement + "</transform>\n"
+                               "  </instance>\n";
+    }
+    return xml + "</scene>\n";
+}
+
+static std::unique_ptr<Scene> loadScene(const std::string &accel, bool instances,
+                                        const std::vector<std::string> &meshes) {
+    std::string filename = test::tempFilename("accel_" + accel + ".xml");
+    std::ofstream(filename) << sceneXML(accel, instances, meshes);
+    std::unique_ptr<Object> root(loadFromXML(filename));
+    std::remove(filename.c_str());
+    return std::unique_ptr<Scene>(static_cast<Scene *>(root.release()));
+}
+
+/* The hit fields that identify a triangle: mesh (by file name), instance
+   (by transformation) and triangle index */
+static bool sameTriangle(const Hit &a, const Hit &b) {
+    if (a.mesh->getName() != b.mesh->getName() || a.primID != b.primID)
+        return false;
+    if (!a.toWorld || !b.toWorld)
+        return !a.toWorld && !b.toWorld;
+    return a.toWorld->getMatrix().isApprox(b.toWorld->getMatrix());
+}
+
+/* Random rays through the scene bounds give the same hits with embree and the
+   built-in BVH, for every ray visibility and for shadow queries. Rays that
+   graze an edge may come out differently, a few of them are tolerated */
+static void compareBackends(bool instances) {
+    std::vector<std::string> meshes;
+    for (int i = 0; i < 5; ++i) {
+        meshes.push_back(test::tempFilename(fmt::format("sphere{}.obj", i)));
+        writeSphereOBJ(meshes.back(), 12 + 4 * i);
+    }
+    std::unique_ptr<Scene> embree = loadScene("embree", instances, meshes);
+    std::unique_ptr<Scene> native = loadScene("bvh", instances, meshes);
+    for (const std::string &mesh : meshes)
+        std::remove(mesh.c_str());
+    KAZEN_CHECK(embree->getAccel()->getOptions().backend == AccelOptions::EEmbree);
+    KAZEN_CHECK(native->getAccel()->getOptions().backend == AccelOptions::ENative);
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> uniform(-1.f, 1.f);
+    const int RayCount = 20000;
+    int queries = 0, hits = 0, occlusions = 0, mismatches = 0;
+    for (int i = 0; i < RayCount; ++i) {
+        Point3f o(4.f * uniform(rng), 4.f * uniform(rng), 4.f * uniform(rng));
+        Vector3f d(uniform(rng), uniform(rng), uniform(rng));
+        if (d.squaredNorm() < 1e-4f)
+            continue;
+        Ray3f ray(o, d.normalized());
+        /* Every other ray ends early, e.g. a shadow ray towards a light */
+        if (i & 1)
+            ray.maxt = 4.f * (uniform(rng) + 1.f);
+
+        for (uint32_t visibility : {EVisibleCamera, EVisibleShadow, EVisibleIndirect}) {
+            Hit a, b;
+            bool hitA = embree->getAccel()->rayIntersect(ray, a, visibility);
+            bool hitB = native->getAccel()->rayIntersect(ray, b, visibility);
+            ++queries;
+            hits += hitA;
+            if (hitA != hitB || (hitA && !sameTriangle(a, b))) {
+                ++mismatches;
+                continue;
+            }
+            if (hitA) {
+                KAZEN_CHECK_CLOSE(a.t, b.t, 1e-4f * std::max(1.f, a.t));
+                KAZEN_CHECK_CLOSE(a.uv.x(), b.uv.x(), 1e-3f);
+                KAZEN_CHECK_CLOSE(a.uv.y(), b.uv.y(), 1e-3f);
+            }
+        }
+
+        bool occludedA = embree->getAccel()->rayOccluded(ray);
+        bool occludedB = native->getAccel()->rayOccluded(ray);
+        ++queries;
+        occlusions += occludedA;
+        if (occludedA != occludedB)
+            ++mismatches;
+    }
+
+    /* The rays have to exercise both outcomes */
+    KAZEN_CHECK(hits > 0 && hits < queries);
+    KAZEN_CHECK(occlusions > 0 && occlusions < RayCount);
+    KAZEN_CHECK(mismatches <= queries / 1000);
+}
+
+KAZEN_TEST(nativeBVHMatchesEmbree) {
+    compareBackends(false);
+}
+
+KAZEN_TEST(nativeBVHMatchesEmbreeWithInstances) {
+    compareBackends(true);
+}
@@ -0,0 +1,156 @@
+#include <kazen/test.h>
+#include <kazen/bitmap.h>
+#include <kazen/block.h>
+#include <tbb/parallel_for.h>
+#include <limits>
+#include <mutex>
+
+using namespace kazen;
+
+/* A block as handed out by a generator */
+struct HandedBlock {
+    Point2i offset;
+    Vector2i size;
+    int index;
+    int repetition;
+};
+
+/* Pull all blocks from several threads at once */
+template <typename Next> static std::vector<HandedBlock> drain(int blockSize, Next next) {
+    std::vector<HandedBlock> handed;
+    std::mutex mutex;
+    tbb::parallel_for(0, 16, [&](int worker) {
+        ImageBlock block(Vector2i(blockSize), nullptr);
+        int index, repetition;
+        while (next(block, worker, index, repetition)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            handed.push_back({block.getOffset(), block.getSize(), index, repetition});
+        }
+    });
+    return handed;
+}
+
+/* Every pixel of the region is covered exactly once per repetition, and every
+   (index, repetition) pair is handed out exactly once */
+static void checkCoverage(const std::vector<HandedBlock> &handed, const Vector2i &size, const Point2i &offset,
+                          int blockCount, int repeatCount) {
+    KAZEN_CHECK_EQUAL(handed.size(), (size_t) blockCount * repeatCount);
+
+    std::vector<int> coverage((size_t) size.prod() * repeatCount, 0);
+    std::vector<int> handouts((size_t) blockCount * repeatCount, 0);
+    for (const HandedBlock &b : handed) {
+        KAZEN_CHECK(b.index >= 0 && b.index < blockCount);
+        KAZEN_CHECK(b.repetition >= 0 && b.repetition < repeatCount);
+        KAZEN_CHECK(b.size.x() > 0 && b.size.y() > 0);
+        if (b.index < 0 || b.index >= blockCount || b.repetition < 0 || b.repetition >= repeatCount)
+            continue;
+        handouts[(size_t) b.repetition * blockCount + b.index]++;
+
+        for (int y = 0; y < b.size.y(); ++y) {
+            for (int x = 0; x < b.size.x(); ++x) {
+                Point2i p = b.offset + Vector2i(x, y) - offset;
+                bool inside = p.x() >= 0 && p.y() >= 0 && p.x() < size.x() && p.y() < size.y();
+                KAZEN_CHECK(inside);
+                if (inside)
+                    coverage[(size_t) b.repetition * size.prod() + p.y() * size.x() + p.x()]++;
+            }
+        }
+    }
+
+    KAZEN_CHECK(std::all_of(coverage.begin(), coverage.end(), [](int c) { return c == 1; }));
+    KAZEN_CHECK(std::all_of(handouts.begin(), handouts.end(), [](int c) { return c == 1; }));
+}
+
+/* Concurrent workers get every block once per repetition (sample range of a
+   split block), with and without split tail blocks */
+KAZEN_TEST(blockGeneratorHandsOutEveryBlockOnce) {
+    const Vector2i sizes[] = { Vector2i(203, 117), Vector2i(32, 32), Vector2i(7, 300), Vector2i(1, 1) };
+    for (const Vector2i &size : sizes) {
+        for (int splitCount : {0, 1, 4, 1000}) {
+            for (int repeatCount : {1, 3, 64}) {
+                Point2i offset(5, 9);
+                BlockGenerator generator(size, 32, splitCount, offset);
+                generator.reset(repeatCount);
+                auto handed = drain(32, [&](ImageBlock &block, int, int &index, int &repetition) {
+                    return generator.next(block, &index, &repetition);
+                });
+                checkCoverage(handed, size, offset, generator.getBlockCount(), repeatCount);
+
+                /* Exhausted until reset, which starts over with a single repetition */
+                ImageBlock block(Vector2i(32), nullptr);
+                KAZEN_CHECK(!generator.next(block));
+                generator.reset();
+                int index, repetition;
+                for (int i = 0; i < generator.getBlockCount(); ++i) {
+                    KAZEN_CHECK(generator.next(block, &index, &repetition));
+                    KAZEN_CHECK_EQUAL(repetition, 0);
+                }
+                KAZEN_CHECK(!generator.next(block));
+            }
+        }
+    }
+}
+
+/* Bands of a NUMA split number their blocks consecutively and cover the image once */
+KAZEN_TEST(blockQueuesHandOutEveryBlockOnce) {
+    Vector2i size(150, 333);
+    Point2i offset(0, 17);
+    for (int queueCount : {1, 2, 3, 64}) {
+        for (int repeatCount : {1, 5}) {
+            BlockQueues queues(size, 16, 4, queueCount, offset);
+            KAZEN_CHECK(queues.getQueueCount() >= 1 && queues.getQueueCount() <= queueCount);
+            queues.reset(repeatCount);
+            auto handed = drain(16, [&](ImageBlock &block, int worker, int &index, int &repetition) {
+                return queues.next(block, worker % queues.getQueueCount(), &index, &repetition);
+            });
+            checkCoverage(handed, size, offset, queues.getBlockCount(), repeatCount);
+        }
+    }
+}
+
+/* NaN and infinite sums in a partial render stay out of the merged image,
+   valid ones (also negative ones) are added up */
+KAZEN_TEST(mergeSkipsInvalidPixels) {
+    const Vector2i size(4, 3);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const float inf = std::numeric_limits<float>::infinity();
+    ImageBlock partial(size, nullptr);
+    partial.clear();
+    for (int y = 0; y < size.y(); ++y)
+        for (int x = 0; x < size.x(); ++x)
+            partial.coeffRef(y, x) = Color4f(0.5f, -0.25f, 1.f, 1.f);
+    partial.coeffRef(1, 2) = Color4f(nan, 0.5f, 0.5f, 1.f);
+    partial.coeffRef(2, 0) = Color4f(0.5f, 0.5f, 0.5f, inf);
+
+    std::string filename = test::tempFilename("invalid.exr");
+    partial.saveAccumulation(filename, size);
+    ImageBlock merged(size, nullptr);
+    merged.clear();
+    KAZEN_CHECK(merged.addAccumulation(filename) == size);
+    KAZEN_CHECK(merged.addAccumulation(filename) == size);
+    std::remove(filename.c_str());
+
+    for (int y = 0; y < size.y(); ++y) {
+        for (int x = 0; x < size.x(); ++x) {
+            bool invalid = (y == 1 && x == 2) || (y == 2 && x == 0);
+            Color4f expected = invalid ? Color4f() : Color4f(1.f, -0.5f, 2.f, 2.f);
+            KAZEN_CHECK_CLOSE((merged.coeff(y, x) - expected).abs().maxCoeff(), 0.f, 1e-6f);
+        }
+    }
+}
+
+/* Tonemapping clamps to [0, 1] and maps NaN to black */
+KAZEN_TEST(toSRGB8ClampsInvalidValues) {
+    Bitmap bitmap(Vector2i(2, 1));
+    bitmap(0, 0) = Color3f(std::numeric_limits<float>::quiet_NaN(), -1.f, 2.f);
+    bitmap(0, 1) = Color3f(0.f, 1.f, std::numeric_limits<float>::infinity());
+    uint8_t srgb[6];
+    bitmap.toSRGB8(srgb);
+    const uint8_t black = srgb[3], white = srgb[4];
+    KAZEN_CHECK_EQUAL((int) black, 0);
+    KAZEN_CHECK((int) white >= 254);
+    KAZEN_CHECK_EQUAL((int) srgb[0], (int) black);
+    KAZEN_CHECK_EQUAL((int) srgb[1], (int) black);
+    KAZEN_CHECK_EQUAL((int) srgb[2], (int) white);
+    KAZEN_CHECK_EQUAL((int) srgb[5], (int) white);
+}
@@ -0,0 +1,110 @@
+#include <kazen/test.h>
+#include <kazen/mesh.h>
+#include <kazen/transform.h>
+#include <Eigen/Geometry>
+#include <Eigen/LU>
+#include <fstream>
+
+using namespace kazen;
+
+/* A tilted quad with texture coordinates and shading normals that differ
+   from the face normal, or only its positions */
+static std::unique_ptr<Mesh> loadQuad(bool attributes = true) {
+    std::string filename = test::tempFilename("quad.obj");
+    std::ofstream(filename) <<
+        "v 0 0 0\nv 1 0 0.2\nv 1 1 0.5\nv 0 1 0.3\n" <<
+        (attributes ? "vt 0 0\nvt 1 0\nvt 1 1\nvt 0 1\n"
+                      "vn 0.3 0.1 1\nvn -0.2 0.2 1\nvn 0 -0.4 1\nvn 0.5 0.5 1\n"
+                      "f 1/1/1 2/2/2 3/3/3 4/4/4\n"
+                    : "f 1 2 3 4\n");
+    PropertyList propList;
+    propList.setString("filename", filename);
+    std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(ObjectFactory::createInstance("obj", propList)));
+    std::remove(filename.c_str());
+    mesh->activate();
+    return mesh;
+}
+
+static void checkFrame(const Frame &frame) {
+    KAZEN_CHECK_CLOSE(frame.n.norm(), 1.f, 1e-5f);
+    KAZEN_CHECK_CLOSE(frame.s.norm(), 1.f, 1e-5f);
+    KAZEN_CHECK_CLOSE(frame.s.dot(frame.n), 0.f, 1e-5f);
+    KAZEN_CHECK_CLOSE((frame.t - frame.n.cross(frame.s)).norm(), 0.f, 1e-5f);
+}
+
+/* Instances transform points and tangents with their matrix and normals with
+   its inverse transpose, also when the scale differs between the axes */
+KAZEN_TEST(instanceFramesUnderNonUniformScale) {
+    std::unique_ptr<Mesh> mesh = loadQuad();
+    KAZEN_CHECK_EQUAL(mesh->getTriangleCount(), 2u);
+
+    Eigen::Affine3f affine = Eigen::Translation3f(1.f, -2.f, 3.f) *
+        Eigen::AngleAxisf(0.7f, Eigen::Vector3f(1.f, 2.f, -1.f).normalized()) *
+        Eigen::Scaling(0.5f, 4.f, 1.5f);
+    Transform toWorld(affine.matrix());
+    Eigen::Matrix3f linear = affine.linear();
+    Eigen::Matrix3f normalMatrix = linear.inverse().transpose();
+
+    for (uint32_t primID = 0; primID < mesh->getTriangleCount(); ++primID) {
+        for (Point2f uv : {Point2f(0.2f, 0.3f), Point2f(0.6f, 0.1f), Point2f(0.05f, 0.9f)}) {
+            Hit hit;
+            hit.t = 1.f;
+            hit.uv = uv;
+            hit.primID = primID;
+            hit.mesh = mesh.get();
+
+            Intersection local, world;
+            mesh->computeIntersection(hit, local);
+            hit.toWorld = &toWorld;
+            mesh->computeIntersection(hit, world);
+
+            KAZEN_CHECK_CLOSE((world.p - toWorld * local.p).norm(), 0.f, 1e-4f);
+            KAZEN_CHECK_CLOSE((world.dpdu - linear * local.dpdu).norm(), 0.f, 1e-4f);
+            KAZEN_CHECK_CLOSE((world.dpdv - linear * local.dpdv).norm(), 0.f, 1e-4f);
+
+            /* Normals stay perpendicular to the transformed surface */
+            Vector3f geoNormal = (normalMatrix * local.geoFrame.n).normalized();
+            Vector3f shNormal = (normalMatrix * local.shFrame.n).normalized();
+            KAZEN_CHECK_CLOSE((world.geoFrame.n - geoNormal).norm(), 0.f, 1e-5f);
+            KAZEN_CHECK_CLOSE((world.shFrame.n - shNormal).norm(), 0.f, 1e-5f);
+            KAZEN_CHECK_CLOSE(world.geoFrame.n.dot(world.dpdu), 0.f, 1e-4f);
+            KAZEN_CHECK_CLOSE(world.geoFrame.n.dot(world.dpdv), 0.f, 1e-4f);
+
+            /* The shading tangent follows dp/du, made orthogonal to the normal */
+            checkFrame(world.geoFrame);
+            checkFrame(world.shFrame);
+            Vector3f s = linear * local.shFrame.s;
+            s = (s - shNormal * shNormal.dot(s)).normalized();
+            KAZEN_CHECK_CLOSE((world.shFrame.s - s).norm(), 0.f, 1e-5f);
+        }
+    }
+}
+
+/* Without shading normals there is no terminator offset, the hit point lies
+   on the triangle and both frames follow its face normal */
+KAZEN_TEST(intersectionWithoutNormals) {
+    std::unique_ptr<Mesh> mesh = loadQuad(false);
+    KAZEN_CHECK_EQUAL(mesh->getTriangleCount(), 2u);
+    KAZEN_CHECK_EQUAL(mesh->getVertexNormals().size(), 0);
+
+    const MatrixXf &V = mesh->getVertexPositions();
+    const MatrixXu &F = mesh->getIndices();
+    for (uint32_t primID = 0; primID < mesh->getTriangleCount(); ++primID) {
+        Hit hit;
+        hit.t = 1.f;
+        hit.uv = Point2f(0.3f, 0.2f);
+        hit.primID = primID;
+        hit.mesh = mesh.get();
+
+        Intersection its;
+        mesh->computeIntersection(hit, its);
+        Point3f p0 = V.col(F(0, primID)), p1 = V.col(F(1, primID)), p2 = V.col(F(2, primID));
+        Point3f p = 0.5f * p0 + 0.3f * p1 + 0.2f * p2;
+        KAZEN_CHECK_CLOSE((its.p - p).norm(), 0.f, 1e-5f);
+
+        Vector3f n = (p1 - p0).cross(p2 - p0).normalized();
+        KAZEN_CHECK_CLOSE((its.geoFrame.n - n).norm(), 0.f, 1e-5f);
+        KAZEN_CHECK_CLOSE((its.shFrame.n - n).norm(), 0.f, 1e-5f);
+        checkFrame(its.shFrame);
+    }
+}
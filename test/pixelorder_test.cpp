@@ -0,0 +1,59 @@
+#include <kazen/test.h>
+#include <kazen/block.h>
+#include <kazen/renderer.h>
+
+using namespace kazen;
+
+/* Both curves visit every cell of their square exactly once */
+KAZEN_TEST(curveDecodeCoversSquare) {
+    for (uint32_t n = 1; n <= 256; n *= 2) {
+        std::vector<int> morton(n * n, 0), hilbert(n * n, 0);
+        uint32_t lastX = 0, lastY = 0;
+        for (uint32_t d = 0; d < n * n; ++d) {
+            uint32_t x, y;
+            math::mortonDecode(d, x, y);
+            KAZEN_CHECK(x < n && y < n);
+            if (x < n && y < n)
+                morton[y * n + x]++;
+
+            math::hilbertDecode(n, d, x, y);
+            KAZEN_CHECK(x < n && y < n);
+            if (x < n && y < n)
+                hilbert[y * n + x]++;
+
+            /* Consecutive positions along the Hilbert curve are neighbors */
+            if (d > 0)
+                KAZEN_CHECK_EQUAL(std::abs((int) x - (int) lastX) + std::abs((int) y - (int) lastY), 1);
+            lastX = x;
+            lastY = y;
+        }
+        KAZEN_CHECK(std::all_of(morton.begin(), morton.end(), [](int c) { return c == 1; }));
+        KAZEN_CHECK(std::all_of(hilbert.begin(), hilbert.end(), [](int c) { return c == 1; }));
+    }
+}
+
+/* Every traversal order visits each pixel of full and partial blocks exactly once */
+KAZEN_TEST(blockPixelsCoverBlock) {
+    const Vector2i sizes[] = { Vector2i(32, 32), Vector2i(16, 16), Vector2i(17, 5), Vector2i(1, 9), Vector2i(1, 1) };
+    for (auto order : {renderer::RenderOptions::EScanline, renderer::RenderOptions::EMorton,
+                       renderer::RenderOptions::EHilbert}) {
+        for (const Vector2i &size : sizes) {
+            ImageBlock block(Vector2i(32), nullptr);
+            block.setOffset(Point2i(64, 96));
+            block.setSize(size);
+
+            std::vector<Point2i> pixels = renderer::blockPixels(block, order);
+            KAZEN_CHECK_EQUAL(pixels.size(), (size_t) size.prod());
+
+            std::vector<int> coverage(size.prod(), 0);
+            for (const Point2i &p : pixels) {
+                Point2i local = p - block.getOffset();
+                bool inside = local.x() >= 0 && local.y() >= 0 && local.x() < size.x() && local.y() < size.y();
+                KAZEN_CHECK(inside);
+                if (inside)
+                    coverage[local.y() * size.x() + local.x()]++;
+            }
+            KAZEN_CHECK(std::all_of(coverage.begin(), coverage.end(), [](int c) { return c == 1; }));
+        }
+    }
+}
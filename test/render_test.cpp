@@ -0,0 +1,184 @@
+#include <kazen/test.h>
+#include <kazen/bitmap.h>
+#include <kazen/integrator.h>
+#include <kazen/output.h>
+#include <kazen/parser.h>
+#include <kazen/renderer.h>
+#include <kazen/sampler.h>
+#include <kazen/scene.h>
+#include <atomic>
+#include <fstream>
+#include <limits>
+
+using namespace kazen;
+
+/* Sample values that only depend on the pixel and the sample index. Stops
+   all renders once a given number of samples has been taken */
+class StoppingIntegrator : public Integrator {
+public:
+    StoppingIntegrator(const PropertyList &) { }
+
+    Color3f Li(const Scene *, Sampler *sampler, const Ray3f &) const {
+        if (++sampleCount == stopAfter)
+            renderer::requestStop();
+        float r = sampler->next1D(), g = sampler->next1D(), b = sampler->next1D();
+        return Color3f(r, g, b);
+    }
+
+    std::string toString() const {
+        return "StoppingIntegrator[]";
+    }
+
+    static std::atomic<uint64_t> sampleCount;
+    static uint64_t stopAfter;
+};
+
+std::atomic<uint64_t> StoppingIntegrator::sampleCount(0);
+uint64_t StoppingIntegrator::stopAfter = 0;
+
+KAZEN_REGISTER_CLASS(StoppingIntegrator, "test_stopping");
+
+/* Keeps the final frame buffer of a render */
+class Capture : public renderer::RenderObserver {
+public:
+    void blockDone(const ImageBlock &, const Point2i &, const Vector2i &) { }
+    void renderDone(const ImageBlock &result) { image.reset(result.toBitmap()); }
+
+    std::unique_ptr<Bitmap> image;
+};
+
+static const Vector2i ImageSize(128, 96);
+static const uint32_t SampleCount = 8;
+
+static std::unique_ptr<Scene> loadScene() {
+    std::string filename = test::tempFilename("render.xml");
+    std::ofstream(filename) << fmt::format(
+        "<scene>\n"
+        "  <integrator type=\"test_stopping\"/>\n"
+        "  <sampler type=\"independent\"><integer name=\"sampleCount\" value=\"{}\"/></sampler>\n"
+        "  <camera type=\"perspective\">\n"
+        "    <integer name=\"width\" value=\"{}\"/><integer name=\"height\" value=\"{}\"/>\n"
+        "  </camera>\n"
+        "</scene>\n", SampleCount, ImageSize.x(), ImageSize.y());
+    std::unique_ptr<Object> root(loadFromXML(filename));
+    std::remove(filename.c_str());
+    KAZEN_CHECK(root->getClassType() == Object::EScene);
+    return std::unique_ptr<Scene>(static_cast<Scene *>(root.release()));
+}
+
+/* Render to a temporary file (whose extension is replaced), stopping after
+   the given number of samples (0: never) */
+static std::unique_ptr<Bitmap> renderImage(Scene *scene, const std::string &name, renderer::RenderOptions options,
+                                           uint64_t stopAfter) {
+    StoppingIntegrator::sampleCount = 0;
+    StoppingIntegrator::stopAfter = stopAfter;
+    options.exrFormat = renderer::RenderOptions::ENoEXR;
+
+    std::string filename = test::tempFilename(name);
+    Capture capture;
+    renderer::render(scene, filename, options, &capture);
+    renderer::clearStop();
+    KAZEN_CHECK(output::wait());
+    std::remove((filename.substr(0, filename.find_last_of(".")) + ".png").c_str());
+    return std::move(capture.image);
+}
+
+/* Largest difference of a channel between two images of the same size */
+static float maxDifference(const Bitmap &a, const Bitmap &b) {
+    KAZEN_CHECK_EQUAL(a.cols(), b.cols());
+    KAZEN_CHECK_EQUAL(a.rows(), b.rows());
+    if (a.cols() != b.cols() || a.rows() != b.rows())
+        return std::numeric_limits<float>::infinity();
+    float difference = 0.f;
+    for (Eigen::Index y = 0; y < a.rows(); ++y)
+        for (Eigen::Index x = 0; x < a.cols(); ++x)
+            difference = std::max(difference, (a(y, x) - b(y, x)).abs().maxCoeff());
+    return difference;
+}
+
+/* A render that is stopped in the middle of a pass and resumed from its
+   checkpoint equals one that was never interrupted, for every accumulation */
+KAZEN_TEST(checkpointResumeMatchesUninterruptedRender) {
+    std::unique_ptr<Scene> scene = loadScene();
+    using RenderOptions = renderer::RenderOptions;
+    for (RenderOptions::EAccumulation accumulation :
+         {RenderOptions::ELocked, RenderOptions::EStriped, RenderOptions::EPerThread}) {
+        RenderOptions options;
+        options.progressive = true;
+        options.passSampleCount = 2;
+        options.blockSize = 8;
+        options.sampleSplitting = false;
+        options.accumulation = accumulation;
+
+        std::unique_ptr<Bitmap> reference = renderImage(scene.get(), "reference.exr", options, 0);
+
+        /* Stop about halfway through the second pass */
+        options.checkpointInterval = 1000.f;
+        uint64_t passSamples = (uint64_t) ImageSize.prod() * options.passSampleCount;
+        renderImage(scene.get(), "resumed.exr", options, passSamples + passSamples / 2);
+        std::string checkpointName = test::tempFilename("resumed.ckpt");
+        KAZEN_CHECK(std::ifstream(checkpointName).good());
+
+        options.resume = true;
+        std::unique_ptr<Bitmap> resumed = renderImage(scene.get(), "resumed.exr", options, 0);
+        KAZEN_CHECK(!std::ifstream(checkpointName).good());
+        std::remove(checkpointName.c_str());
+
+        KAZEN_CHECK(reference && resumed);
+        if (reference && resumed)
+            KAZEN_CHECK_CLOSE(maxDifference(*reference, *resumed), 0.f, 1e-4f);
+    }
+}
+
+/* A small image whose blocks are split into sample ranges across the workers
+   gives the same image as one rendered block by block */
+KAZEN_TEST(sampleSplittingMatchesBlockRender) {
+    std::unique_ptr<Scene> scene = loadScene();
+    renderer::RenderOptions options;
+    options.blockSize = 64;
+    options.sampleSplitting = false;
+    std::unique_ptr<Bitmap> reference = renderImage(scene.get(), "blocks.exr", options, 0);
+    options.sampleSplitting = true;
+    std::unique_ptr<Bitmap> split = renderImage(scene.get(), "split.exr", options, 0);
+
+    KAZEN_CHECK(reference && split);
+    if (reference && split)
+        KAZEN_CHECK_CLOSE(maxDifference(*reference, *split), 0.f, 1e-4f);
+}
+
+/* Summing up partial renders like kazen_merge does gives the image of a
+   single render, for sample ranges as well as for crop windows */
+KAZEN_TEST(mergedPartialsMatchFullRender) {
+    std::unique_ptr<Scene> scene = loadScene();
+    renderer::RenderOptions options;
+    options.sampleSplitting = false;
+    std::unique_ptr<Bitmap> reference = renderImage(scene.get(), "full.exr", options, 0);
+    KAZEN_CHECK(reference != nullptr);
+    if (!reference)
+        return;
+
+    /* Two sample ranges of the full frame, then two crop windows with all samples */
+    std::vector<std::vector<renderer::RenderOptions>> splits(2, std::vector<renderer::RenderOptions>(2, options));
+    splits[0][0].sampleRangeEnd = 3;
+    splits[0][1].sampleRangeBegin = 3;
+    splits[0][1].sampleRangeEnd = SampleCount;
+    splits[1][0].cropSize = Vector2i(ImageSize.x() / 2 + 5, ImageSize.y());
+    splits[1][1].cropOffset = Point2i(ImageSize.x() / 2 + 5, 0);
+    splits[1][1].cropSize = Vector2i(ImageSize.x() / 2 - 5, ImageSize.y());
+
+    for (const auto &partials : splits) {
+        ImageBlock merged(ImageSize, nullptr);
+        merged.clear();
+        for (size_t i = 0; i < partials.size(); ++i) {
+            renderer::RenderOptions partial = partials[i];
+            partial.partial = true;
+            std::string filename = test::tempFilename(fmt::format("partial{}.exr", i));
+            renderer::render(scene.get(), filename, partial);
+            KAZEN_CHECK(merged.addAccumulation(filename) == ImageSize);
+            std::remove(filename.c_str());
+        }
+
+        std::unique_ptr<Bitmap> bitmap(merged.toBitmap());
+        KAZEN_CHECK_CLOSE(maxDifference(*reference, *bitmap), 0.f, 1e-4f);
+    }
+}